@@ -0,0 +1,46 @@
+#include <cstdlib>
+
+#include "Bench.h"
+
+#include "../src/Database.h"
+#include "../src/Settings.h"
+#include "../src/WebServer.h"
+#include "../src/Controller.h"
+
+namespace micasa {
+
+	// The globals are normally defined by src/micasa.cpp, which isn't linked into the benchmarks.
+	std::unique_ptr<Database> g_database;
+	std::unique_ptr<Settings<>> g_settings;
+	std::unique_ptr<WebServer> g_webServer;
+	std::unique_ptr<Controller> g_controller;
+
+	namespace bench {
+
+		unsigned long argument( int argc_, char** argv_, int index_, unsigned long default_ ) {
+			if ( index_ < argc_ ) {
+				return std::strtoul( argv_[index_], NULL, 10 );
+			}
+			return default_;
+		};
+
+		void start() {
+			if ( ! g_database ) {
+				g_database = std::unique_ptr<Database>( new Database() );
+			}
+			g_settings = std::unique_ptr<Settings<>>( new Settings<> );
+			g_controller = std::unique_ptr<Controller>( new Controller );
+			g_webServer = std::unique_ptr<WebServer>( new WebServer( 0, 0 ) );
+			g_controller->start();
+		};
+
+		void stop() {
+			g_controller->stop();
+			g_webServer = nullptr;
+			g_controller = nullptr;
+			g_settings = nullptr;
+		};
+
+	}; // namespace bench
+
+}; // namespace micasa
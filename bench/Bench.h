@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+// The benchmarks are built with -DBUILD_BENCHMARKS=YES and are not part of the default build. Configure them with
+// -DCMAKE_BUILD_TYPE=Release for representative numbers. Each benchmark prints its results to stdout. Benchmarks that need a database create it in the data directory and remove their own rows
+// afterwards, but should still be run from an empty directory.
+
+namespace micasa {
+
+	namespace bench {
+
+		// Returns the time it takes to run func_, in microseconds.
+		template<class F> double measure( F&& func_ ) {
+			auto start = std::chrono::steady_clock::now();
+			func_();
+			return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - start ).count();
+		};
+
+		// Returns the numeric command line argument at index_, or default_ if it was not passed.
+		unsigned long argument( int argc_, char** argv_, int index_, unsigned long default_ );
+
+		// Creates the global instances in the same order as main does and starts the controller, or stops the
+		// controller and destroys them again. The web server is created but not started. The database is kept.
+		void start();
+		void stop();
+
+	}; // namespace bench
+
+}; // namespace micasa
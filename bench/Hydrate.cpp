@@ -0,0 +1,104 @@
+#include <iostream>
+#include <cstdlib>
+#include <memory>
+
+#include "Bench.h"
+
+#include "../src/Database.h"
+#include "../src/Device.h"
+
+// Measures the bulk hydration of devices and the start of the controller with a large number of devices of each type,
+// each with five settings and a day of history. Usage: bench_hydrate [<devices>]
+
+namespace micasa {
+
+	extern std::unique_ptr<Database> g_database;
+
+}; // namespace micasa
+
+using namespace micasa;
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long devices = bench::argument( argc_, argv_, 1, 5000 );
+
+	g_database = std::unique_ptr<Database>( new Database() );
+	long plugin = g_database->putQuery( "INSERT INTO `plugins` ( `reference`, `type`, `enabled` ) VALUES ( 'bench', 'dummy', 1 )" );
+	g_database->transaction( [&]() {
+		g_database->putQuery(
+			"WITH RECURSIVE `numbers`( `number` ) AS ( SELECT 1 UNION ALL SELECT `number` + 1 FROM `numbers` WHERE `number` < %lu ) "
+			"INSERT INTO `devices` ( `plugin_id`, `reference`, `label`, `type`, `enabled` ) "
+			"SELECT %ld, 'bench' || `number`, 'Bench ' || `number`, CASE `number` %% 4 WHEN 0 THEN 'level' WHEN 1 THEN 'counter' WHEN 2 THEN 'switch' ELSE 'text' END, 1 "
+			"FROM `numbers`",
+			devices,
+			plugin
+		);
+		g_database->putQuery(
+			"WITH RECURSIVE `numbers`( `number` ) AS ( SELECT 1 UNION ALL SELECT `number` + 1 FROM `numbers` WHERE `number` < 4 ) "
+			"INSERT INTO `device_settings` ( `device_id`, `key`, `value` ) "
+			"SELECT `devices`.`id`, 'setting' || `number`, 'value' || `number` "
+			"FROM `devices`, `numbers` "
+			"WHERE `devices`.`plugin_id` = %ld",
+			plugin
+		);
+		g_database->putQuery(
+			"INSERT INTO `device_settings` ( `device_id`, `key`, `value` ) "
+			"SELECT `id`, 'subtype', 'generic' "
+			"FROM `devices` "
+			"WHERE `plugin_id` = %ld",
+			plugin
+		);
+		for ( auto const &table : { "level", "counter" } ) {
+			g_database->putQuery(
+				"WITH RECURSIVE `numbers`( `number` ) AS ( SELECT 0 UNION ALL SELECT `number` + 1 FROM `numbers` WHERE `number` < 287 ) "
+				"INSERT INTO `device_%s_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+				"SELECT `devices`.`id`, ( CAST( strftime( '%%s', 'now' ) AS INTEGER ) / 300 - `number` ) * 300, 10000 - `number`, 1 "
+				"FROM `devices`, `numbers` "
+				"WHERE `devices`.`plugin_id` = %ld "
+				"AND `devices`.`type` = %Q",
+				table,
+				plugin,
+				table
+			);
+		}
+		for ( auto const &table : { "switch", "text" } ) {
+			g_database->putQuery(
+				"WITH RECURSIVE `numbers`( `number` ) AS ( SELECT 0 UNION ALL SELECT `number` + 1 FROM `numbers` WHERE `number` < 47 ) "
+				"INSERT INTO `device_%s_history` ( `device_id`, `timestamp`, `value` ) "
+				"SELECT `devices`.`id`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - `number` * 1800, CASE `number` %% 2 WHEN 0 THEN 'On' ELSE 'Off' END "
+				"FROM `devices`, `numbers` "
+				"WHERE `devices`.`plugin_id` = %ld "
+				"AND `devices`.`type` = %Q",
+				table,
+				plugin,
+				table
+			);
+		}
+		g_database->putQuery(
+			"INSERT INTO `device_state` ( `device_id`, `value`, `timestamp`, `source` ) "
+			"SELECT `id`, CASE WHEN `type` IN ( 'level', 'counter' ) THEN 10000 ELSE 'On' END, CAST( strftime( '%%s', 'now' ) AS INTEGER ), 0 "
+			"FROM `devices` "
+			"WHERE `plugin_id` = %ld",
+			plugin
+		);
+	} );
+
+	unsigned long hydrated = 0;
+	double hydrate = bench::measure( [&]() {
+		hydrated = Device::hydrate().size();
+	} );
+	double start = bench::measure( []() {
+		bench::start();
+	} );
+	double stop = bench::measure( []() {
+		bench::stop();
+	} );
+
+	std::cout << "hydrate " << hydrated << " devices: " << hydrate / 1000. << " ms" << std::endl;
+	std::cout << "start controller: " << start / 1000. << " ms" << std::endl;
+	std::cout << "stop controller: " << stop / 1000. << " ms" << std::endl;
+
+	// The devices, and with them their settings, history and state, are removed by the foreign keys.
+	g_database->putQuery( "DELETE FROM `plugins` WHERE `id`=%ld", plugin );
+	g_database = nullptr;
+	return EXIT_SUCCESS;
+};
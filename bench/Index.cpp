@@ -0,0 +1,92 @@
+#include <iostream>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "Bench.h"
+
+#include "../src/Database.h"
+#include "../src/Controller.h"
+
+// Measures device lookups by id, name and label through the controller, with devices spread over 50 plugins and a
+// name setting for half of them. Usage: bench_index [<devices>] [<lookups>]
+
+#define BENCH_PLUGINS 50
+
+namespace micasa {
+
+	extern std::unique_ptr<Database> g_database;
+	extern std::unique_ptr<Controller> g_controller;
+
+}; // namespace micasa
+
+using namespace micasa;
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long devices = bench::argument( argc_, argv_, 1, 10000 );
+	unsigned long lookups = bench::argument( argc_, argv_, 2, 20000 );
+
+	// The plugins are disabled, their devices are indexed nonetheless.
+	g_database = std::unique_ptr<Database>( new Database() );
+	std::vector<long> plugins;
+	std::vector<long> ids;
+	g_database->transaction( [&]() {
+		for ( unsigned int i = 0; i < BENCH_PLUGINS; i++ ) {
+			plugins.push_back( g_database->putQuery( "INSERT INTO `plugins` ( `reference`, `type`, `enabled` ) VALUES ( 'bench%d', 'dummy', 0 )", i ) );
+		}
+		for ( unsigned long i = 0; i < devices; i++ ) {
+			ids.push_back( g_database->putQuery(
+				"INSERT INTO `devices` ( `plugin_id`, `reference`, `label`, `type`, `enabled` ) "
+				"VALUES ( %ld, 'bench%lu', 'Bench %lu', 'level', 0 )",
+				plugins[i % BENCH_PLUGINS],
+				i,
+				i
+			) );
+			if ( i % 2 == 0 ) {
+				g_database->putQuery( "INSERT INTO `device_settings` ( `device_id`, `key`, `value` ) VALUES ( %ld, 'name', 'Name %lu' )", ids.back(), i );
+			}
+		}
+	} );
+
+	bench::start();
+
+	std::mt19937 random( 1 );
+	std::vector<unsigned long> keys( lookups );
+	for ( auto& key : keys ) {
+		key = random() % devices;
+	}
+	auto lookup = [&]( const std::string& label_, std::function<std::shared_ptr<Device>( unsigned long )>&& func_ ) {
+		unsigned long found = 0;
+		double duration = bench::measure( [&]() {
+			for ( auto const& key : keys ) {
+				if ( func_( key ) != nullptr ) {
+					found++;
+				}
+			}
+		} );
+		std::cout << label_ << ": " << duration / lookups << " us per lookup, " << found << " of " << lookups << " found" << std::endl;
+	};
+	lookup( "id", [&]( unsigned long key_ ) {
+		return g_controller->getDeviceById( ids[key_] );
+	} );
+	lookup( "name", []( unsigned long key_ ) {
+		return g_controller->getDeviceByName( "Name " + std::to_string( key_ - key_ % 2 ) );
+	} );
+	lookup( "label", []( unsigned long key_ ) {
+		return g_controller->getDeviceByLabel( "Bench " + std::to_string( key_ ) );
+	} );
+	lookup( "missing", []( unsigned long key_ ) {
+		return g_controller->getDeviceByName( "Missing " + std::to_string( key_ ) );
+	} );
+
+	bench::stop();
+
+	// The devices, and with them their settings, are removed by the foreign keys.
+	for ( auto const& plugin : plugins ) {
+		g_database->putQuery( "DELETE FROM `plugins` WHERE `id`=%ld", plugin );
+	}
+	g_database = nullptr;
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,68 @@
+#include <iostream>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "Bench.h"
+
+#include "../src/Scheduler.h"
+
+// Emulates the path from the network poll loop to a websocket broadcast: threads outside of the pool schedule a
+// zero-delay task per event, which in turn schedules a zero-delay task on another scheduler. Measures the throughput
+// with one and with four producers, and the latency of single events. Usage: bench_lane [<events>]
+
+using namespace micasa;
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long events = bench::argument( argc_, argv_, 1, 200000 );
+
+	Scheduler network( "Network" );
+	Scheduler webServer( "WebServer" );
+
+	for ( unsigned int producers : { 1, 4 } ) {
+		std::atomic<unsigned long> delivered( 0 );
+		double duration = bench::measure( [&]() {
+			std::vector<std::thread> threads;
+			for ( unsigned int producer = 0; producer < producers; producer++ ) {
+				threads.emplace_back( [&]() {
+					for ( unsigned long i = 0; i < events / producers; i++ ) {
+						network.schedule( 0, 1, nullptr, [&]( std::shared_ptr<Scheduler::Task<>> ) {
+							webServer.schedule( 0, 1, nullptr, [&]( std::shared_ptr<Scheduler::Task<>> ) {
+								delivered++;
+							} );
+						} );
+					}
+				} );
+			}
+			for ( auto& thread : threads ) {
+				thread.join();
+			}
+			while ( delivered < ( events / producers ) * producers ) {
+				std::this_thread::yield();
+			}
+		} );
+		std::cout << producers << " producer(s): " << (unsigned long)( delivered * 1000000. / duration ) << " events/s" << std::endl;
+	}
+
+	// Single events are scheduled while the pool is idle, which measures the wakeup of an idle thread.
+	const unsigned int samples = 2000;
+	double total = 0;
+	for ( unsigned int i = 0; i < samples; i++ ) {
+		std::atomic<bool> done( false );
+		total += bench::measure( [&]() {
+			network.schedule( 0, 1, nullptr, [&]( std::shared_ptr<Scheduler::Task<>> ) {
+				webServer.schedule( 0, 1, nullptr, [&]( std::shared_ptr<Scheduler::Task<>> ) {
+					done = true;
+				} );
+			} );
+			while ( ! done ) {
+				std::this_thread::yield();
+			}
+		} );
+		std::this_thread::sleep_for( std::chrono::microseconds( 200 ) );
+	}
+	std::cout << "single event latency: " << total / samples << " us" << std::endl;
+
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,92 @@
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Bench.h"
+
+#include "../src/Database.h"
+
+// Measures the background migration of a legacy level history table and how long single writes by another thread are
+// blocked while it runs. The legacy table is created with rows older than two hours, so none of them are migrated at
+// startup. Usage: bench_migration [<rows>]
+
+#define BENCH_DEVICES 100
+
+namespace micasa {
+
+	extern std::unique_ptr<Database> g_database;
+
+}; // namespace micasa
+
+using namespace micasa;
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long rows = bench::argument( argc_, argv_, 1, 500000 );
+
+	g_database = std::unique_ptr<Database>( new Database() );
+	long plugin = g_database->putQuery( "INSERT INTO `plugins` ( `reference`, `type`, `enabled` ) VALUES ( 'bench', 'dummy', 0 )" );
+	std::vector<long> devices;
+	for ( unsigned int i = 0; i < BENCH_DEVICES; i++ ) {
+		devices.push_back( g_database->putQuery( "INSERT INTO `devices` ( `plugin_id`, `reference`, `label`, `type`, `enabled` ) VALUES ( %ld, 'bench%d', 'Bench', 'level', 0 )", plugin, i ) );
+	}
+	g_database->putQuery(
+		"CREATE TABLE `device_level_history_legacy` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`value` FLOAT NOT NULL, "
+		"`samples` INTEGER DEFAULT 1 NOT NULL, "
+		"`date` TIMESTAMP NOT NULL )"
+	);
+	g_database->putQuery(
+		"WITH RECURSIVE `rows`( `row` ) AS ( SELECT 0 UNION ALL SELECT `row` + 1 FROM `rows` WHERE `row` < %lu ) "
+		"INSERT INTO `device_level_history_legacy` ( `device_id`, `value`, `samples`, `date` ) "
+		"SELECT %ld + `row` %% %d, `row` * .5, 1, datetime( 'now', '-3 hours', '-' || ( ( `row` / %d ) * 300 ) || ' seconds' ) "
+		"FROM `rows`",
+		rows - 1,
+		devices.front(),
+		BENCH_DEVICES,
+		BENCH_DEVICES
+	);
+
+	// The legacy table is picked up when the database is opened again.
+	g_database = nullptr;
+	double open = bench::measure( []() {
+		g_database = std::unique_ptr<Database>( new Database() );
+	} );
+
+	// A concurrent writer measures how long single writes are blocked by the migration.
+	std::atomic<bool> done( false );
+	std::vector<double> latencies;
+	std::thread writer( [&]() {
+		unsigned long timestamp = 0;
+		while ( ! done ) {
+			latencies.push_back( bench::measure( [&]() {
+				g_database->putQuery(
+					"INSERT INTO `device_level_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+					"VALUES ( %ld, %lu, 1, 1 )",
+					devices.front(),
+					timestamp++
+				);
+			} ) );
+			std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+		}
+	} );
+	double migrate = bench::measure( []() {
+		while ( ! g_database->migrate() ) { }
+	} );
+	done = true;
+	writer.join();
+
+	std::sort( latencies.begin(), latencies.end() );
+	std::cout << "open: " << open / 1000. << " ms" << std::endl;
+	std::cout << "migrate " << rows << " rows: " << migrate / 1000000. << " s" << std::endl;
+	std::cout << "concurrent writes: " << latencies.size() << ", p50 " << latencies[latencies.size() / 2] / 1000. << " ms, p99 " << latencies[latencies.size() * 99 / 100] / 1000. << " ms, max " << latencies.back() / 1000. << " ms" << std::endl;
+
+	// The devices, and with them their history and state, are removed by the foreign keys.
+	g_database->putQuery( "DELETE FROM `plugins` WHERE `id`=%ld", plugin );
+	g_database = nullptr;
+	return EXIT_SUCCESS;
+};
@@ -0,0 +1,46 @@
+#include <iostream>
+#include <cstdlib>
+#include <atomic>
+#include <random>
+#include <thread>
+
+#include "Bench.h"
+
+#include "../src/Scheduler.h"
+
+// Measures the cost of scheduling a task while many tasks are pending, and the time it takes to run a large number of
+// zero-delay tasks with those tasks still pending. Usage: bench_scheduler [<pending>] [<tasks>]
+
+using namespace micasa;
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long pending = bench::argument( argc_, argv_, 1, 100000 );
+	unsigned long tasks = bench::argument( argc_, argv_, 2, 200000 );
+
+	Scheduler scheduler( "Bench" );
+	std::mt19937 random( 1 );
+
+	// The pending tasks are due between one minute and an hour from now, so none of them runs during the benchmark.
+	double insert = bench::measure( [&]() {
+		for ( unsigned long i = 0; i < pending; i++ ) {
+			scheduler.schedule( 60000 + random() % 3600000, 1, nullptr, []( std::shared_ptr<Scheduler::Task<>> ) { } );
+		}
+	} );
+	std::cout << "schedule with " << pending << " pending: " << insert * 1000. / pending << " ns per task" << std::endl;
+
+	std::atomic<unsigned long> done( 0 );
+	double run = bench::measure( [&]() {
+		for ( unsigned long i = 0; i < tasks; i++ ) {
+			scheduler.schedule( 0, 1, nullptr, [&]( std::shared_ptr<Scheduler::Task<>> ) {
+				done++;
+			} );
+		}
+		while ( done < tasks ) {
+			std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+		}
+	} );
+	std::cout << tasks << " zero-delay tasks: " << run / 1000. << " ms" << std::endl;
+
+	scheduler.erase();
+	return EXIT_SUCCESS;
+};
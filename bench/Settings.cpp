@@ -0,0 +1,92 @@
+#include <iostream>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Bench.h"
+
+#include "../src/Database.h"
+#include "../src/Settings.h"
+#include "../src/Device.h"
+
+// Measures the settings reads that Level::updateValue does for every sample, from one or more threads at the same time.
+// Usage: bench_settings [<threads>] [<samples per thread>]
+
+namespace micasa {
+
+	extern std::unique_ptr<Database> g_database;
+
+}; // namespace micasa
+
+using namespace micasa;
+
+static double sample( const Settings<>& settings_, double value_ ) {
+	if ( ( settings_.get<Device::UpdateSource>( DEVICE_SETTING_ALLOWED_UPDATE_SOURCES ) & Device::UpdateSource::PLUGIN ) != Device::UpdateSource::PLUGIN ) {
+		return 0;
+	}
+	if (
+		settings_.get<bool>( "ignore_duplicates", false )
+		&& value_ < 0
+	) {
+		return 0;
+	}
+	double divider = settings_.get<double>( "divider", 1 );
+	double offset = settings_.get<double>( "offset", 0 );
+	if (
+		settings_.contains( "minimum" )
+		&& ( value_ + offset ) / divider < settings_.get<double>( "minimum" )
+	) {
+		return 0;
+	}
+	if (
+		settings_.contains( "maximum" )
+		&& ( value_ + offset ) / divider > settings_.get<double>( "maximum" )
+	) {
+		return 0;
+	}
+	if ( settings_.contains( "rate_limit" ) ) {
+		return settings_.get<double>( "rate_limit" ) + divider + offset;
+	}
+	return divider + offset;
+};
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long threads = bench::argument( argc_, argv_, 1, 1 );
+	unsigned long samples = bench::argument( argc_, argv_, 2, 1000000 );
+
+	// The generic settings are used because they don't need a device. They're removed again before they're
+	// committed by the destructor.
+	g_database = std::unique_ptr<Database>( new Database() );
+	{
+		Settings<> settings;
+		settings.put( DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::ANY ) );
+		settings.put( "divider", 1000.0 );
+		settings.put( "offset", 2.5 );
+		settings.put( "minimum", -100.0 );
+		settings.put( "maximum", 100000.0 );
+		settings.put( "rate_limit", 5.0 );
+
+		std::vector<double> results( threads, 0 );
+		double duration = bench::measure( [&]() {
+			std::vector<std::thread> pool;
+			for ( unsigned long thread = 0; thread < threads; thread++ ) {
+				pool.emplace_back( [&,thread]() {
+					for ( unsigned long i = 0; i < samples; i++ ) {
+						results[thread] += sample( settings, i );
+					}
+				} );
+			}
+			for ( auto& thread : pool ) {
+				thread.join();
+			}
+		} );
+		std::cout << threads << " thread(s): " << duration * 1000. / samples << " ns per sample, " << (unsigned long)( threads * samples * 1000000. / duration ) << " samples/s in total" << std::endl;
+
+		for ( auto const &key : { DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, "divider", "offset", "minimum", "maximum", "rate_limit" } ) {
+			settings.remove( key );
+		}
+	}
+	g_database = nullptr;
+	return EXIT_SUCCESS;
+};
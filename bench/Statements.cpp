@@ -0,0 +1,127 @@
+#include <iostream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "Bench.h"
+
+#include "../src/Database.h"
+
+// Compares formatted queries with prepared statements from the statement cache for the most frequent writes and reads:
+// the level history upsert, the settings replace and the settings select. The writes are done in a single transaction
+// so that the cost of syncing the database to disk is left out. Usage: bench_statements [<operations>]
+
+#define BENCH_DEVICES 20
+
+namespace micasa {
+
+	extern std::unique_ptr<Database> g_database;
+
+}; // namespace micasa
+
+using namespace micasa;
+
+static void report( const std::string& label_, unsigned long operations_, double formatted_, double prepared_ ) {
+	std::cout << label_ << ": " << (unsigned long)( operations_ * 1000000. / formatted_ ) << " -> " << (unsigned long)( operations_ * 1000000. / prepared_ ) << " ops/s" << std::endl;
+};
+
+int main( int argc_, char* argv_[] ) {
+	unsigned long operations = bench::argument( argc_, argv_, 1, 20000 );
+
+	g_database = std::unique_ptr<Database>( new Database() );
+	long plugin = g_database->putQuery( "INSERT INTO `plugins` ( `reference`, `type`, `enabled` ) VALUES ( 'bench', 'dummy', 0 )" );
+	std::vector<long> devices;
+	for ( unsigned int i = 0; i < BENCH_DEVICES; i++ ) {
+		devices.push_back( g_database->putQuery( "INSERT INTO `devices` ( `plugin_id`, `reference`, `label`, `type`, `enabled` ) VALUES ( %ld, 'bench%d', 'Bench', 'level', 0 )", plugin, i ) );
+		for ( unsigned int key = 0; key < 10; key++ ) {
+			g_database->putQuery( "INSERT INTO `device_settings` ( `device_id`, `key`, `value` ) VALUES ( %ld, 'key%d', 'value' )", devices.back(), key );
+		}
+	}
+
+	double formatted[3];
+	double prepared[3];
+	g_database->transaction( [&]() {
+		formatted[0] = bench::measure( [&]() {
+			for ( unsigned long i = 0; i < operations; i++ ) {
+				g_database->putQuery(
+					"INSERT INTO `device_level_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+					"VALUES ( %ld, %lu, %.6f, 1 ) "
+					"ON CONFLICT( `device_id`, `timestamp` ) DO UPDATE SET "
+						"`value` = ( ( `value` * `samples` ) + excluded.`value` ) / ( `samples` + 1 ), "
+						"`samples` = `samples` + 1",
+					devices[i % BENCH_DEVICES],
+					i / BENCH_DEVICES * 300,
+					i * .5
+				);
+			}
+		} );
+		prepared[0] = bench::measure( [&]() {
+			for ( unsigned long i = 0; i < operations; i++ ) {
+				g_database->prepare(
+					"bench.level",
+					"INSERT INTO `device_level_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+					"VALUES ( ?, ?, ?, 1 ) "
+					"ON CONFLICT( `device_id`, `timestamp` ) DO UPDATE SET "
+						"`value` = ( ( `value` * `samples` ) + excluded.`value` ) / ( `samples` + 1 ), "
+						"`samples` = `samples` + 1"
+				).bind( devices[i % BENCH_DEVICES], i / BENCH_DEVICES * 300, i * .5 ).step();
+			}
+		} );
+
+		formatted[1] = bench::measure( [&]() {
+			for ( unsigned long i = 0; i < operations; i++ ) {
+				g_database->putQuery(
+					"REPLACE INTO `device_settings` ( `device_id`, `key`, `value` ) "
+					"VALUES ( %ld, 'key3', %Q )",
+					devices[i % BENCH_DEVICES],
+					std::to_string( i ).c_str()
+				);
+			}
+		} );
+		prepared[1] = bench::measure( [&]() {
+			for ( unsigned long i = 0; i < operations; i++ ) {
+				g_database->prepare(
+					"bench.settings.replace",
+					"REPLACE INTO `device_settings` ( `device_id`, `key`, `value` ) "
+					"VALUES ( ?, 'key3', ? )"
+				).bind( devices[i % BENCH_DEVICES], std::to_string( i ) ).step();
+			}
+		} );
+	} );
+
+	unsigned long rows = 0;
+	formatted[2] = bench::measure( [&]() {
+		for ( unsigned long i = 0; i < operations; i++ ) {
+			rows += g_database->getQueryMap(
+				"SELECT `key`, `value` "
+				"FROM `device_settings` "
+				"WHERE `device_id`=%ld",
+				devices[i % BENCH_DEVICES]
+			).size();
+		}
+	} );
+	prepared[2] = bench::measure( [&]() {
+		for ( unsigned long i = 0; i < operations; i++ ) {
+			Database::Statement statement = g_database->prepare(
+				"bench.settings.select",
+				"SELECT `key`, `value` "
+				"FROM `device_settings` "
+				"WHERE `device_id`=?"
+			);
+			statement.bind( devices[i % BENCH_DEVICES] );
+			while ( statement.step() ) {
+				rows++;
+			}
+		}
+	} );
+
+	report( "level history upsert", operations, formatted[0], prepared[0] );
+	report( "settings replace", operations, formatted[1], prepared[1] );
+	report( "settings select", operations, formatted[2], prepared[2] );
+
+	// The devices, and with them their settings and history, are removed by the foreign keys.
+	g_database->putQuery( "DELETE FROM `plugins` WHERE `id`=%ld", plugin );
+	g_database = nullptr;
+	return EXIT_SUCCESS;
+};
@@ -203,7 +203,8 @@ namespace micasa {
 	extern std::unique_ptr<WebServer> g_webServer;
 
 	Controller::Controller() :
-		m_running( false )
+		m_running( false ),
+		m_scheduler( "Controller" )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before global Controller instance." );
@@ -264,6 +265,11 @@ namespace micasa {
 			"FROM `plugins` "
 			"ORDER BY `id` ASC"
 		);
+
+		// The stored state of all devices is fetched up front and handed to the plugins, which saves a few queries for
+		// each device they create.
+		auto hydration = Device::hydrate();
+
 		for ( auto& pluginData : pluginsData ) {
 			std::shared_ptr<Plugin> parent;
 			if ( pluginData["plugin_id"].size() > 0 ) {
@@ -278,7 +284,7 @@ namespace micasa {
 				pluginData["reference"],
 				parent
 			);
-			plugin->init();
+			plugin->init( hydration );
 			this->m_plugins[pluginData["reference"]] = plugin;
 
 			// Only parent plugin is started automatically. The plugin itself should take care of starting it's
@@ -296,7 +302,8 @@ namespace micasa {
 		pluginsLock.unlock();
 
 		// Start a task that runs at every whole minute that processes the configured timers. The 5ms is a safe margin
-		// to make sure the whole minute has passed.
+		// to make sure the whole minute has passed. The task is scheduled at a system clock time point which anchors it
+		// to the wall clock, so it keeps running at whole minutes if the system clock is adjusted.
 		auto now = system_clock::now();
 		auto wait = now + ( milliseconds( 60005 ) - duration_cast<milliseconds>( now.time_since_epoch() ) % milliseconds( 60000 ) );
 		this->m_scheduler.schedule( wait, 60000, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
@@ -305,6 +312,24 @@ namespace micasa {
 			}
 		} );
 
+		// Database maintenance is done in the background in small steps. Free pages are reclaimed frequently, so the
+		// database shrinks shortly after history has been purged. The migration task stops repeating once all legacy
+		// tables have been migrated.
+		this->m_scheduler.schedule( Scheduler::Priority::BACKGROUND, SCHEDULER_INTERVAL_10SEC, SCHEDULER_INTERVAL_10SEC, SCHEDULER_REPEAT_INFINITE, this, []( std::shared_ptr<Scheduler::Task<>> ) {
+			g_database->vacuum();
+		} );
+		this->m_scheduler.schedule( Scheduler::Priority::BACKGROUND, SCHEDULER_INTERVAL_5MIN, SCHEDULER_INTERVAL_5MIN, SCHEDULER_REPEAT_INFINITE, this, []( std::shared_ptr<Scheduler::Task<>> ) {
+			g_database->checkpoint();
+		} );
+		this->m_scheduler.schedule( Scheduler::Priority::BACKGROUND, SCHEDULER_INTERVAL_5SEC, SCHEDULER_INTERVAL_5SEC, SCHEDULER_REPEAT_INFINITE, this, []( std::shared_ptr<Scheduler::Task<>> task_ ) {
+			if ( g_database->migrate() ) {
+				task_->repeat = 0; // done
+			}
+		} );
+		this->m_scheduler.schedule( Scheduler::Priority::BACKGROUND, SCHEDULER_INTERVAL_1HOUR, SCHEDULER_INTERVAL_1HOUR, SCHEDULER_REPEAT_INFINITE, this, []( std::shared_ptr<Scheduler::Task<>> ) {
+			g_database->optimize();
+		} );
+
 		this->m_running = true;
 
 #ifdef _WITH_LIBUDEV
@@ -386,6 +411,17 @@ namespace micasa {
 		this->m_plugins.clear();
 		pluginsLock.unlock();
 
+		std::unique_lock<std::mutex> devicesLock( this->m_devicesMutex );
+		this->m_devicesById.clear();
+		this->m_devicesByName.clear();
+		this->m_devicesByLabel.clear();
+		this->m_devicesIndexed.clear();
+		devicesLock.unlock();
+
+		// The plugins and their devices queue their dirty settings when they are stopped and destroyed, which are
+		// all committed at once here.
+		g_database->flush();
+
 		Logger::log( Logger::LogLevel::NORMAL, this, "Stopped." );
 	};
 
@@ -476,6 +512,7 @@ namespace micasa {
 
 		// Then the plugin is stopped in a separate thread.
 		this->m_scheduler.schedule( 0, 1, this, [this,plugin_]( std::shared_ptr<Scheduler::Task<>> ) {
+			Scheduler::Blocking blocking;
 			auto future = std::async( std::launch::async, [plugin_] {
 				plugin_->stop();
 			} );
@@ -503,6 +540,9 @@ namespace micasa {
 				};
 				g_webServer->broadcast( data.dump() );
 
+				for ( auto const& device : plugin->getAllDevices() ) {
+					this->unindexDevice( device );
+				}
 				pluginsIt = this->m_plugins.erase( pluginsIt );
 			} else {
 				pluginsIt++;
@@ -522,36 +562,22 @@ namespace micasa {
 	};
 
 	std::shared_ptr<Device> Controller::getDeviceById( const unsigned int& id_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDeviceById( id_ );
-			if ( device != nullptr ) {
-				return device;
-			}
+		std::lock_guard<std::mutex> lock( this->m_devicesMutex );
+		auto find = this->m_devicesById.find( id_ );
+		if ( find != this->m_devicesById.end() ) {
+			return find->second.lock();
 		}
 		return nullptr;
 	};
 
 	std::shared_ptr<Device> Controller::getDeviceByName( const std::string& name_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDeviceByName( name_ );
-			if ( device != nullptr ) {
-				return device;
-			}
-		}
-		return nullptr;
+		std::lock_guard<std::mutex> lock( this->m_devicesMutex );
+		return this->_getIndexedDevice( this->m_devicesByName, name_ );
 	};
 
 	std::shared_ptr<Device> Controller::getDeviceByLabel( const std::string& label_ ) const {
-		std::lock_guard<std::recursive_mutex> lock( this->m_pluginsMutex );
-		for ( auto const &pluginsIt : this->m_plugins ) {
-			auto device = pluginsIt.second->getDeviceByLabel( label_ );
-			if ( device != nullptr ) {
-				return device;
-			}
-		}
-		return nullptr;
+		std::lock_guard<std::mutex> lock( this->m_devicesMutex );
+		return this->_getIndexedDevice( this->m_devicesByLabel, label_ );
 	};
 
 	std::vector<std::shared_ptr<Device>> Controller::getAllDevices() const {
@@ -565,26 +591,55 @@ namespace micasa {
 	};
 
 	bool Controller::isScheduled( std::shared_ptr<const Device> device_ ) const {
-		return this->m_scheduler.first(
-			[device_]( const Scheduler::BaseTask& task_ ) -> bool {
-				return task_.data == device_.get();
-			}
-		) != nullptr;
+		return this->m_scheduler.nextScheduleFor( device_.get() ) != nullptr;
 	};
 
 	std::chrono::seconds Controller::nextSchedule( std::shared_ptr<const Device> device_ ) const {
-		auto task = this->m_scheduler.first(
-			[device_]( const Scheduler::BaseTask& task_ ) -> bool {
-				return task_.data == device_.get();
-			}
-		);
+		auto task = this->m_scheduler.nextScheduleFor( device_.get() );
 		if ( task != nullptr ) {
-			return duration_cast<seconds>( task->time - system_clock::now() );
+			return duration_cast<seconds>( task->time - steady_clock::now() );
 		} else {
 			return seconds::zero();
 		}
 	};
 
+	void Controller::indexDevice( const std::shared_ptr<Device> device_ ) {
+		std::string name = device_->getName();
+		std::string label = device_->getLabel();
+		std::lock_guard<std::mutex> lock( this->m_devicesMutex );
+		this->_unindexDevice( device_->getId() );
+		this->m_devicesById[device_->getId()] = device_;
+		this->m_devicesByName.insert( { name, device_->getId() } );
+		this->m_devicesByLabel.insert( { label, device_->getId() } );
+		this->m_devicesIndexed[device_->getId()] = { name, label };
+	};
+
+	void Controller::unindexDevice( const std::shared_ptr<Device> device_ ) {
+		std::lock_guard<std::mutex> lock( this->m_devicesMutex );
+		this->_unindexDevice( device_->getId() );
+	};
+
+	void Controller::reindexDeviceName( const Device* device_ ) {
+		std::string name = device_->getName();
+		std::lock_guard<std::mutex> lock( this->m_devicesMutex );
+		auto find = this->m_devicesIndexed.find( device_->getId() );
+		if (
+			find == this->m_devicesIndexed.end()
+			|| find->second.first == name
+		) {
+			return;
+		}
+		auto range = this->m_devicesByName.equal_range( find->second.first );
+		for ( auto indexIt = range.first; indexIt != range.second; indexIt++ ) {
+			if ( indexIt->second == device_->getId() ) {
+				this->m_devicesByName.erase( indexIt );
+				break;
+			}
+		}
+		this->m_devicesByName.insert( { name, device_->getId() } );
+		find->second.first = name;
+	};
+
 	template<class D> void Controller::newEvent( std::shared_ptr<D> device_, const Device::UpdateSource& source_ ) {
 		if ( this->m_running ) {
 
@@ -993,6 +1048,50 @@ namespace micasa {
 		}
 	};
 
+	void Controller::_unindexDevice( const unsigned int& id_ ) {
+		// NOTE Only call this method with held lock on devices mutex.
+		auto find = this->m_devicesIndexed.find( id_ );
+		if ( find != this->m_devicesIndexed.end() ) {
+			auto erase = [id_]( std::unordered_multimap<std::string, unsigned int>& index_, const std::string& key_ ) {
+				auto range = index_.equal_range( key_ );
+				for ( auto indexIt = range.first; indexIt != range.second; indexIt++ ) {
+					if ( indexIt->second == id_ ) {
+						index_.erase( indexIt );
+						break;
+					}
+				}
+			};
+			erase( this->m_devicesByName, find->second.first );
+			erase( this->m_devicesByLabel, find->second.second );
+			this->m_devicesIndexed.erase( find );
+		}
+		this->m_devicesById.erase( id_ );
+	};
+
+	std::shared_ptr<Device> Controller::_getIndexedDevice( const std::unordered_multimap<std::string, unsigned int>& index_, const std::string& key_ ) const {
+		// NOTE Only call this method with held lock on devices mutex.
+		// The order of the devices in the index is arbitrary and changes when devices are reindexed, so the device
+		// with the lowest id is returned to always resolve a duplicate name or label to the same device.
+		std::shared_ptr<Device> result = nullptr;
+		auto range = index_.equal_range( key_ );
+		for ( auto indexIt = range.first; indexIt != range.second; indexIt++ ) {
+			if (
+				result != nullptr
+				&& result->getId() < indexIt->second
+			) {
+				continue;
+			}
+			auto find = this->m_devicesById.find( indexIt->second );
+			if ( find != this->m_devicesById.end() ) {
+				auto device = find->second.lock();
+				if ( device != nullptr ) {
+					result = device;
+				}
+			}
+		}
+		return result;
+	};
+
 	Controller::TaskOptions Controller::_parseTaskOptions( const std::string& options_ ) const {
 		int lastTokenType = 0;
 		TaskOptions result = { 0, 0, 1, 0, false, false };
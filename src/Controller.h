@@ -83,6 +83,13 @@ namespace micasa {
 
 		template<class D> void newEvent( std::shared_ptr<D> device_, const Device::UpdateSource& source_ );
 
+		// Devices are looked up by id, name and label through an index, which should be updated whenever a device
+		// is added, removed or when its name or label changes. If several devices share a name or label, the one with
+		// the lowest id is returned. The name of an indexed device is reindexed whenever its name setting is committed.
+		void indexDevice( const std::shared_ptr<Device> device_ );
+		void unindexDevice( const std::shared_ptr<Device> device_ );
+		void reindexDeviceName( const Device* device_ );
+
 #ifdef _WITH_LIBUDEV
 		void addSerialPortCallback( const std::string& name_, const t_serialPortCallback& callback_ );
 		void removeSerialPortCallback( const std::string& name_ );
@@ -92,6 +99,11 @@ namespace micasa {
 		volatile bool m_running;
 		std::unordered_map<std::string, std::shared_ptr<Plugin>> m_plugins;
 		mutable std::recursive_mutex m_pluginsMutex;
+		std::unordered_map<unsigned int, std::weak_ptr<Device>> m_devicesById;
+		std::unordered_multimap<std::string, unsigned int> m_devicesByName;
+		std::unordered_multimap<std::string, unsigned int> m_devicesByLabel;
+		std::unordered_map<unsigned int, std::pair<std::string, std::string>> m_devicesIndexed; // name and label a device is indexed with
+		mutable std::mutex m_devicesMutex;
 		Scheduler m_scheduler;
 		v7* m_v7_js;
 		mutable std::mutex m_jsMutex;
@@ -108,6 +120,8 @@ namespace micasa {
 		void _runScripts( const std::string key_, const nlohmann::json data_, const std::vector<std::map<std::string, std::string>> scripts_ );
 		void _runTimers();
 		void _runLinks( std::shared_ptr<Device> device_ );
+		void _unindexDevice( const unsigned int& id_ );
+		std::shared_ptr<Device> _getIndexedDevice( const std::unordered_multimap<std::string, unsigned int>& index_, const std::string& key_ ) const;
 		TaskOptions _parseTaskOptions( const std::string& options_ ) const;
 
 		template<class D> void _js_updateDevice( const std::shared_ptr<D> device_, const typename D::t_value& value_, const std::string& options_ = "" );
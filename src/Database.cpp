@@ -1,28 +1,93 @@
 // https://blogs.gnome.org/jnelson/2015/01/06/sqlite-vacuum-and-auto_vacuum/
 
+#include <algorithm>
 #include <memory>
 
 #include "Database.h"
 #include "Structs.h"
 #include "Logger.h"
+#include "Scheduler.h"
+#include "Utils.h"
 
 namespace micasa {
 
 	using namespace nlohmann;
 
-	Database::Database() {
-		int result = sqlite3_open_v2( ( std::string( _DATADIR ) + "/micasa.db" ).c_str(), &this->m_connection, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_WAL | SQLITE_OPEN_FULLMUTEX, NULL );
+	// The number of rows returned by the statement that is being executed by the current thread. It's maintained by a
+	// trace callback on all connections and used to count the rows of queries that step through their results
+	// internally. Rows of other statements, such as the ones sqlite uses to load the schema, are not counted.
+	static thread_local sqlite3_stmt* g_statement = NULL;
+	static thread_local unsigned long long g_rows = 0;
+
+	Database::Database( unsigned int writeInterval_, unsigned int writeBatchSize_ ) :
+		m_writeInterval( writeInterval_ > 0 ? writeInterval_ : DATABASE_WRITE_INTERVAL_MSEC ),
+		m_writeBatchSize( writeBatchSize_ > 0 ? writeBatchSize_ : DATABASE_WRITE_BATCH_SIZE ),
+		m_writesQueued( 0 ),
+		m_writesCommitted( 0 ),
+		m_flush( false ),
+		m_shutdown( false ),
+		m_checkpoint( false ),
+		m_slowQueryThreshold( 0 ),
+		m_readAcquisitions( 0 ),
+		m_readWait( 0 ),
+		m_writeAcquisitions( 0 ),
+		m_writeWait( 0 )
+	{
+		std::string filename = std::string( _DATADIR ) + "/micasa.db";
+		int result = sqlite3_open_v2( filename.c_str(), &this->m_connection, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL );
 		if ( result == SQLITE_OK ) {
 			Logger::log( Logger::LogLevel::VERBOSE, this, "Database opened." );
+			this->m_statistics[this->m_connection] = std::unique_ptr<t_statistics>( new t_statistics() );
 			this->_init();
+
+			// The read-only connections are opened after the schema has been created or upgraded. Each connection
+			// is used by a single thread at a time, so they don't need their own mutex.
+			for ( unsigned int i = 0; i < DATABASE_READ_CONNECTIONS; i++ ) {
+				sqlite3* connection;
+				if ( SQLITE_OK == sqlite3_open_v2( filename.c_str(), &connection, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL ) ) {
+					sqlite3_busy_timeout( connection, 1000 );
+					sqlite3_trace_v2( connection, SQLITE_TRACE_ROW, []( unsigned int, void*, void* statement_, void* ) -> int {
+						if ( statement_ == g_statement ) {
+							g_rows++;
+						}
+						return 0;
+					}, NULL );
+					this->m_readers.push_back( connection );
+					this->m_statistics[connection] = std::unique_ptr<t_statistics>( new t_statistics() );
+				} else {
+					Logger::log( Logger::LogLevel::ERROR, this, "Unable to open read-only connection." );
+					sqlite3_close( connection );
+				}
+			}
+			this->m_availableReaders = this->m_readers;
 		} else {
 			Logger::log( Logger::LogLevel::ERROR, this, "Unable to open database." );
 		}
 		this->m_queries = 0;
+		this->m_writer = std::thread( &Database::_writer, this );
 	};
 
 	Database::~Database() {
-		this->putQuery( "PRAGMA optimize" );
+		// The writer thread commits all remaining writes before it exits.
+		{
+			std::lock_guard<std::mutex> lock( this->m_writesMutex );
+			this->m_shutdown = true;
+		}
+		this->m_writesCondition.notify_one();
+		this->m_writer.join();
+
+		this->optimize();
+		for ( auto readersIt = this->m_readers.begin(); readersIt != this->m_readers.end(); readersIt++ ) {
+			sqlite3_close( *readersIt );
+		}
+		{
+			std::lock_guard<std::mutex> lock( this->m_statementsMutex );
+			for ( auto statementsIt = this->m_statements.begin(); statementsIt != this->m_statements.end(); statementsIt++ ) {
+				sqlite3_finalize( statementsIt->second );
+			}
+			this->m_statements.clear();
+			this->m_statementsIndex.clear();
+		}
 		int result = sqlite3_close( this->m_connection );
 		if ( SQLITE_OK == result ) {
 			Logger::log( Logger::LogLevel::VERBOSE, this, "Database closed." );
@@ -32,12 +97,62 @@ namespace micasa {
 		}
 	};
 
+	template<> int Database::Row::get( int column_ ) const {
+		return sqlite3_column_int( this->m_statement, column_ );
+	};
+
+	template<> unsigned int Database::Row::get( int column_ ) const {
+		return static_cast<unsigned int>( sqlite3_column_int64( this->m_statement, column_ ) );
+	};
+
+	template<> long Database::Row::get( int column_ ) const {
+		return static_cast<long>( sqlite3_column_int64( this->m_statement, column_ ) );
+	};
+
+	template<> unsigned long Database::Row::get( int column_ ) const {
+		return static_cast<unsigned long>( sqlite3_column_int64( this->m_statement, column_ ) );
+	};
+
+	template<> long long Database::Row::get( int column_ ) const {
+		return sqlite3_column_int64( this->m_statement, column_ );
+	};
+
+	template<> double Database::Row::get( int column_ ) const {
+		return sqlite3_column_double( this->m_statement, column_ );
+	};
+
+	template<> const char* Database::Row::get( int column_ ) const {
+		const unsigned char* value = sqlite3_column_text( this->m_statement, column_ );
+		if ( value != NULL ) {
+			return reinterpret_cast<const char*>( value );
+		} else {
+			return "";
+		}
+	};
+
+	template<> std::string Database::Row::get( int column_ ) const {
+		const unsigned char* value = sqlite3_column_text( this->m_statement, column_ );
+		if ( value != NULL ) {
+			return std::string( reinterpret_cast<const char*>( value ), sqlite3_column_bytes( this->m_statement, column_ ) );
+		} else {
+			return "";
+		}
+	};
+
+	size_t Database::Row::getSize( int column_ ) const {
+		return sqlite3_column_bytes( this->m_statement, column_ );
+	};
+
+	bool Database::Row::isNull( int column_ ) const {
+		return SQLITE_NULL == sqlite3_column_type( this->m_statement, column_ );
+	};
+
 	std::vector<std::map<std::string, std::string>> Database::getQuery( const std::string query_, ... ) const {
 		std::vector<std::map<std::string, std::string>> result;
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			int columns = sqlite3_column_count( statement_ );
 			while ( true ) {
 				if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
@@ -68,7 +183,7 @@ namespace micasa {
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			int columns = sqlite3_column_count( statement_ );
 			while ( true ) {
 				if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
@@ -110,7 +225,7 @@ namespace micasa {
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
 				int columns = sqlite3_column_count( statement_ );
 				for ( int column = 0; column < columns; column++ ) {
@@ -137,7 +252,7 @@ namespace micasa {
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
 				int columns = sqlite3_column_count( statement_ );
 				for ( int column = 0; column < columns; column++ ) {
@@ -175,17 +290,15 @@ namespace micasa {
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			while ( true ) {
 				if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
 					if ( sqlite3_column_count( statement_ ) != 1 ) {
 						throw InvalidResultException( "resultset doesn't contain exactly one column" );
 					}
-					const unsigned char* valueC = sqlite3_column_text( statement_, 0 );
-					if ( valueC != NULL ) {
-						T value;
-						std::istringstream( reinterpret_cast<const char*>( valueC ) ) >> value;
-						result.push_back( value );
+					Row row( statement_ );
+					if ( ! row.isNull( 0 ) ) {
+						result.push_back( row.get<T>( 0 ) );
 					}
 				} else {
 					break;
@@ -203,14 +316,14 @@ namespace micasa {
 	template std::vector<unsigned long> Database::getQueryColumn( const std::string query_, ... ) const;
 	template std::vector<double> Database::getQueryColumn( const std::string query_, ... ) const;
 
-	// The string variant of the above template doesn't require string streams and has it's own
-	// specialized implementation.
+	// The string variant of the above template skips the intermediate row and has it's own specialized
+	// implementation.
 	template<> std::vector<std::string> Database::getQueryColumn( const std::string query_, ... ) const {
 		std::vector<std::string> result;
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			while ( true ) {
 				if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
 					if ( sqlite3_column_count( statement_ ) != 1 ) {
@@ -235,7 +348,7 @@ namespace micasa {
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			int columns = sqlite3_column_count( statement_ );
 			if ( 2 != columns ) {
 				throw InvalidResultException( "resultset doesn't contain exactly two columns" );
@@ -261,28 +374,23 @@ namespace micasa {
 	};
 
 	template<typename T> T Database::getQueryValue( const std::string query_, ... ) const {
-		std::string result;
+		T result = T();
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
 				if ( sqlite3_column_count( statement_ ) != 1 ) {
 					throw InvalidResultException( "resultset doesn't contain exactly one column" );
 				}
-				const unsigned char* valueC = sqlite3_column_text( statement_, 0 );
-				if ( valueC != NULL ) {
-					result = std::string( reinterpret_cast<const char*>( valueC ) );
-				}
+				result = Row( statement_ ).get<T>( 0 );
 			} else {
 				throw NoResultsException( "resultset doesn't contain any rows" );
 			}
 		} );
 		va_end( arguments );
 
-		T value;
-		std::istringstream( result ) >> value;
-		return value;
+		return result;
 	};
 
 	// The above template is specialized for the types listed below.
@@ -291,14 +399,14 @@ namespace micasa {
 	template unsigned long Database::getQueryValue( const std::string query_, ... ) const;
 	template double Database::getQueryValue( const std::string query_, ... ) const;
 
-	// The string variant of the above template doesn't require string streams and has it's own
-	// specialized implementation.
+	// The string variant of the above template skips the intermediate row and has it's own specialized
+	// implementation.
 	template<> std::string Database::getQueryValue<std::string>( const std::string query_, ... ) const {
 		std::string result;
 
 		va_list arguments;
 		va_start( arguments, query_ );
-		this->_wrapQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
+		this->_wrapReadQuery( query_, arguments, [&result]( sqlite3_stmt *statement_ ) {
 			if ( SQLITE_ROW == sqlite3_step( statement_ ) ) {
 				if ( sqlite3_column_count( statement_ ) != 1 ) {
 					throw InvalidResultException( "resultset doesn't contain exactly one column" );
@@ -316,11 +424,42 @@ namespace micasa {
 		return result;
 	};
 
+	Database::Cursor Database::getCursor( const std::string query_, ... ) const {
+		unsigned long long wait = 0;
+		sqlite3* connection = this->_acquireReader( wait );
+
+		va_list arguments;
+		va_start( arguments, query_ );
+		char* query = sqlite3_vmprintf( query_.c_str(), arguments );
+		va_end( arguments );
+		if ( ! query ) {
+			Logger::log( Logger::LogLevel::ERROR, this, "Out of memory or invalid printf style query." );
+			this->_releaseReader( connection );
+			return Cursor( this, NULL, NULL );
+		}
+
+#ifdef _DEBUG
+		Logger::log( Logger::LogLevel::DEBUG, this, std::string( query ) );
+#endif // _DEBUG
+
+		auto start = std::chrono::steady_clock::now();
+		sqlite3_stmt *statement;
+		if ( SQLITE_OK != sqlite3_prepare_v2( connection, query, -1, &statement, NULL ) ) {
+			const char* error = sqlite3_errmsg( connection );
+			Logger::logr( Logger::LogLevel::ERROR, this, "Query rejected (%s).", error );
+			sqlite3_free( query );
+			this->_releaseReader( connection );
+			return Cursor( this, NULL, NULL );
+		}
+		sqlite3_free( query );
+		return Cursor( this, connection, statement, query_, std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count(), wait );
+	};
+
 	long Database::putQuery( const std::string query_, ... ) const {
 		va_list arguments;
 		va_start( arguments, query_ );
 		long insertId = -1;
-		this->_wrapQuery( query_, arguments, [this,&insertId]( sqlite3_stmt *statement_ ) {
+		this->_wrapQuery( this->m_connection, query_, arguments, [this,&insertId]( sqlite3_stmt *statement_ ) {
 			if ( SQLITE_DONE != sqlite3_step( statement_ ) ) {
 				const char *error = sqlite3_errmsg( this->m_connection );
 				Logger::logr( Logger::LogLevel::ERROR, this, "Query rejected (%s).", error );
@@ -336,26 +475,444 @@ namespace micasa {
 		return sqlite3_errcode( this->m_connection );
 	};
 
+	Database::Statement Database::prepare( const std::string& id_, const std::string& query_ ) const {
+		{
+			std::lock_guard<std::mutex> lock( this->m_statementsMutex );
+			auto find = this->m_statementsIndex.find( id_ );
+			if ( find != this->m_statementsIndex.end() ) {
+				sqlite3_stmt* statement = find->second->second;
+				this->m_statements.erase( find->second );
+				this->m_statementsIndex.erase( find );
+				return Statement( this, id_, statement );
+			}
+		}
+
+		// The statement is not in the cache or is in use by another thread, in which case an additional statement
+		// is prepared. Only one of them is kept when they are handed back.
+		sqlite3_stmt* statement = NULL;
+		if ( ! this->m_connection ) {
+			Logger::log( Logger::LogLevel::ERROR, this, "Database not open." );
+		} else if ( SQLITE_OK != sqlite3_prepare_v2( this->m_connection, query_.c_str(), -1, &statement, NULL ) ) {
+			const char* error = sqlite3_errmsg( this->m_connection );
+			Logger::logr( Logger::LogLevel::ERROR, this, "Query rejected (%s).", error );
+			sqlite3_finalize( statement );
+			statement = NULL;
+		}
+		return Statement( this, id_, statement );
+	};
+
 	void Database::_init() const {
 		// OFF = safe from crashes, not from system failures
 		// NORMAL = ok
 		this->putQuery( "PRAGMA synchronous=NORMAL" );
 		this->putQuery( "PRAGMA foreign_keys=ON" );
 
-		Logger::log( Logger::LogLevel::NORMAL, this, "Optimizing database." );
-		this->putQuery( "VACUUM" );
+		// In wal mode the read-only connections can read while the primary connection writes. The wal file is
+		// checkpointed by the writer thread instead of by whichever query happens to commit when it grows too large.
+		if ( "wal" != this->getQueryValue<std::string>( "PRAGMA journal_mode=WAL" ) ) {
+			Logger::log( Logger::LogLevel::ERROR, this, "Unable to enable wal mode." );
+		}
+		sqlite3_busy_timeout( this->m_connection, 1000 );
+		sqlite3_trace_v2( this->m_connection, SQLITE_TRACE_ROW, []( unsigned int, void*, void* statement_, void* ) -> int {
+			if ( statement_ == g_statement ) {
+				g_rows++;
+			}
+			return 0;
+		}, NULL );
+		sqlite3_wal_hook( this->m_connection, []( void* database_, sqlite3*, const char*, int pages_ ) -> int {
+			if ( pages_ >= DATABASE_CHECKPOINT_PAGES ) {
+				const Database* database = static_cast<const Database*>( database_ );
+				std::lock_guard<std::mutex> lock( database->m_writesMutex );
+				database->m_checkpoint = true;
+				database->m_writesCondition.notify_one();
+			}
+			return SQLITE_OK;
+		}, const_cast<Database*>( this ) );
 
+		// Free pages are reclaimed in small steps by the maintenance task instead of by a full VACUUM at startup.
+		// Enabling incremental auto vacuum on an existing database requires a one-time VACUUM though.
 		unsigned int version = this->getQueryValue<unsigned int>( "PRAGMA user_version" );
+		if ( this->getQueryValue<unsigned int>( "PRAGMA auto_vacuum" ) != 2 ) {
+			this->putQuery( "PRAGMA auto_vacuum=INCREMENTAL" );
+			if ( version > 0 ) {
+				Logger::log( Logger::LogLevel::NORMAL, this, "Enabling incremental vacuum, this might take a while." );
+				this->putQuery( "VACUUM" );
+			}
+		}
+
 		if ( version < c_queries.size() ) {
 			for ( auto queryIt = c_queries.begin() + version; queryIt != c_queries.end(); queryIt++ ) {
 				this->putQuery( *queryIt );
 			}
 			this->putQuery( "PRAGMA user_version=%d", c_queries.size() );
 		}
+
+		for ( auto const& seed : c_legacyStates ) {
+			if ( this->getQueryValue<unsigned int>( "SELECT COUNT(*) FROM `sqlite_master` WHERE `type` = 'table' AND `name` = '%s_legacy'", seed.first.c_str() ) > 0 ) {
+				this->putQuery( seed.second );
+			}
+		}
+
+		// The rows of the last two hours are migrated right away, so devices can restore their current bucket and
+		// trend from the new tables. The remaining rows are migrated in the background.
+		for ( auto const& migration : c_migrations ) {
+			if (
+				this->getQueryValue<unsigned int>( "SELECT COUNT(*) FROM `sqlite_master` WHERE `type` = 'table' AND `name` = '%s_legacy'", migration.first.c_str() ) > 0
+				&& this->_migrate( migration, "`date` >= datetime( 'now', '-2 hours' )" )
+			) {
+				this->m_migrations.push_back( migration );
+			}
+		}
+		if (
+			this->m_migrations.size() > 0
+			&& version > 0
+		) {
+			Logger::log( Logger::LogLevel::NORMAL, this, "Migrating history and trends in the background." );
+		}
 	};
 
-	void Database::_wrapQuery( const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_ ) const {
-		if ( ! this->m_connection ) {
+	void Database::_release( const std::string& id_, sqlite3_stmt* statement_ ) const {
+		sqlite3_reset( statement_ );
+		sqlite3_clear_bindings( statement_ );
+
+		// Statements are finalized after the cache lock is released. Finalizing needs the connection mutex, which might
+		// be held by a transaction that is waiting for the cache lock.
+		sqlite3_stmt* finalize = NULL;
+		{
+			std::lock_guard<std::mutex> lock( this->m_statementsMutex );
+			if ( this->m_statementsIndex.find( id_ ) != this->m_statementsIndex.end() ) {
+				finalize = statement_;
+			} else {
+				this->m_statements.emplace_front( id_, statement_ );
+				this->m_statementsIndex[id_] = this->m_statements.begin();
+				if ( this->m_statements.size() > DATABASE_STATEMENT_CACHE_SIZE ) {
+					finalize = this->m_statements.back().second;
+					this->m_statementsIndex.erase( this->m_statements.back().first );
+					this->m_statements.pop_back();
+				}
+			}
+		}
+		sqlite3_finalize( finalize );
+	};
+
+	void Database::checkpoint() const {
+		// A passive checkpoint does not wait for readers, so it might not be able to checkpoint all the pages. The
+		// remaining pages are checkpointed the next time.
+		int pages, checkpointed;
+		this->_enter();
+		if ( SQLITE_OK == sqlite3_wal_checkpoint_v2( this->m_connection, NULL, SQLITE_CHECKPOINT_PASSIVE, &pages, &checkpointed ) ) {
+			Logger::logr( Logger::LogLevel::VERBOSE, this, "Checkpointed %d of %d pages.", checkpointed, pages );
+		} else {
+			const char* error = sqlite3_errmsg( this->m_connection );
+			Logger::logr( Logger::LogLevel::ERROR, this, "Checkpoint failed (%s).", error );
+		}
+		this->_leave();
+	};
+
+	unsigned int Database::vacuum( unsigned int pages_ ) const {
+		if ( this->getQueryValue<unsigned int>( "PRAGMA freelist_count" ) == 0 ) {
+			return 0;
+		}
+
+		// The incremental vacuum pragma returns a row for each page that is reclaimed. It's executed in a transaction
+		// to prevent it from being mixed with a batch of queued writes.
+		auto start = std::chrono::steady_clock::now();
+		unsigned int reclaimed = 0;
+		this->transaction( [this,pages_,&reclaimed]() {
+			Statement statement = this->prepare( "incremental_vacuum_" + std::to_string( pages_ ), "PRAGMA incremental_vacuum(" + std::to_string( pages_ ) + ")" );
+			while ( statement.step() ) {
+				reclaimed++;
+			}
+		} );
+		double duration = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+		Logger::logr( Logger::LogLevel::VERBOSE, this, "Reclaimed %u pages in %.1f ms, %u free pages left.", reclaimed, duration, this->getQueryValue<unsigned int>( "PRAGMA freelist_count" ) );
+		return reclaimed;
+	};
+
+	void Database::optimize() const {
+		this->putQuery( "PRAGMA optimize" );
+	};
+
+	bool Database::migrate() const {
+		// Rows are migrated newest first, so the recent history is available first. The pause after each chunk gives
+		// queued writes at least the same amount of time, during which the pool thread doesn't count as running.
+		Scheduler::Blocking blocking;
+		auto start = std::chrono::steady_clock::now();
+		unsigned long migrated = 0;
+		while (
+			this->m_migrations.size() > 0
+			&& std::chrono::steady_clock::now() - start < std::chrono::milliseconds( DATABASE_MIGRATE_MSEC )
+		) {
+			const auto& migration = this->m_migrations.front();
+			std::vector<std::string> rowids = this->getQueryColumn<std::string>(
+				"SELECT rowid "
+				"FROM `%s_legacy` "
+				"ORDER BY rowid DESC "
+				"LIMIT %d",
+				migration.first.c_str(),
+				DATABASE_MIGRATE_ROWS
+			);
+			if ( rowids.size() == 0 ) {
+				this->putQuery( "DROP TABLE `%s_legacy`", migration.first.c_str() );
+				Logger::logr( Logger::LogLevel::NORMAL, this, "Migration of %s completed.", migration.first.c_str() );
+				this->m_migrations.erase( this->m_migrations.begin() );
+				continue;
+			}
+
+			auto chunkStart = std::chrono::steady_clock::now();
+			if ( ! this->_migrate( migration, "rowid IN ( " + stringJoin( rowids, ", " ) + " )" ) ) {
+				this->m_migrations.erase( this->m_migrations.begin() );
+				continue;
+			}
+			migrated += rowids.size();
+			std::this_thread::sleep_for( std::chrono::steady_clock::now() - chunkStart );
+		}
+		if ( migrated > 0 ) {
+			Logger::logr( Logger::LogLevel::VERBOSE, this, "Migrated %lu rows.", migrated );
+		}
+		return this->m_migrations.size() == 0;
+	};
+
+	bool Database::_migrate( const std::pair<std::string, std::string>& migration_, const std::string& condition_ ) const {
+		// Rows of devices that no longer exist would violate the foreign key of the new table, they're deleted
+		// instead. If the rows cannot be copied for some other reason they're left in the legacy table.
+		std::string condition = "( " + condition_ + " ) AND `device_id` IN ( SELECT `id` FROM `devices` )";
+		try {
+			this->transaction( [this,&migration_,&condition_,&condition]() {
+				if ( this->putQuery( migration_.second, condition.c_str() ) < 0 ) {
+					throw std::runtime_error( "copy failed" );
+				}
+				this->putQuery( "DELETE FROM `%s_legacy` WHERE %s", migration_.first.c_str(), condition_.c_str() );
+			} );
+			return true;
+		} catch( const std::runtime_error& exception_ ) {
+			Logger::logr( Logger::LogLevel::ERROR, this, "Migration of %s failed, the remaining rows are kept in %s_legacy.", migration_.first.c_str(), migration_.first.c_str() );
+			return false;
+		}
+	};
+
+	std::vector<Database::Statistics> Database::getStatistics() const {
+		std::unordered_map<std::string, Statistics> queries;
+		for ( auto const& connection : this->m_statistics ) {
+			std::lock_guard<std::mutex> lock( connection.second->mutex );
+			for ( auto const& statistics : connection.second->queries ) {
+				Statistics& merged = queries[statistics.first];
+				if ( merged.executed == 0 ) {
+					merged.query = statistics.first;
+				}
+				merged.executed += statistics.second.executed;
+				merged.runtime += statistics.second.runtime;
+				merged.maximum = std::max( merged.maximum, statistics.second.maximum );
+				merged.rows += statistics.second.rows;
+				merged.wait += statistics.second.wait;
+			}
+		}
+		std::vector<Statistics> result;
+		result.reserve( queries.size() );
+		for ( auto const& statistics : queries ) {
+			result.push_back( statistics.second );
+		}
+		return result;
+	};
+
+	void Database::setSlowQueryThreshold( unsigned int threshold_ ) {
+		this->m_slowQueryThreshold = threshold_;
+	};
+
+	void Database::transaction( const std::function<void()>&& func_ ) const {
+		// The connection mutex is held for the entire transaction, so queries of other threads on the primary
+		// connection wait for it to end instead of becoming part of it (and being rolled back with it). The mutex is
+		// recursive, the queries of the transaction itself are therefore not blocked.
+		this->_enter();
+		this->putQuery( "BEGIN TRANSACTION" );
+		try {
+			func_();
+		} catch( ... ) {
+			this->putQuery( "ROLLBACK" );
+			this->_leave();
+			throw; // re-throw exception
+		}
+		this->putQuery( "COMMIT" );
+		this->_leave();
+	};
+
+	void Database::_queueWrite( Durability durability_, t_write&& write_ ) const {
+		std::unique_lock<std::mutex> lock( this->m_writesMutex );
+		auto find = this->m_writesIndex.find( write_.key );
+		if ( find != this->m_writesIndex.end() ) {
+			this->m_writes[find->second] = std::move( write_ );
+		} else {
+			if ( write_.key.size() > 0 ) {
+				this->m_writesIndex[write_.key] = this->m_writes.size();
+			}
+			this->m_writes.push_back( std::move( write_ ) );
+		}
+		unsigned long long sequence = ++this->m_writesQueued;
+		if ( durability_ == Durability::COMMITTED ) {
+			// The writer thread is asked to commit the pending batch right away instead of letting the caller wait
+			// for the remainder of the interval.
+			this->m_flush = true;
+			this->m_writesCondition.notify_one();
+			this->m_committedCondition.wait( lock, [this,sequence]() {
+				return this->m_writesCommitted >= sequence;
+			} );
+		} else if (
+			this->m_writes.size() == 1
+			|| this->m_writes.size() >= this->m_writeBatchSize
+		) {
+			this->m_writesCondition.notify_one();
+		}
+	};
+
+	void Database::flush() const {
+		std::unique_lock<std::mutex> lock( this->m_writesMutex );
+		unsigned long long sequence = this->m_writesQueued;
+		if ( this->m_writes.size() > 0 ) {
+			this->m_flush = true;
+			this->m_writesCondition.notify_one();
+		}
+		this->m_committedCondition.wait( lock, [this,sequence]() {
+			return this->m_writesCommitted >= sequence;
+		} );
+	};
+
+	void Database::_writer() {
+		std::unique_lock<std::mutex> lock( this->m_writesMutex );
+		while ( true ) {
+			this->m_writesCondition.wait( lock, [this]() {
+				return this->m_shutdown || this->m_checkpoint || this->m_writes.size() > 0;
+			} );
+
+			if ( this->m_writes.size() > 0 ) {
+				// Writes are accumulated until the interval has passed or the batch is complete.
+				this->m_writesCondition.wait_until( lock, std::chrono::steady_clock::now() + this->m_writeInterval, [this]() {
+					return this->m_shutdown || this->m_flush || this->m_writes.size() >= this->m_writeBatchSize;
+				} );
+				std::deque<t_write> writes;
+				writes.swap( this->m_writes );
+				this->m_writesIndex.clear();
+				unsigned long long sequence = this->m_writesQueued;
+				this->m_flush = false;
+				lock.unlock();
+
+				this->transaction( [this,&writes]() {
+					for ( auto writesIt = writes.begin(); writesIt != writes.end(); writesIt++ ) {
+						Statement statement = this->prepare( writesIt->id, writesIt->query );
+						writesIt->bind( statement );
+						statement.step();
+					}
+				} );
+
+				lock.lock();
+				this->m_writesCommitted = sequence;
+				this->m_committedCondition.notify_all();
+			}
+
+			if ( this->m_checkpoint ) {
+				this->m_checkpoint = false;
+				lock.unlock();
+				this->checkpoint();
+				lock.lock();
+			}
+
+			if (
+				this->m_shutdown
+				&& this->m_writes.size() == 0
+			) {
+				break;
+			}
+		}
+	};
+
+	sqlite3* Database::_acquireReader( unsigned long long& wait_ ) const {
+		if ( this->m_readers.size() == 0 ) {
+			return this->m_connection;
+		}
+		std::unique_lock<std::mutex> lock( this->m_readersMutex );
+		this->m_readAcquisitions++;
+		if ( this->m_availableReaders.size() == 0 ) {
+			auto start = std::chrono::steady_clock::now();
+			this->m_readersCondition.wait( lock, [this]() {
+				return this->m_availableReaders.size() > 0;
+			} );
+			wait_ += std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+			this->m_readWait += wait_;
+		}
+		sqlite3* connection = this->m_availableReaders.back();
+		this->m_availableReaders.pop_back();
+		return connection;
+	};
+
+	void Database::_releaseReader( sqlite3* connection_ ) const {
+		if ( connection_ != this->m_connection ) {
+			{
+				std::lock_guard<std::mutex> lock( this->m_readersMutex );
+				this->m_availableReaders.push_back( connection_ );
+			}
+			this->m_readersCondition.notify_one();
+		}
+	};
+
+	unsigned long long Database::_enter( bool acquisition_ ) const {
+		// The primary connection is opened in serialized mode. The connection mutex is held for the duration of an
+		// entire query, which also keeps error messages and insert ids from being mixed up between threads. Queries
+		// that are stepped through row by row enter once per row but are only counted as a single acquisition.
+		sqlite3_mutex* mutex = sqlite3_db_mutex( this->m_connection );
+		if ( acquisition_ ) {
+			this->m_writeAcquisitions++;
+		}
+		unsigned long long wait = 0;
+		if ( SQLITE_BUSY == sqlite3_mutex_try( mutex ) ) {
+			auto start = std::chrono::steady_clock::now();
+			sqlite3_mutex_enter( mutex );
+			wait = std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+			this->m_writeWait += wait;
+		}
+		return wait;
+	};
+
+	void Database::_leave() const {
+		sqlite3_mutex_leave( sqlite3_db_mutex( this->m_connection ) );
+	};
+
+	void Database::_profile( sqlite3* connection_, const std::string& query_, const char* sql_, unsigned long long runtime_, unsigned long long rows_, unsigned long long wait_ ) const {
+		auto find = this->m_statistics.find( connection_ );
+		if ( find != this->m_statistics.end() ) {
+			std::lock_guard<std::mutex> lock( find->second->mutex );
+			Statistics& statistics = find->second->queries[query_];
+			if ( statistics.executed == 0 ) {
+				statistics.query = query_;
+			}
+			statistics.executed++;
+			statistics.runtime += runtime_;
+			statistics.maximum = std::max( statistics.maximum, runtime_ );
+			statistics.rows += rows_;
+			statistics.wait += wait_;
+		}
+
+		unsigned int threshold = this->m_slowQueryThreshold;
+		if (
+			threshold > 0
+			&& runtime_ >= threshold * 1000ULL
+		) {
+			Logger::logr( Logger::LogLevel::WARNING, this, "Slow query took %.1f ms, returned %llu rows and waited %.1f ms (%s).", runtime_ / 1000., rows_, wait_ / 1000., sql_ );
+		}
+	};
+
+	void Database::_wrapReadQuery( const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_ ) const {
+		unsigned long long wait = 0;
+		sqlite3* connection = this->_acquireReader( wait );
+		try {
+			this->_wrapQuery( connection, query_, arguments_, std::move( process_ ), wait );
+		} catch( ... ) {
+			this->_releaseReader( connection );
+			throw; // re-throw exception
+		}
+		this->_releaseReader( connection );
+	};
+
+	void Database::_wrapQuery( sqlite3* connection_, const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_, unsigned long long wait_ ) const {
+		if ( ! connection_ ) {
 			Logger::log( Logger::LogLevel::ERROR, this, "Database not open." );
 			return;
 		}
@@ -370,23 +927,233 @@ namespace micasa {
 		Logger::log( Logger::LogLevel::DEBUG, this, std::string( query ) );
 #endif // _DEBUG
 
+		bool primary = ( connection_ == this->m_connection );
+		if ( primary ) {
+			wait_ += this->_enter();
+		}
+		auto start = std::chrono::steady_clock::now();
+		unsigned long long rows = g_rows;
 		sqlite3_stmt *statement;
-		if ( SQLITE_OK == sqlite3_prepare_v2( this->m_connection, query, -1, &statement, NULL ) ) {
+		if ( SQLITE_OK == sqlite3_prepare_v2( connection_, query, -1, &statement, NULL ) ) {
+			g_statement = statement;
 			try {
 				process_( statement );
 			} catch( ... ) {
+				g_statement = NULL;
 				sqlite3_finalize( statement );
+				if ( primary ) {
+					this->_leave();
+				}
+				// Queries that throw because they have no results are still executed, so they are profiled too.
+				this->_profile( connection_, query_, query, std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count(), g_rows - rows, wait_ );
 				sqlite3_free( query );
 				throw; // re-throw exception
 			}
+			g_statement = NULL;
 			sqlite3_finalize( statement );
 			this->m_queries++;
+			if ( primary ) {
+				this->_leave();
+			}
+			this->_profile( connection_, query_, query, std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count(), g_rows - rows, wait_ );
 		} else {
-			const char* error = sqlite3_errmsg( this->m_connection );
+			const char* error = sqlite3_errmsg( connection_ );
 			Logger::logr( Logger::LogLevel::ERROR, this, "Query rejected (%s).", error );
+			if ( primary ) {
+				this->_leave();
+			}
 		}
 
 		sqlite3_free( query );
 	};
 
+	Database::Statement::Statement( const Database* database_, const std::string& id_, sqlite3_stmt* statement_ ) :
+		Row( statement_ ),
+		m_database( database_ ),
+		m_id( id_ ),
+		m_executed( false ),
+		m_runtime( 0 ),
+		m_rows( 0 ),
+		m_wait( 0 )
+	{
+	};
+
+	Database::Statement::Statement( Statement&& other_ ) :
+		Row( other_.m_statement ),
+		m_database( other_.m_database ),
+		m_id( other_.m_id ),
+		m_executed( other_.m_executed ),
+		m_runtime( other_.m_runtime ),
+		m_rows( other_.m_rows ),
+		m_wait( other_.m_wait )
+	{
+		other_.m_statement = NULL;
+	};
+
+	Database::Statement::~Statement() {
+		if ( this->m_statement ) {
+			this->_finish();
+			this->m_database->_release( this->m_id, this->m_statement );
+		}
+	};
+
+	bool Database::Statement::step() {
+		if ( ! this->m_statement ) {
+			return false;
+		}
+		bool first = ! this->m_executed;
+		if ( first ) {
+			this->m_executed = true;
+			this->m_database->m_queries++;
+#ifdef _DEBUG
+			Logger::log( Logger::LogLevel::DEBUG, this->m_database, std::string( sqlite3_sql( this->m_statement ) ) );
+#endif // _DEBUG
+		}
+		this->m_wait += this->m_database->_enter( first );
+		auto start = std::chrono::steady_clock::now();
+		int result = sqlite3_step( this->m_statement );
+		this->m_runtime += std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+		if ( SQLITE_ROW == result ) {
+			this->m_database->_leave();
+			this->m_rows++;
+			return true;
+		} else if ( SQLITE_DONE != result ) {
+			const char* error = sqlite3_errmsg( this->m_database->m_connection );
+			Logger::logr( Logger::LogLevel::ERROR, this->m_database, "Query rejected (%s).", error );
+		}
+		this->m_database->_leave();
+		this->_finish();
+		return false;
+	};
+
+	void Database::Statement::reset() {
+		if ( this->m_statement ) {
+			this->_finish();
+			sqlite3_reset( this->m_statement );
+		}
+	};
+
+	long Database::Statement::getInsertId() const {
+		return sqlite3_last_insert_rowid( this->m_database->m_connection );
+	};
+
+	void Database::Statement::_finish() {
+		// An execution ends when all rows have been stepped through or when the statement is reset before that.
+		if ( this->m_executed ) {
+			this->m_database->_profile( this->m_database->m_connection, sqlite3_sql( this->m_statement ), sqlite3_sql( this->m_statement ), this->m_runtime, this->m_rows, this->m_wait );
+			this->m_executed = false;
+			this->m_runtime = this->m_rows = this->m_wait = 0;
+		}
+	};
+
+	void Database::Statement::_bindValue( int index_, int value_ ) {
+		sqlite3_bind_int( this->m_statement, index_, value_ );
+	};
+
+	void Database::Statement::_bindValue( int index_, unsigned int value_ ) {
+		sqlite3_bind_int64( this->m_statement, index_, value_ );
+	};
+
+	void Database::Statement::_bindValue( int index_, long value_ ) {
+		sqlite3_bind_int64( this->m_statement, index_, value_ );
+	};
+
+	void Database::Statement::_bindValue( int index_, unsigned long value_ ) {
+		sqlite3_bind_int64( this->m_statement, index_, static_cast<sqlite3_int64>( value_ ) );
+	};
+
+	void Database::Statement::_bindValue( int index_, double value_ ) {
+		sqlite3_bind_double( this->m_statement, index_, value_ );
+	};
+
+	void Database::Statement::_bindValue( int index_, const std::string& value_ ) {
+		sqlite3_bind_text( this->m_statement, index_, value_.c_str(), value_.size(), SQLITE_TRANSIENT );
+	};
+
+	void Database::Statement::_bindValue( int index_, const char* value_ ) {
+		sqlite3_bind_text( this->m_statement, index_, value_, -1, SQLITE_TRANSIENT );
+	};
+
+	Database::Cursor::Cursor( const Database* database_, sqlite3* connection_, sqlite3_stmt* statement_, const std::string& query_, unsigned long long runtime_, unsigned long long wait_ ) :
+		Row( statement_ ),
+		m_database( database_ ),
+		m_connection( connection_ ),
+		m_query( query_ ),
+		m_executed( false ),
+		m_runtime( runtime_ ),
+		m_rows( 0 ),
+		m_wait( wait_ )
+	{
+	};
+
+	Database::Cursor::Cursor( Cursor&& other_ ) :
+		Row( other_.m_statement ),
+		m_database( other_.m_database ),
+		m_connection( other_.m_connection ),
+		m_query( std::move( other_.m_query ) ),
+		m_executed( other_.m_executed ),
+		m_runtime( other_.m_runtime ),
+		m_rows( other_.m_rows ),
+		m_wait( other_.m_wait )
+	{
+		other_.m_statement = NULL;
+		other_.m_connection = NULL;
+	};
+
+	Database::Cursor::~Cursor() {
+		if ( this->m_statement ) {
+			this->_finish();
+			sqlite3_finalize( this->m_statement );
+		}
+		if ( this->m_connection ) {
+			this->m_database->_releaseReader( this->m_connection );
+		}
+	};
+
+	bool Database::Cursor::next() {
+		if ( ! this->m_statement ) {
+			return false;
+		}
+		bool first = ! this->m_executed;
+		if ( first ) {
+			this->m_executed = true;
+			this->m_database->m_queries++;
+		}
+
+		// The primary connection is only handed out by the read pool while the schema is being initialized.
+		bool primary = ( this->m_connection == this->m_database->m_connection );
+		if ( primary ) {
+			this->m_wait += this->m_database->_enter( first );
+		}
+		auto start = std::chrono::steady_clock::now();
+		int result = sqlite3_step( this->m_statement );
+		this->m_runtime += std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - start ).count();
+		if (
+			SQLITE_ROW != result
+			&& SQLITE_DONE != result
+		) {
+			const char* error = sqlite3_errmsg( this->m_connection );
+			Logger::logr( Logger::LogLevel::ERROR, this->m_database, "Query rejected (%s).", error );
+		}
+		if ( primary ) {
+			this->m_database->_leave();
+		}
+		if ( SQLITE_ROW == result ) {
+			this->m_rows++;
+			return true;
+		}
+		this->_finish();
+		return false;
+	};
+
+	void Database::Cursor::_finish() {
+		// The time spent by the caller on processing the rows is not included, only the time spent stepping through
+		// them.
+		if ( this->m_executed ) {
+			this->m_database->_profile( this->m_connection, this->m_query, sqlite3_sql( this->m_statement ), this->m_runtime, this->m_rows, this->m_wait );
+			this->m_executed = false;
+			this->m_runtime = this->m_rows = this->m_wait = 0;
+		}
+	};
+
 } // namespace micasa
@@ -3,11 +3,44 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
 
 #include <sqlite3.h>
 
 #include "json.hpp"
 
+// The number of prepared statements that are kept in the statement cache. The least recently used statement is
+// finalized when the cache is full.
+#define DATABASE_STATEMENT_CACHE_SIZE 64
+
+// Queued writes are committed in a single transaction by the writer thread, at most this many milliseconds after the
+// first write of a batch was queued or as soon as the batch contains this many writes.
+#define DATABASE_WRITE_INTERVAL_MSEC 1000
+#define DATABASE_WRITE_BATCH_SIZE 500
+
+// Read queries are executed on a pool of read-only connections so they do not block writes, which are executed on
+// the primary connection.
+#define DATABASE_READ_CONNECTIONS 3
+
+// The wal file is checkpointed by the writer thread when it contains at least this many pages.
+#define DATABASE_CHECKPOINT_PAGES 1000
+
+// The maximum number of free pages that are reclaimed by a single incremental vacuum step.
+#define DATABASE_VACUUM_PAGES 256
+
+// Rows of legacy tables are migrated in chunks of this many rows, each in its own transaction, for at most this many
+// milliseconds per run of the maintenance task.
+#define DATABASE_MIGRATE_ROWS 2000
+#define DATABASE_MIGRATE_MSEC 1000
+
 namespace micasa {
 
 	class Database final {
@@ -25,7 +58,142 @@ namespace micasa {
 			using runtime_error::runtime_error;
 		}; // class InvalidResultException
 
-		Database();
+		enum class Durability: unsigned short {
+			QUEUED = 0, // returns as soon as the write is queued
+			COMMITTED // returns after the write is committed
+		}; // enum class Durability
+
+		// ===
+		// Row
+		// ===
+
+		// Typed access to the columns of the current row of a statement or cursor. Values are read directly from the
+		// statement, without converting them to and from strings. The const char* variant points into the statement
+		// and is only valid until the next row is fetched, use getSize to obtain it's length in bytes.
+		class Row {
+
+			friend class Database;
+
+		public:
+			template<typename T> T get( int column_ ) const;
+			size_t getSize( int column_ ) const;
+			bool isNull( int column_ ) const;
+
+		protected:
+			sqlite3_stmt* m_statement;
+
+			Row( sqlite3_stmt* statement_ ) : m_statement( statement_ ) { };
+
+		}; // class Row
+
+		// =========
+		// Statement
+		// =========
+
+		// A prepared statement that is checked out from the statement cache. Parameters are bound natively, without
+		// formatting them into the query, in the order they are passed starting at index 1. The statement is reset
+		// and handed back to the cache when the instance is destructed.
+		class Statement final : public Row {
+
+			friend class Database;
+
+		public:
+			Statement( Statement&& other_ );
+			~Statement();
+
+			Statement( const Statement& ) = delete; // do not copy
+			Statement& operator=( const Statement& ) = delete; // do not copy-assign
+			Statement& operator=( Statement&& ) = delete; // do not move-assign
+
+			template<typename... A> Statement& bind( const A&... arguments_ ) {
+				this->_bind( 1, arguments_... );
+				return *this;
+			};
+			bool step();
+			void reset();
+			long getInsertId() const;
+
+		private:
+			const Database* m_database;
+			const std::string m_id;
+			bool m_executed;
+			unsigned long long m_runtime;
+			unsigned long long m_rows;
+			unsigned long long m_wait;
+
+			Statement( const Database* database_, const std::string& id_, sqlite3_stmt* statement_ );
+
+			void _finish();
+
+			void _bind( int ) { };
+			template<typename F, typename... A> void _bind( int index_, const F& first_, const A&... rest_ ) {
+				this->_bindValue( index_, first_ );
+				this->_bind( index_ + 1, rest_... );
+			};
+			void _bindValue( int index_, int value_ );
+			void _bindValue( int index_, unsigned int value_ );
+			void _bindValue( int index_, long value_ );
+			void _bindValue( int index_, unsigned long value_ );
+			void _bindValue( int index_, double value_ );
+			void _bindValue( int index_, const std::string& value_ );
+			void _bindValue( int index_, const char* value_ );
+
+		}; // class Statement
+
+		// ======
+		// Cursor
+		// ======
+
+		// A read query that yields it's rows one at a time instead of collecting the entire resultset in memory. The
+		// cursor holds on to a connection from the read pool until it is destructed, so it should be kept no longer
+		// than needed and never more than one per thread.
+		class Cursor final : public Row {
+
+			friend class Database;
+
+		public:
+			Cursor( Cursor&& other_ );
+			~Cursor();
+
+			Cursor( const Cursor& ) = delete; // do not copy
+			Cursor& operator=( const Cursor& ) = delete; // do not copy-assign
+			Cursor& operator=( Cursor&& ) = delete; // do not move-assign
+
+			bool next();
+
+		private:
+			const Database* m_database;
+			sqlite3* m_connection;
+			std::string m_query;
+			bool m_executed;
+			unsigned long long m_runtime;
+			unsigned long long m_rows;
+			unsigned long long m_wait;
+
+			Cursor( const Database* database_, sqlite3* connection_, sqlite3_stmt* statement_, const std::string& query_ = "", unsigned long long runtime_ = 0, unsigned long long wait_ = 0 );
+
+			void _finish();
+
+		}; // class Cursor
+
+		// ==========
+		// Statistics
+		// ==========
+
+		// The aggregated executions of a single query. Queries are identified by the query before the arguments are
+		// formatted into it, or by the sql of the prepared statement, so all executions of a query are aggregated
+		// regardless of their arguments. Times are in microseconds, the wait is the time spent waiting for a
+		// connection.
+		struct Statistics {
+			std::string query;
+			unsigned long long executed;
+			unsigned long long runtime;
+			unsigned long long maximum;
+			unsigned long long rows;
+			unsigned long long wait;
+		}; // struct Statistics
+
+		Database( unsigned int writeInterval_ = 0, unsigned int writeBatchSize_ = 0 );
 		~Database();
 
 		Database( const Database& ) = delete; // do not copy
@@ -42,15 +210,126 @@ namespace micasa {
 		template<typename T> std::vector<T> getQueryColumn( const std::string query_, ... ) const;
 		std::map<std::string, std::string> getQueryMap( const std::string query_, ... ) const ;
 		template<typename T> T getQueryValue( const std::string query_, ... ) const;
+		Cursor getCursor( const std::string query_, ... ) const;
 		long putQuery( const std::string query_, ... ) const;
 		int getLastErrorCode() const;
 
+		// Statements are cached by their id, which should therefore uniquely identify the query.
+		Statement prepare( const std::string& id_, const std::string& query_ ) const;
+
+		// Writes that do not need to be visible immediately, such as device history, are queued and executed by the
+		// writer thread as a prepared statement. The arguments are copied, so it is safe to pass temporaries.
+		template<typename... A> void queueQuery( Durability durability_, const std::string& id_, const std::string& query_, const A&... arguments_ ) const {
+			this->_queueQuery( durability_, "", id_, query_, Database::_copy( arguments_ )... );
+		};
+
+		// Queued writes with the same key replace each other until they are committed, so only the last one is
+		// executed. This is meant for writes that store the latest state of something, which may change many times
+		// within a single batch.
+		template<typename... A> void coalesceQuery( Durability durability_, const std::string& key_, const std::string& id_, const std::string& query_, const A&... arguments_ ) const {
+			this->_queueQuery( durability_, key_, id_, query_, Database::_copy( arguments_ )... );
+		};
+
+		// Waits until all writes that were queued before the call are committed.
+		void flush() const;
+
+		// Runs the function in a single transaction. Other threads cannot use the primary connection until the
+		// transaction ends, so do not wait for queued writes to be committed, or for anything else that needs the
+		// database, from within the function.
+		void transaction( const std::function<void()>&& func_ ) const;
+
+		// Maintenance, which is scheduled by the controller. All of these are safe to run while the database is in
+		// use.
+		void checkpoint() const;
+		unsigned int vacuum( unsigned int pages_ = DATABASE_VACUUM_PAGES ) const;
+		void optimize() const;
+		bool migrate() const; // returns true once all legacy tables have been migrated
+
+		std::vector<Statistics> getStatistics() const;
+
+		// Executions that take longer than the threshold, in milliseconds, are logged. Zero disables the slow query
+		// log. The threshold is zero until the system plugin sets it from its slow_query_threshold setting, which
+		// defaults to SYSTEM_DEFAULT_SLOW_QUERY_THRESHOLD (250 milliseconds).
+		void setSlowQueryThreshold( unsigned int threshold_ );
+
 	private:
+		typedef std::list<std::pair<std::string, sqlite3_stmt*>> t_statements;
+
+		struct t_write {
+			std::string key;
+			std::string id;
+			std::string query;
+			std::function<void( Statement& )> bind;
+		}; // struct t_write
+
+		struct t_statistics {
+			std::mutex mutex;
+			std::unordered_map<std::string, Statistics> queries;
+		}; // struct t_statistics
+
 		sqlite3 *m_connection;
-		mutable unsigned long long m_queries;
+		mutable std::atomic<unsigned long long> m_queries;
+
+		// The statement cache is ordered from most to least recently used. Statements that are checked out are
+		// removed from the cache until they are handed back, so a statement is only used by one thread at a time.
+		mutable t_statements m_statements;
+		mutable std::unordered_map<std::string, t_statements::iterator> m_statementsIndex;
+		mutable std::mutex m_statementsMutex;
+
+		const std::chrono::milliseconds m_writeInterval;
+		const size_t m_writeBatchSize;
+		mutable std::deque<t_write> m_writes;
+		mutable std::unordered_map<std::string, size_t> m_writesIndex; // position of coalesced writes in m_writes
+		mutable unsigned long long m_writesQueued;
+		mutable unsigned long long m_writesCommitted;
+		mutable bool m_flush;
+		bool m_shutdown;
+		mutable std::mutex m_writesMutex;
+		mutable std::condition_variable m_writesCondition;
+		mutable std::condition_variable m_committedCondition;
+		std::thread m_writer;
+
+		std::vector<sqlite3*> m_readers;
+		mutable std::vector<sqlite3*> m_availableReaders;
+		mutable std::mutex m_readersMutex;
+		mutable std::condition_variable m_readersCondition;
+
+		mutable bool m_checkpoint;
+
+		// The statistics are kept per connection, so that queries on different connections don't contend for a
+		// single mutex. Connections are only added in the constructor, before any queries are profiled.
+		std::unordered_map<sqlite3*, std::unique_ptr<t_statistics>> m_statistics;
+		std::atomic<unsigned int> m_slowQueryThreshold;
+
+		// The legacy tables that still need to be migrated, see c_migrations. Only used by _init and migrate.
+		mutable std::vector<std::pair<std::string, std::string>> m_migrations;
+
+		// The number of times a connection was acquired and the total time spent waiting for it, in microseconds.
+		mutable std::atomic<unsigned long long> m_readAcquisitions;
+		mutable std::atomic<unsigned long long> m_readWait;
+		mutable std::atomic<unsigned long long> m_writeAcquisitions;
+		mutable std::atomic<unsigned long long> m_writeWait;
+
+		template<typename T> static const T& _copy( const T& value_ ) { return value_; };
+		static std::string _copy( const char* value_ ) { return std::string( value_ ); };
+		template<typename... A> void _queueQuery( Durability durability_, const std::string& key_, const std::string& id_, const std::string& query_, A... arguments_ ) const {
+			this->_queueWrite( durability_, { key_, id_, query_, [arguments_...]( Statement& statement_ ) {
+				statement_.bind( arguments_... );
+			} } );
+		};
 
 		void _init() const;
-		void _wrapQuery( const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_ ) const;
+		void _release( const std::string& id_, sqlite3_stmt* statement_ ) const;
+		void _queueWrite( Durability durability_, t_write&& write_ ) const;
+		void _writer();
+		sqlite3* _acquireReader( unsigned long long& wait_ ) const;
+		void _releaseReader( sqlite3* connection_ ) const;
+		bool _migrate( const std::pair<std::string, std::string>& migration_, const std::string& condition_ ) const;
+		unsigned long long _enter( bool acquisition_ = true ) const;
+		void _leave() const;
+		void _profile( sqlite3* connection_, const std::string& query_, const char* sql_, unsigned long long runtime_, unsigned long long rows_, unsigned long long wait_ ) const;
+		void _wrapQuery( sqlite3* connection_, const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_, unsigned long long wait_ = 0 ) const;
+		void _wrapReadQuery( const std::string& query_, va_list arguments_, const std::function<void(sqlite3_stmt*)>&& process_ ) const;
 
 	}; // class Database
 
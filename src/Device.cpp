@@ -28,18 +28,23 @@ namespace micasa {
 		{ Device::Type::TEXT, "text" },
 	};
 
-	Device::Device( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
+	Device::Device( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Hydration* hydration_ ) :
 		m_plugin( plugin_ ),
 		m_id( id_ ),
 		m_reference( reference_ ),
 		m_enabled( enabled_ ),
-		m_label( label_ )
+		m_label( label_ ),
+		m_scheduler( "Device " + std::to_string( id_ ) + " (" + label_ + ")" )
 	{
 #ifdef _DEBUG
 		assert( g_controller && "Global Controller instance should be created before Device instances." );
 		assert( g_database && "Global Database instance should be created before Device instances." );
 #endif // _DEBUG
-		this->m_settings = std::make_shared<Settings<Device>>( *this );
+		if ( hydration_ != nullptr ) {
+			this->m_settings = std::make_shared<Settings<Device>>( *this, hydration_->settings );
+		} else {
+			this->m_settings = std::make_shared<Settings<Device>>( *this );
+		}
 	};
 
 	Device::~Device() {
@@ -66,6 +71,7 @@ namespace micasa {
 				"WHERE `id`=%d"
 				, label_.c_str(), this->m_id
 			);
+			g_controller->indexDevice( this->shared_from_this() );
 		}
 	};
 
@@ -101,24 +107,131 @@ namespace micasa {
 	template Switch::t_value Device::getValue<Switch>() const;
 	template Text::t_value Device::getValue<Text>() const;
 
-	std::shared_ptr<Device> Device::factory( std::weak_ptr<Plugin> plugin_, const Type type_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) {
+	std::shared_ptr<Device> Device::factory( std::weak_ptr<Plugin> plugin_, const Type type_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Hydration* hydration_ ) {
 		switch( type_ ) {
 			case Type::COUNTER:
-				return std::make_shared<Counter>( plugin_, id_, reference_, label_, enabled_ );
+				return std::make_shared<Counter>( plugin_, id_, reference_, label_, enabled_, hydration_ );
 				break;
 			case Type::LEVEL:
-				return std::make_shared<Level>( plugin_, id_, reference_, label_, enabled_ );
+				return std::make_shared<Level>( plugin_, id_, reference_, label_, enabled_, hydration_ );
 				break;
 			case Type::SWITCH:
-				return std::make_shared<Switch>( plugin_, id_, reference_, label_, enabled_ );
+				return std::make_shared<Switch>( plugin_, id_, reference_, label_, enabled_, hydration_ );
 				break;
 			case Type::TEXT:
-				return std::make_shared<Text>( plugin_, id_, reference_, label_, enabled_ );
+				return std::make_shared<Text>( plugin_, id_, reference_, label_, enabled_, hydration_ );
 				break;
 		}
 		return nullptr;
 	};
 
+	std::unordered_map<unsigned int, Device::Hydration> Device::hydrate() {
+		std::unordered_map<unsigned int, Hydration> result;
+
+		// Devices without settings or state are included too, otherwise they would fetch them themselves.
+		{
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT `id` "
+				"FROM `devices`"
+			);
+			while ( cursor.next() ) {
+				result[cursor.get<unsigned int>( 0 )];
+			}
+		}
+
+		// All settings are fetched in a single scan of the settings table, which is considerably faster than joining
+		// them with the devices.
+		{
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT `device_id`, `key`, `value` "
+				"FROM `device_settings`"
+			);
+			while ( cursor.next() ) {
+				result[cursor.get<unsigned int>( 0 )].settings[cursor.get<std::string>( 1 )] = cursor.get<std::string>( 2 );
+			}
+		}
+
+		// The state of all devices is fetched in a single scan of the state table. The value is stored as FLOAT for
+		// level and counter devices and as TEXT for switch and text devices, the timestamps are read as 64 bit.
+		{
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT `device_state`.`device_id`, `devices`.`type` IN ( 'level', 'counter' ), `device_state`.`value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - `device_state`.`timestamp`, `device_state`.`source` "
+				"FROM `device_state` "
+				"JOIN `devices` ON `devices`.`id` = `device_state`.`device_id`"
+			);
+			while ( cursor.next() ) {
+				json& last = result[cursor.get<unsigned int>( 0 )].last;
+				if ( cursor.get<int>( 1 ) ) {
+					last["value"] = cursor.get<double>( 2 );
+				} else {
+					last["value"] = cursor.get<std::string>( 2 );
+				}
+				last["age"] = cursor.get<long>( 3 );
+				last["source"] = cursor.get<unsigned int>( 4 );
+			}
+		}
+
+		// Devices that have history but no state yet fall back to the last entry in their history. The subqueries only
+		// search the history of the devices without state.
+		for ( auto const &table : { "level", "counter", "switch", "text" } ) {
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT `id`, ( "
+					"SELECT `value` "
+					"FROM `device_%s_history` "
+					"WHERE `device_id` = `devices`.`id` "
+					"ORDER BY `timestamp` DESC "
+					"LIMIT 1 "
+				") AS `value`, ( "
+					"SELECT CAST( strftime( '%%s', 'now' ) AS INTEGER ) - `timestamp` "
+					"FROM `device_%s_history` "
+					"WHERE `device_id` = `devices`.`id` "
+					"ORDER BY `timestamp` DESC "
+					"LIMIT 1 "
+				") AS `age` "
+				"FROM `devices` "
+				"WHERE `type` = %Q "
+				"AND `id` NOT IN ( "
+					"SELECT `device_id` "
+					"FROM `device_state` "
+				")",
+				table,
+				table,
+				table
+			);
+			bool numeric = std::string( table ) == "level" || std::string( table ) == "counter";
+			while ( cursor.next() ) {
+				if ( ! cursor.isNull( 1 ) ) {
+					json& last = result[cursor.get<unsigned int>( 0 )].last;
+					if ( numeric ) {
+						last["value"] = cursor.get<double>( 1 );
+					} else {
+						last["value"] = cursor.get<std::string>( 1 );
+					}
+					last["age"] = cursor.get<long>( 2 );
+					last["source"] = 0;
+				}
+			}
+		}
+
+		return result;
+	};
+
+	template<typename V> void Device::_storeState( const V& value_, const UpdateSource& source_ ) const {
+		g_database->coalesceQuery(
+			Database::Durability::QUEUED,
+			"device_state." + std::to_string( this->m_id ),
+			"device_state.replace",
+			"REPLACE INTO `device_state` ( `device_id`, `value`, `timestamp`, `source` ) "
+			"VALUES ( ?, ?, ?, ? )",
+			this->m_id,
+			value_,
+			std::chrono::system_clock::to_time_t( std::chrono::system_clock::now() ),
+			Device::resolveUpdateSource( source_ )
+		);
+	};
+	template void Device::_storeState( const double& value_, const UpdateSource& source_ ) const;
+	template void Device::_storeState( const std::string& value_, const UpdateSource& source_ ) const;
+
 	json Device::getJson() const {
 		json result = json::object();
 
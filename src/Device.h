@@ -5,6 +5,7 @@
 #include <mutex>
 #include <memory>
 #include <map>
+#include <unordered_map>
 #include <chrono>
 
 #include "Settings.h"
@@ -53,6 +54,17 @@ namespace micasa {
 		}; // enum UpdateSource
 		ENUM_UTIL( UpdateSource );
 
+		// =========
+		// Hydration
+		// =========
+
+		// The stored state of a device that is needed to construct it. At startup the state of all devices is fetched
+		// at once by the hydrate method, instead of each device querying its own last value and settings.
+		struct Hydration {
+			nlohmann::json last; // the value, age and source of the last update, null if there is none
+			std::map<std::string, std::string> settings;
+		}; // struct Hydration
+
 		static const char* settingsName;
 
 		Device( const Device& ) = delete; // Do not copy!
@@ -63,8 +75,10 @@ namespace micasa {
 		virtual ~Device();
 		friend std::ostream& operator<<( std::ostream& out_, const Device* device_ );
 
-		// This is the preferred way to create a device of specific type (hence the protected constructor).
-		static std::shared_ptr<Device> factory( std::weak_ptr<Plugin> plugin_, const Type type_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ );
+		// This is the preferred way to create a device of specific type (hence the protected constructor). Without
+		// hydration the device fetches it's own stored state.
+		static std::shared_ptr<Device> factory( std::weak_ptr<Plugin> plugin_, const Type type_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Hydration* hydration_ = nullptr );
+		static std::unordered_map<unsigned int, Hydration> hydrate();
 
 		unsigned int getId() const { return this->m_id; };
 		std::string getReference() const { return this->m_reference; };
@@ -95,7 +109,11 @@ namespace micasa {
 		Scheduler m_scheduler;
 		std::shared_ptr<Settings<Device>> m_settings;
 
-		Device( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ );
+		Device( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Hydration* hydration_ );
+
+		// Stores the current value in the state table it's restored from at startup. The writes are coalesced, so a
+		// device that is updated frequently only writes it's state once per batch of queued writes.
+		template<typename V> void _storeState( const V& value_, const UpdateSource& source_ ) const;
 
 	}; // class Device
 
@@ -202,7 +202,7 @@ namespace micasa {
 	// Network
 	// =======
 
-	Network::Network() {
+	Network::Network() : m_scheduler( "Network", Scheduler::Priority::INTERACTIVE ) {
 		mg_mgr_init( &this->m_manager, NULL );
 		this->m_shutdown = false;
 		this->m_worker = std::thread( [this]() -> void {
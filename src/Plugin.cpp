@@ -79,7 +79,7 @@ namespace micasa {
 		{ Plugin::State::DISCONNECTED, "Disconnected" }
 	};
 
-	Plugin::Plugin( const unsigned int id_, const Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_ ) : m_id( id_ ), m_type( type_ ), m_reference( reference_ ), m_parent( parent_ ) {
+	Plugin::Plugin( const unsigned int id_, const Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_ ) : m_id( id_ ), m_type( type_ ), m_reference( reference_ ), m_parent( parent_ ), m_scheduler( "Plugin " + std::to_string( id_ ) + " (" + Plugin::resolveTextType( type_ ) + ")", Scheduler::Priority::NORMAL, PLUGIN_MAX_CONCURRENCY ) {
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before Plugins instances." );
 #endif // _DEBUG
@@ -146,7 +146,7 @@ namespace micasa {
 		return nullptr;
 	}
 
-	void Plugin::init() {
+	void Plugin::init( const std::unordered_map<unsigned int, Device::Hydration>& hydration_ ) {
 		std::lock_guard<std::recursive_mutex> devicesLock( this->m_devicesMutex );
 		std::vector<std::map<std::string, std::string>> devicesData = g_database->getQuery(
 			"SELECT `id`, `reference`, `label`, `type`, `enabled` "
@@ -155,15 +155,19 @@ namespace micasa {
 			this->m_id
 		);
 		for ( auto const &devicesDataIt : devicesData ) {
+			unsigned int id = std::stoi( devicesDataIt.at( "id" ) );
+			auto find = hydration_.find( id );
 			std::shared_ptr<Device> device = Device::factory(
 				this->shared_from_this(),
 				Device::resolveTextType( devicesDataIt.at( "type" ) ),
-				std::stoi( devicesDataIt.at( "id" ) ),
+				id,
 				devicesDataIt.at( "reference" ),
 				devicesDataIt.at( "label" ),
-				( devicesDataIt.at( "enabled" ) == "1" )
+				( devicesDataIt.at( "enabled" ) == "1" ),
+				find != hydration_.end() ? &find->second : nullptr
 			);
 			this->m_devices[devicesDataIt.at( "reference" )] = device;
+			g_controller->indexDevice( device );
 		}
 	};
 
@@ -354,6 +358,7 @@ namespace micasa {
 				};
 				g_webServer->broadcast( data.dump() );
 
+				g_controller->unindexDevice( device_ );
 				this->m_devices.erase( devicesIt );
 				break;
 			}
@@ -402,6 +407,7 @@ namespace micasa {
 		}
 
 		this->m_devices[reference_] = device;
+		g_controller->indexDevice( device );
 
 		json data = json::object();
 		data["event"] = "device_add";
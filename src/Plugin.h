@@ -10,6 +10,10 @@
 #include "Settings.h"
 #include "Scheduler.h"
 
+// Plugins run at most this many tasks simultaneously, so that a plugin that is stuck, for instance waiting for a
+// device or for a lock held by it's library, cannot tie up the threads that other work depends on.
+#define PLUGIN_MAX_CONCURRENCY 2
+
 namespace micasa {
 
 	class Plugin : public std::enable_shared_from_this<Plugin> {
@@ -63,7 +67,7 @@ namespace micasa {
 
 		static std::shared_ptr<Plugin> factory( const Type type_, const unsigned int id_, const std::string reference_, const std::shared_ptr<Plugin> parent_ );
 
-		void init();
+		void init( const std::unordered_map<unsigned int, Device::Hydration>& hydration_ );
 		virtual void start();
 		virtual void stop();
 		unsigned int getId() const { return this->m_id; };
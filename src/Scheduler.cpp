@@ -1,6 +1,13 @@
 #include <iostream>
 #include <algorithm>
 #include <atomic>
+#include <stdexcept>
+#include <iterator>
+#include <cstdlib>
+#include <cstdint>
+
+#include <pthread.h>
+#include <limits.h>
 
 #ifdef _DEBUG
 	#include <cassert>
@@ -13,12 +20,69 @@ namespace micasa {
 
 	using namespace std::chrono;
 
+	// Pool threads know the index of their worker. Blocking sections entered on other threads (such as the webserver
+	// or the main thread) are ignored. Blocking sections can be nested, only the outermost one is reported to the pool.
+	static thread_local int g_worker = -1;
+	static thread_local unsigned int g_blockingDepth = 0;
+
+	// The parking slots threads wait in for tasks to complete. Slots are shared by all the tasks that map onto them,
+	// waiting threads therefore check the state of their own task again after each wakeup.
+	struct t_parking {
+		std::mutex mutex;
+		std::condition_variable condition;
+	};
+	static t_parking& parking( const void* task_ ) {
+		static t_parking slots[SCHEDULER_PARKING_SLOTS];
+		return slots[( reinterpret_cast<std::uintptr_t>( task_ ) / sizeof( void* ) ) % SCHEDULER_PARKING_SLOTS];
+	};
+
+	// Returns the first slot of a repeating task that is not in the past. Slots that were missed, for instance
+	// because the task took longer than it's delay, are skipped.
+	template<class T> static T nextSlot( T time_, unsigned long delay_, T now_ ) {
+		time_ += milliseconds( delay_ );
+		if (
+			time_ < now_
+			&& delay_ > 0
+		) {
+			auto behind = duration_cast<milliseconds>( now_ - time_ ).count();
+			time_ += milliseconds( ( ( behind + delay_ - 1 ) / delay_ ) * delay_ );
+			if ( time_ < now_ ) {
+				time_ += milliseconds( delay_ );
+			}
+		}
+		return time_;
+	};
+
 	// =========
 	// Scheduler
 	// =========
 
+	const unsigned long long Scheduler::StatisticsBuckets[SCHEDULER_STATISTICS_BUCKETS - 1] = {
+		100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000
+	};
+
+	Scheduler::Scheduler( const std::string& label_, Priority priority_, unsigned int maxConcurrency_ ) :
+		m_label( label_ ),
+		m_priority( priority_ ),
+		m_maxConcurrency( maxConcurrency_ ),
+		m_running( 0 )
+	{
+		this->m_counters.executed = 0;
+		this->m_counters.delay = 0;
+		this->m_counters.runtime = 0;
+		for ( unsigned int i = 0; i < SCHEDULER_STATISTICS_BUCKETS; i++ ) {
+			this->m_counters.delayBuckets[i] = 0;
+			this->m_counters.runtimeBuckets[i] = 0;
+		}
+
+		// NOTE this also makes sure the thread pool is constructed before, and therefore destructed after, any static
+		// scheduler.
+		Scheduler::ThreadPool::get().attach( this );
+	};
+
 	Scheduler::~Scheduler() {
 		Scheduler::ThreadPool::get().erase( this );
+		Scheduler::ThreadPool::get().detach( this );
 	};
 
 	void Scheduler::erase( BaseTask::t_compareFunc&& func_ ) {
@@ -29,34 +93,201 @@ namespace micasa {
 		return Scheduler::ThreadPool::get().first( this, std::move( func_ ) );
 	};
 
+	std::shared_ptr<Scheduler::BaseTask> Scheduler::nextScheduleFor( const void* data_ ) const {
+		return Scheduler::ThreadPool::get().nextScheduleFor( this, data_ );
+	};
+
 	void Scheduler::proceed( unsigned long wait_, std::shared_ptr<BaseTask> task_ ) {
 		Scheduler::ThreadPool::get().proceed( this, wait_, task_ );
 	};
 
+	void Scheduler::configure( unsigned int minThreads_, unsigned int maxThreads_, size_t stackSize_ ) {
+		Scheduler::ThreadPool::get().configure( minThreads_, maxThreads_, stackSize_ );
+	};
+
+	Scheduler::Statistics Scheduler::getStatistics() const {
+		return Scheduler::ThreadPool::get().getStatistics( this );
+	};
+
+	std::vector<Scheduler::Statistics> Scheduler::getAllStatistics() {
+		return Scheduler::ThreadPool::get().getAllStatistics();
+	};
+
+	void Scheduler::_record( unsigned long long delay_, unsigned long long runtime_ ) {
+		unsigned int delayBucket = 0;
+		while(
+			delayBucket < SCHEDULER_STATISTICS_BUCKETS - 1
+			&& delay_ >= Scheduler::StatisticsBuckets[delayBucket]
+		) {
+			delayBucket++;
+		}
+		unsigned int runtimeBucket = 0;
+		while(
+			runtimeBucket < SCHEDULER_STATISTICS_BUCKETS - 1
+			&& runtime_ >= Scheduler::StatisticsBuckets[runtimeBucket]
+		) {
+			runtimeBucket++;
+		}
+		this->m_counters.executed.fetch_add( 1, std::memory_order_relaxed );
+		this->m_counters.delay.fetch_add( delay_, std::memory_order_relaxed );
+		this->m_counters.runtime.fetch_add( runtime_, std::memory_order_relaxed );
+		this->m_counters.delayBuckets[delayBucket].fetch_add( 1, std::memory_order_relaxed );
+		this->m_counters.runtimeBuckets[runtimeBucket].fetch_add( 1, std::memory_order_relaxed );
+	};
+
+	// ========
+	// Blocking
+	// ========
+
+	Scheduler::Blocking::Blocking() {
+		if (
+			g_worker >= 0
+			&& g_blockingDepth++ == 0
+		) {
+			Scheduler::ThreadPool::get().block();
+		}
+	};
+
+	Scheduler::Blocking::~Blocking() {
+		if (
+			g_worker >= 0
+			&& --g_blockingDepth == 0
+		) {
+			Scheduler::ThreadPool::get().unblock();
+		}
+	};
+
+	// ========
+	// BaseTask
+	// ========
+
+	void Scheduler::BaseTask::_begin() {
+		if ( ( this->m_completion.load( std::memory_order_relaxed ) & c_completed ) == c_completed ) {
+			this->m_completion.fetch_and( ~c_completed, std::memory_order_relaxed );
+		}
+	};
+
+	void Scheduler::BaseTask::_finish() {
+		unsigned int state = this->m_completion.exchange( c_completed, std::memory_order_acq_rel );
+		if ( __likely( ( state & ( c_parked | c_continued ) ) == 0 ) ) {
+			return;
+		}
+
+		// The parked threads are woken up after the lock is released. The task can be destroyed by one of them as
+		// soon as it's woken up, so the task isn't touched anymore after that.
+		t_parking& slot = parking( this );
+		std::vector<std::function<void()>> continuations;
+		{
+			std::lock_guard<std::mutex> lock( slot.mutex );
+			continuations.swap( this->m_continuations );
+		}
+		slot.condition.notify_all();
+		for ( auto const &continuation : continuations ) {
+			continuation();
+		}
+	};
+
+	void Scheduler::BaseTask::_wait() const {
+		if ( ( this->m_completion.load( std::memory_order_acquire ) & c_completed ) == c_completed ) {
+			return;
+		}
+
+		// The parked flag is set again on each wakeup because the run that completed in the mean time has cleared it
+		// and a new run might already have been started.
+		Blocking blocking;
+		t_parking& slot = parking( this );
+		std::unique_lock<std::mutex> lock( slot.mutex );
+		while( ( this->m_completion.fetch_or( c_parked, std::memory_order_acq_rel ) & c_completed ) == 0 ) {
+			slot.condition.wait( lock );
+		}
+	};
+
+	bool Scheduler::BaseTask::_waitFor( unsigned long wait_ ) const {
+		if ( ( this->m_completion.load( std::memory_order_acquire ) & c_completed ) == c_completed ) {
+			return true;
+		}
+
+		Blocking blocking;
+		t_parking& slot = parking( this );
+		auto until = steady_clock::now() + milliseconds( wait_ );
+		std::unique_lock<std::mutex> lock( slot.mutex );
+		while( ( this->m_completion.fetch_or( c_parked, std::memory_order_acq_rel ) & c_completed ) == 0 ) {
+			if ( slot.condition.wait_until( lock, until ) == std::cv_status::timeout ) {
+				return ( this->m_completion.load( std::memory_order_acquire ) & c_completed ) == c_completed;
+			}
+		}
+		return true;
+	};
+
+	void Scheduler::BaseTask::_then( std::function<void()>&& func_ ) {
+		// If the continued flag was set after the run completed, the completing thread might not have seen it, so the
+		// continuation is taken back and run right away.
+		t_parking& slot = parking( this );
+		std::unique_lock<std::mutex> lock( slot.mutex );
+		this->m_continuations.push_back( std::move( func_ ) );
+		if ( ( this->m_completion.fetch_or( c_continued, std::memory_order_acq_rel ) & c_completed ) == c_completed ) {
+			std::function<void()> continuation = std::move( this->m_continuations.back() );
+			this->m_continuations.pop_back();
+			lock.unlock();
+			continuation();
+		}
+	};
+
+	std::mutex& Scheduler::BaseTask::_parkingMutex() const {
+		return parking( this ).mutex;
+	};
+
 	// ==========
 	// ThreadPool
 	// ==========
 
 	Scheduler::ThreadPool::ThreadPool() :
 		m_shutdown( false ),
-		m_continue( false ),
-		m_threads( std::vector<std::thread>( std::max( 4U, 16 * std::thread::hardware_concurrency() ) ) )
+		m_epoch( steady_clock::now() ),
+		m_clockOffset( duration_cast<milliseconds>( system_clock::now().time_since_epoch() ) - duration_cast<milliseconds>( m_epoch.time_since_epoch() ) ),
+		m_tick( 0 ),
+		m_size( 0 ),
+		m_workersUsed( 0 ),
+		m_queued( 0 ),
+		m_lane( nullptr ),
+		m_nextWorker( 0 ),
+		m_minThreads( SCHEDULER_THREADS_MIN ),
+		m_maxThreads( std::max( 2U * SCHEDULER_THREADS_MAX_PER_CORE, SCHEDULER_THREADS_MAX_PER_CORE * std::thread::hardware_concurrency() ) ),
+		m_stackSize( SCHEDULER_THREADS_STACK_SIZE ),
+		m_threads( 0 ),
+		m_startingThreads( 0 ),
+		m_blockingThreads( 0 ),
+		m_workWaiting( 0 ),
+		m_timerWaiting( false ),
+		m_timerDeadline( ULLONG_MAX )
 	{
-		for ( unsigned int i = 0; i < this->m_threads.size(); i++ ) {
-			this->m_threads[i] = std::thread( [this,i]() { this->_loop( i ); } );
+		std::fill( std::begin( this->m_levelSizes ), std::end( this->m_levelSizes ), 0 );
+		for ( unsigned int i = 0; i < SCHEDULER_THREADS_LIMIT; i++ ) {
+			this->m_workers[i].pool = this;
+			this->m_workers[i].index = i;
+			this->m_workers[i].running = false;
+			this->m_workers[i].executing = nullptr;
+		}
+		for ( unsigned int i = 0; i < SCHEDULER_PRIORITIES; i++ ) {
+			this->m_queuedPriorities[i] = 0;
+		}
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		while( this->m_threads < this->m_minThreads ) {
+			if ( ! this->_spawn() ) {
+				throw std::runtime_error( "unable to start scheduler threads" );
+			}
 		}
 	};
 
 	Scheduler::ThreadPool::~ThreadPool() {
-		this->_notify( true, [this]() -> void { this->m_shutdown = true; } );
-		for ( auto& thread: this->m_threads ) {
-			thread.join();
-		}
+		std::unique_lock<std::mutex> tasksLock( this->m_tasksMutex );
+		this->m_shutdown = true;
+		this->m_workCondition.notify_all();
+		this->m_timerCondition.notify_all();
+		this->m_exitCondition.wait( tasksLock, [this]() -> bool { return this->m_threads == 0; } );
 #ifdef _DEBUG
-		std::unique_lock<std::recursive_mutex> tasksLock( this->m_tasksMutex );
-		assert( this->m_tasks.size() == 0 && "All tasks should be purged when ThreadPool is destructed." );
-		assert( this->m_activeTasks.size() == 0 && "All active tasks should be completed when ThreadPool is destructed." );
-		tasksLock.unlock();
+		assert( this->m_size == 0 && "All tasks should be purged when ThreadPool is destructed." );
+		assert( this->m_lane == nullptr && "All submitted tasks should be drained when ThreadPool is destructed." );
 #endif // _DEBUG
 	};
 
@@ -64,134 +295,837 @@ namespace micasa {
 #ifdef _DEBUG
 		assert( this->m_shutdown == false && "Tasks should only be scheduled when scheduler is running." );
 #endif // _DEBUG
-		std::lock_guard<std::recursive_mutex> tasksLock( this->m_tasksMutex );
-		this->m_tasks.insert( { task_->time, task_ } );
-		this->_notify( false, [this]() -> void { this->m_continue = true; } );
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_insert( task_, steady_clock::now() );
 	};
 
-	void Scheduler::ThreadPool::erase( Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ ) {
-		std::unique_lock<std::recursive_mutex> tasksLock( this->m_tasksMutex );
+	void Scheduler::ThreadPool::submit( std::shared_ptr<BaseTask> task_ ) {
+#ifdef _DEBUG
+		assert( this->m_shutdown == false && "Tasks should only be scheduled when scheduler is running." );
+#endif // _DEBUG
+		// Only new tasks that are due right away are submitted to the lane. Existing tasks that are scheduled again
+		// might be indexed, placed in the wheel or running, so they always take the tasks mutex.
+		if ( task_->time > steady_clock::now() ) {
+			this->schedule( task_ );
+			return;
+		}
 
-		for ( auto taskIt = this->m_tasks.begin(); taskIt != this->m_tasks.end(); ) {
-			if (
-				taskIt->second->m_scheduler == scheduler_
-				&& func_( *( taskIt->second.get() ) )
-			) {
-				taskIt = this->m_tasks.erase( taskIt );
-			} else {
-				taskIt++;
+		task_->m_due.store( task_->time.time_since_epoch().count(), std::memory_order_relaxed );
+		BaseTask* task = task_.get();
+		task->m_laneSelf = std::move( task_ );
+		BaseTask* head = this->m_lane.load( std::memory_order_relaxed );
+		do {
+			task->m_laneNext = head;
+		} while( ! this->m_lane.compare_exchange_weak( head, task, std::memory_order_release, std::memory_order_relaxed ) );
+
+		// If the lane wasn't empty the submitter of the first task in it takes care of waking up a thread. Threads
+		// drain the lane while holding the tasks mutex before they go idle, so a thread that is about to go idle
+		// either sees the task or is woken up here.
+		if ( head == nullptr ) {
+			std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+			if ( this->m_lane.load( std::memory_order_relaxed ) != nullptr ) {
+				this->_wake( true );
 			}
 		}
+	};
+
+	void Scheduler::ThreadPool::erase( Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ ) {
+		std::unique_lock<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
 
 		std::vector<std::shared_ptr<BaseTask>> tasks;
-		for ( auto taskIt = this->m_activeTasks.begin(); taskIt != this->m_activeTasks.end(); taskIt++ ) {
-			if (
-				(*taskIt)->m_scheduler == scheduler_
-				&& func_( *( taskIt->get() ) )
-			) {
-				(*taskIt)->repeat = 0;
-				tasks.push_back( *taskIt );
+		this->_each( scheduler_, [&]( BaseTask* task_ ) {
+			if ( func_( *task_ ) ) {
+				tasks.push_back( task_->shared_from_this() );
+			}
+		} );
+
+		// Tasks that are running are allowed to finish but are not repeated. They are removed from the index once
+		// they've finished.
+		std::vector<std::shared_ptr<BaseTask>> active;
+		for ( auto const &task : tasks ) {
+			this->_cancel( task );
+			if ( ( task->m_state & c_active ) == c_active ) {
+				task->repeat = 0;
+				active.push_back( task );
+			} else {
+				this->_unindex( task.get() );
 			}
 		}
 
 		tasksLock.unlock();
 
-		for ( auto const &task : tasks ) {
+		for ( auto const &task : active ) {
 			task->complete();
 		}
 	};
 
-	auto Scheduler::ThreadPool::first( const Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ ) const -> std::shared_ptr<BaseTask> {
-		std::lock_guard<std::recursive_mutex> tasksLock( this->m_tasksMutex );
-		for ( auto& taskIt : this->m_tasks ) {
+	auto Scheduler::ThreadPool::first( const Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ ) -> std::shared_ptr<BaseTask> {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
+
+		// The wheel is not ordered within its slots, so all pending tasks of the scheduler are visited to find the
+		// earliest match.
+		BaseTask* result = nullptr;
+		this->_each( scheduler_, [&]( BaseTask* task_ ) {
 			if (
-				taskIt.second->m_scheduler == scheduler_
-				&& func_( *( taskIt.second.get() ) )
+				( task_->m_slot != nullptr || ( task_->m_state & c_queued ) == c_queued )
+				&& ( result == nullptr || task_->time < result->time )
+				&& func_( *task_ )
 			) {
-				return taskIt.second;
+				result = task_;
 			}
-		}
-		return nullptr;
+		} );
+		return result == nullptr ? nullptr : result->shared_from_this();
 	};
 
-	void Scheduler::ThreadPool::proceed( const Scheduler* scheduler_, unsigned long wait_, std::shared_ptr<BaseTask> task_ ) {
-		std::lock_guard<std::recursive_mutex> tasksLock( this->m_tasksMutex );
-		for ( auto taskIt = this->m_tasks.begin(); taskIt != this->m_tasks.end(); ) {
+	auto Scheduler::ThreadPool::nextScheduleFor( const Scheduler* scheduler_, const void* data_ ) -> std::shared_ptr<BaseTask> {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
+		auto owner = this->m_index.find( scheduler_ );
+		if ( owner == this->m_index.end() ) {
+			return nullptr;
+		}
+		auto tasks = owner->second.find( data_ );
+		if ( tasks == owner->second.end() ) {
+			return nullptr;
+		}
+		BaseTask* result = nullptr;
+		for ( auto const &task : tasks->second ) {
 			if (
-				taskIt->second->m_scheduler == scheduler_
-				&& taskIt->second == task_
+				( task->m_slot != nullptr || ( task->m_state & c_queued ) == c_queued )
+				&& ( result == nullptr || task->time < result->time )
 			) {
-				taskIt = this->m_tasks.erase( taskIt );
-			} else {
-				taskIt++;
+				result = task;
 			}
 		}
-		task_->time = system_clock::now() + milliseconds( wait_ );
-		this->m_tasks.insert( { task_->time, task_ } );
-		this->_notify( false, [this]() -> void { this->m_continue = true; } );
+		return result == nullptr ? nullptr : result->shared_from_this();
 	};
 
-	void Scheduler::ThreadPool::_loop( unsigned int index_ ) {
+	void Scheduler::ThreadPool::proceed( const Scheduler* scheduler_, unsigned long wait_, std::shared_ptr<BaseTask> task_ ) {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
+		auto now = steady_clock::now();
+		task_->time = now + milliseconds( wait_ );
+		task_->m_wallClock = false;
+		this->_insert( task_, now );
+	};
+
+	size_t Scheduler::ThreadPool::size() {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
+		return this->m_size + this->m_queued;
+	};
+
+	void Scheduler::ThreadPool::attach( Scheduler* scheduler_ ) {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->m_schedulers.insert( scheduler_ );
+	};
+
+	void Scheduler::ThreadPool::detach( Scheduler* scheduler_ ) {
+		std::unique_lock<std::mutex> tasksLock( this->m_tasksMutex );
+		this->m_schedulers.erase( scheduler_ );
+		tasksLock.unlock();
+
+		// A thread that just finished the last task of the scheduler might still be updating it's counters or it's
+		// concurrency slots.
+		unsigned int used = this->m_workersUsed;
+		for ( unsigned int i = 0; i < used; i++ ) {
+			while( this->m_workers[i].executing.load() == scheduler_ ) {
+				std::this_thread::yield();
+			}
+		}
+	};
+
+	Scheduler::Statistics Scheduler::ThreadPool::getStatistics( const Scheduler* scheduler_ ) {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
+		return this->_statistics( scheduler_ );
+	};
+
+	std::vector<Scheduler::Statistics> Scheduler::ThreadPool::getAllStatistics() {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->_drain();
+		std::vector<Statistics> result;
+		result.reserve( this->m_schedulers.size() );
+		for ( auto const &scheduler : this->m_schedulers ) {
+			result.push_back( this->_statistics( scheduler ) );
+		}
+		return result;
+	};
+
+	void Scheduler::ThreadPool::configure( unsigned int minThreads_, unsigned int maxThreads_, size_t stackSize_ ) {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		if ( minThreads_ > 0 ) {
+			this->m_minThreads = minThreads_;
+		}
+		if ( maxThreads_ > 0 ) {
+			this->m_maxThreads = maxThreads_;
+		}
+		this->m_maxThreads = std::max( this->m_minThreads, this->m_maxThreads );
+		if ( stackSize_ > 0 ) {
+			this->m_stackSize = std::max( (size_t)PTHREAD_STACK_MIN, stackSize_ );
+		}
+		while(
+			this->m_threads < this->m_minThreads
+			&& this->_spawn()
+		) { }
+
+		// Superfluous threads are stopped by waking up the idle threads.
+		this->m_workCondition.notify_all();
+	};
+
+	void Scheduler::ThreadPool::block() {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->m_blockingThreads++;
+
+		// The blocking task gives up it's slot of the concurrency limit of it's scheduler for the duration of the
+		// wait. A deferred task that is handed back to the ready queue of this thread is picked up by another thread.
+		t_worker& worker = this->m_workers[g_worker];
+		Scheduler* scheduler = worker.executing.load( std::memory_order_relaxed );
+		if (
+			scheduler != nullptr
+			&& this->_release( worker, scheduler )
+		) {
+			this->_wake( true );
+		}
+		if (
+			this->m_size + this->m_queued > 0
+			&& this->m_workWaiting + this->m_startingThreads == 0
+			&& ! this->m_timerWaiting
+		) {
+			this->_spawn();
+		}
+	};
+
+	void Scheduler::ThreadPool::unblock() {
+		std::lock_guard<std::mutex> tasksLock( this->m_tasksMutex );
+		this->m_blockingThreads--;
+
+		// The slot is taken back regardless of the limit, the limit is therefore exceeded briefly if the slot was
+		// taken by another task in the mean time.
+		Scheduler* scheduler = this->m_workers[g_worker].executing.load( std::memory_order_relaxed );
+		if (
+			scheduler != nullptr
+			&& scheduler->m_maxConcurrency > 0
+		) {
+			std::lock_guard<std::mutex> concurrencyLock( scheduler->m_concurrencyMutex );
+			scheduler->m_running++;
+		}
+	};
+
+	void* Scheduler::ThreadPool::_worker( void* worker_ ) {
+		t_worker* worker = static_cast<t_worker*>( worker_ );
+		g_worker = worker->index;
+		worker->pool->_loop( *worker );
+		return NULL;
+	};
+
+	bool Scheduler::ThreadPool::_spawn() {
+		// Blocking threads are compensated for, but the pool never grows beyond twice the maximum.
+		if (
+			this->m_shutdown
+			|| this->m_threads >= std::min( this->m_maxThreads + this->m_blockingThreads, 2 * this->m_maxThreads )
+		) {
+			return false;
+		}
+
+		unsigned int index = 0;
+		while( this->m_workers[index].running ) {
+			if ( ++index == SCHEDULER_THREADS_LIMIT ) {
+				return false;
+			}
+		}
+		t_worker& worker = this->m_workers[index];
+		worker.running = true;
+
+		pthread_attr_t attributes;
+		pthread_attr_init( &attributes );
+		pthread_attr_setdetachstate( &attributes, PTHREAD_CREATE_DETACHED );
+		pthread_attr_setstacksize( &attributes, this->m_stackSize );
+		pthread_t thread;
+		int result = pthread_create( &thread, &attributes, &ThreadPool::_worker, &worker );
+		pthread_attr_destroy( &attributes );
+		if ( __unlikely( result != 0 ) ) {
+			worker.running = false;
+			return false;
+		}
+
+		this->m_workersUsed = std::max( this->m_workersUsed.load(), index + 1 );
+		this->m_threads++;
+		this->m_startingThreads++;
+		return true;
+	};
+
+	void Scheduler::ThreadPool::_loop( t_worker& worker_ ) {
+		std::unique_lock<std::mutex> tasksLock( this->m_tasksMutex );
+		this->m_startingThreads--;
 		while( ! this->m_shutdown ) {
-			std::unique_lock<std::recursive_mutex> tasksLock( this->m_tasksMutex );
-			if (
-				this->m_tasks.size() > 0
-				&& this->m_tasks.begin()->second->time <= system_clock::now()
-			) {
-				auto task = this->m_tasks.begin()->second;
-				this->m_tasks.erase( this->m_tasks.begin() );
-				this->m_activeTasks.push_back( task );
-				tasksLock.unlock();
+			auto now = steady_clock::now();
+			this->_drain( false );
+			this->_finish( worker_ );
+			this->_adjust( now );
+			this->_advance( now );
 
-				task->iteration++;
-				task->execute();
+			if ( this->m_queued > 0 ) {
 
+				// Other threads are woken up to help out with the queued tasks and to take over waiting for the
+				// wheel. The wheel is advanced again after a batch of tasks so that a steady stream of immediate tasks
+				// cannot delay timed tasks indefinitely.
+				this->_wake( this->m_queued > 1 );
+				tasksLock.unlock();
+				std::shared_ptr<BaseTask> task;
+				for ( unsigned int i = 0; i < SCHEDULER_THREADS_BATCH_SIZE && ( task = this->_take( worker_ ) ) != nullptr; i++ ) {
+					this->_execute( worker_, task );
+				}
+				task = nullptr;
 				tasksLock.lock();
-				auto find = std::find( this->m_activeTasks.begin(), this->m_activeTasks.end(), task );
-				if ( find != this->m_activeTasks.end() ) {
-					this->m_activeTasks.erase( find );
+
+			} else if ( ! this->m_timerWaiting ) {
+
+				// One thread at a time waits for the wheel to reach the next expiry tick, all other idle threads wait
+				// for work to be handed to them.
+				this->m_timerWaiting = true;
+				this->m_timerDeadline = this->_next();
+				if ( __unlikely( this->m_timerDeadline == ULLONG_MAX ) ) {
+					this->m_timerCondition.wait( tasksLock );
+				} else {
+					this->m_timerCondition.wait_until( tasksLock, this->m_epoch + milliseconds( this->m_timerDeadline ) );
+				}
+				this->m_timerWaiting = false;
+				this->m_timerDeadline = ULLONG_MAX;
+
+			} else if ( this->m_threads > this->m_maxThreads + this->m_blockingThreads ) {
+				break;
+
+			} else {
+				this->m_workWaiting++;
+				std::cv_status status = this->m_workCondition.wait_for( tasksLock, milliseconds( SCHEDULER_THREADS_IDLE_TIMEOUT ) );
+				this->m_workWaiting--;
+				if (
+					status == std::cv_status::timeout
+					&& this->m_threads > this->m_minThreads
+				) {
+					break;
+				}
+			}
+		}
+
+		// Tasks that are still in the ready queue of this thread are handed to another thread.
+		worker_.running = false;
+		g_worker = -1;
+		this->_finish( worker_ );
+		std::vector<std::shared_ptr<BaseTask>> tasks;
+		std::unique_lock<std::mutex> workerLock( worker_.mutex );
+		for ( unsigned int priority = 0; priority < SCHEDULER_PRIORITIES; priority++ ) {
+			this->m_queuedPriorities[priority] -= worker_.tasks[priority].size();
+			std::move( worker_.tasks[priority].begin(), worker_.tasks[priority].end(), std::back_inserter( tasks ) );
+			worker_.tasks[priority].clear();
+		}
+		workerLock.unlock();
+		this->m_queued -= tasks.size();
+		for ( auto const &task : tasks ) {
+			if ( task->m_state == c_queued ) {
+				task->m_state &= ~c_queued;
+				if ( ! this->m_shutdown ) {
+					this->_queue( task );
 				}
+			}
+		}
 
-				if ( task->repeat > 1 ) {
-					if ( task->repeat != SCHEDULER_REPEAT_INFINITE ) {
-						task->repeat--;
+		// The exit condition is notified while still holding the lock, so the pool cannot be destructed before this
+		// thread has released it.
+		this->m_threads--;
+		if ( this->m_threads == 0 ) {
+			this->m_exitCondition.notify_all();
+		}
+	};
+
+	auto Scheduler::ThreadPool::_take( t_worker& worker_ ) -> std::shared_ptr<BaseTask> {
+		// A thread takes tasks from the front of its own ready queue first and then steals tasks from the back of the
+		// ready queues of the other threads, one priority class at a time. Entries of tasks that were cancelled or
+		// rescheduled after being queued are skipped.
+		unsigned int used = this->m_workersUsed;
+		for ( unsigned int priority = 0; priority < SCHEDULER_PRIORITIES; priority++ ) {
+			for ( unsigned int i = 0; i < used && this->m_queuedPriorities[priority] > 0; i++ ) {
+				t_worker& worker = this->m_workers[( worker_.index + i ) % used];
+				if (
+					i > 0
+					&& ! worker.running
+				) {
+					continue;
+				}
+				std::unique_lock<std::mutex> workerLock( worker.mutex );
+				std::deque<std::shared_ptr<BaseTask>>& tasks = worker.tasks[priority];
+				while( tasks.size() > 0 ) {
+					std::shared_ptr<BaseTask> task;
+					if ( i == 0 ) {
+						task = std::move( tasks.front() );
+						tasks.pop_front();
+					} else {
+						task = std::move( tasks.back() );
+						tasks.pop_back();
+					}
+					this->m_queuedPriorities[priority]--;
+					this->m_queued--;
+
+					// Tasks of a scheduler with a concurrency limit are claimed only after a slot has been acquired, a
+					// task that is deferred therefore remains queued and can still be cancelled. If the task was
+					// cancelled in the mean time the slot is released again.
+					if (
+						task->m_state != c_queued
+						|| (
+							task->m_limited
+							&& ! this->_acquire( worker_, task )
+						)
+					) {
+						continue;
+					}
+					unsigned int state = c_queued;
+					if ( task->m_state.compare_exchange_strong( state, c_active ) ) {
+						return task;
+					}
+					if ( task->m_limited ) {
+						workerLock.unlock();
+						this->_release( worker_, task->m_scheduler );
+						worker_.executing.store( nullptr, std::memory_order_release );
+						return this->_take( worker_ );
 					}
-					auto now = system_clock::now();
-					do {
-						task->time += milliseconds( task->delay );
-					} while( task->time < now );
-					this->m_tasks.insert( { task->time, task } );
-					this->_notify( false, [this]() -> void { this->m_continue = true; } );
 				}
 			}
+		}
+		return nullptr;
+	};
 
-			auto predicate = [&]() -> bool { return this->m_shutdown || this->m_continue; };
-			std::unique_lock<std::mutex> conditionLock( this->m_conditionMutex );
-			if ( __unlikely( this->m_tasks.size() == 0 ) ) {
-				tasksLock.unlock();
-				this->m_continueCondition.wait( conditionLock, predicate );
-			} else {
-				auto now = system_clock::now();
-				if ( now < this->m_tasks.begin()->second->time ) {
-					auto wait = this->m_tasks.begin()->second->time - now;
-					tasksLock.unlock();
-					this->m_continueCondition.wait_for( conditionLock, wait, predicate );
+	void Scheduler::ThreadPool::_execute( t_worker& worker_, std::shared_ptr<BaseTask> task_ ) {
+		// The scheduler of the task is marked as executing on this thread, so that it isn't destructed before the
+		// counters have been updated.
+		Scheduler* scheduler = task_->m_scheduler;
+		worker_.executing.store( scheduler, std::memory_order_release );
+		auto start = steady_clock::now();
+		task_->iteration++;
+		task_->execute();
+		auto end = steady_clock::now();
+		steady_clock::time_point due( steady_clock::duration( task_->m_due.load( std::memory_order_relaxed ) ) );
+		scheduler->_record(
+			start > due ? duration_cast<microseconds>( start - due ).count() : 0,
+			duration_cast<microseconds>( end - start ).count()
+		);
+		this->_release( worker_, scheduler );
+		worker_.executing.store( nullptr, std::memory_order_release );
+
+		// A task that became due again while it was running is queued again right away. Other tasks are handed
+		// back to the wheel or removed from the index the next time this thread holds the tasks mutex.
+		if ( ( task_->m_state.fetch_and( ~c_active ) & c_queued ) == c_queued ) {
+			std::lock_guard<std::mutex> workerLock( worker_.mutex );
+			this->_push( worker_, task_ );
+		} else {
+			worker_.finished.push_back( task_ );
+		}
+	};
+
+	void Scheduler::ThreadPool::_finish( t_worker& worker_ ) {
+		auto now = steady_clock::now();
+		for ( auto const &task : worker_.finished ) {
+
+			// Tasks that were erased, rescheduled or queued again since they finished are left alone.
+			if (
+				! task->m_indexed
+				|| task->m_slot != nullptr
+				|| task->m_state != 0
+			) {
+				continue;
+			}
+
+			if ( task->repeat > 1 ) {
+				if ( task->repeat != SCHEDULER_REPEAT_INFINITE ) {
+					task->repeat--;
+				}
+				if ( task->m_wallClock ) {
+					task->m_wallTime = nextSlot( task->m_wallTime, task->delay, system_clock::now() );
 				} else {
-					tasksLock.unlock();
+					task->time = nextSlot( task->time, task->delay, now );
 				}
+				this->_insert( task, now );
+			} else {
+				this->_unindex( task.get() );
+			}
+		}
+		worker_.finished.clear();
+	};
+
+	void Scheduler::ThreadPool::_drain( bool wake_ ) {
+		BaseTask* head = this->m_lane.exchange( nullptr, std::memory_order_acquire );
+		if ( __likely( head == nullptr ) ) {
+			return;
+		}
+
+		// The lane is a stack, so the tasks are taken from it in reverse order. All of them are due and new, so they
+		// are indexed and handed to the ready queues of a single thread in one go. Threads that drain the lane from
+		// their loop take care of waking up other threads themselves.
+		std::vector<std::shared_ptr<BaseTask>> tasks;
+		while( head != nullptr ) {
+			BaseTask* next = head->m_laneNext;
+			head->m_laneNext = nullptr;
+			this->_index( head );
+			head->m_state.fetch_or( c_queued );
+			tasks.push_back( std::move( head->m_laneSelf ) );
+			head = next;
+		}
+		t_worker* worker = this->_select();
+		std::unique_lock<std::mutex> workerLock( worker->mutex );
+		for ( auto tasksIt = tasks.rbegin(); tasksIt != tasks.rend(); tasksIt++ ) {
+			this->_push( *worker, std::move( *tasksIt ) );
+		}
+		workerLock.unlock();
+
+		if ( wake_ ) {
+			this->_wake( true );
+		}
+	};
+
+	void Scheduler::ThreadPool::_queue( std::shared_ptr<BaseTask> task_ ) {
+		// If the task is already queued there's nothing to do. If the task is running it is queued again by the
+		// thread that is running it as soon as it finishes.
+		if ( ( task_->m_state & c_queued ) == 0 ) {
+			task_->m_due.store( task_->time.time_since_epoch().count(), std::memory_order_relaxed );
+		}
+		if ( ( task_->m_state.fetch_or( c_queued ) & ( c_queued | c_active ) ) != 0 ) {
+			return;
+		}
+
+		t_worker* worker = this->_select();
+		std::unique_lock<std::mutex> workerLock( worker->mutex );
+		this->_push( *worker, task_ );
+		workerLock.unlock();
+
+		this->_wake( true );
+	};
+
+	inline void Scheduler::ThreadPool::_push( t_worker& worker_, std::shared_ptr<BaseTask> task_ ) {
+		// NOTE the caller should hold the lock on the worker.
+		unsigned int priority = static_cast<unsigned int>( task_->m_priority );
+		worker_.tasks[priority].push_back( std::move( task_ ) );
+		this->m_queuedPriorities[priority]++;
+		this->m_queued++;
+	};
+
+	bool Scheduler::ThreadPool::_acquire( t_worker& worker_, std::shared_ptr<BaseTask> task_ ) {
+		// The scheduler is marked as executing on this thread before it is touched, so that it isn't destructed in
+		// the mean time. If the task has been cancelled before that the scheduler might already be gone. The mark
+		// stays in place if a slot was acquired.
+		Scheduler* scheduler = task_->m_scheduler;
+		worker_.executing.store( scheduler );
+		if ( task_->m_state == c_queued ) {
+			std::lock_guard<std::mutex> concurrencyLock( scheduler->m_concurrencyMutex );
+			if ( scheduler->m_running < scheduler->m_maxConcurrency ) {
+				scheduler->m_running++;
+				return true;
 			}
-			this->m_continue = false;
-			conditionLock.unlock();
+			scheduler->m_deferred.push_back( task_ );
 		}
+		worker_.executing.store( nullptr, std::memory_order_release );
+		return false;
 	};
 
-	inline void Scheduler::ThreadPool::_notify( bool all_, std::function<void()>&& func_ ) {
-		std::lock_guard<std::mutex> lock( this->m_conditionMutex );
-		func_();
-		if ( __unlikely( all_ ) ) {
-			this->m_continueCondition.notify_all();
+	bool Scheduler::ThreadPool::_release( t_worker& worker_, Scheduler* scheduler_ ) {
+		if ( __likely( scheduler_->m_maxConcurrency == 0 ) ) {
+			return false;
+		}
+
+		// The oldest deferred task that hasn't been cancelled in the mean time is handed back to the ready queue of
+		// the releasing thread.
+		std::unique_lock<std::mutex> concurrencyLock( scheduler_->m_concurrencyMutex );
+		scheduler_->m_running--;
+		std::shared_ptr<BaseTask> task;
+		while(
+			task == nullptr
+			&& scheduler_->m_deferred.size() > 0
+		) {
+			if ( scheduler_->m_deferred.front()->m_state == c_queued ) {
+				task = std::move( scheduler_->m_deferred.front() );
+			}
+			scheduler_->m_deferred.pop_front();
+		}
+		concurrencyLock.unlock();
+
+		if ( task != nullptr ) {
+			std::lock_guard<std::mutex> workerLock( worker_.mutex );
+			this->_push( worker_, task );
+			return true;
+		}
+		return false;
+	};
+
+	auto Scheduler::ThreadPool::_select() -> t_worker* {
+		// Pool threads queue tasks in their own ready queue, other threads spread them over the running threads.
+		t_worker* worker = nullptr;
+		if ( g_worker >= 0 ) {
+			worker = &this->m_workers[g_worker];
 		} else {
-			this->m_continueCondition.notify_one();
+			unsigned int used = this->m_workersUsed;
+			for ( unsigned int i = 0; i < used; i++ ) {
+				worker = &this->m_workers[this->m_nextWorker++ % used];
+				if ( worker->running ) {
+					break;
+				}
+			}
+		}
+		return worker;
+	};
+
+	inline void Scheduler::ThreadPool::_cancel( std::shared_ptr<BaseTask> task_ ) {
+		// Cancelled tasks might still have an entry in one of the ready queues, which is skipped when it's taken.
+		this->_unlink( task_ );
+		task_->m_state &= ~c_queued;
+	};
+
+	unsigned long long Scheduler::ThreadPool::_toTick( steady_clock::time_point time_ ) const {
+		if ( __unlikely( time_ <= this->m_epoch ) ) {
+			return 0;
+		}
+		return duration_cast<milliseconds>( time_ - this->m_epoch ).count();
+	};
+
+	void Scheduler::ThreadPool::_adjust( steady_clock::time_point now_ ) {
+		// The offset between the system clock and the steady clock only changes if the system clock is adjusted, in
+		// which case the tasks that are anchored to the wall clock are placed in the wheel again.
+		auto offset = duration_cast<milliseconds>( system_clock::now().time_since_epoch() ) - duration_cast<milliseconds>( now_.time_since_epoch() );
+		if ( __unlikely( std::abs( ( offset - this->m_clockOffset ).count() ) > SCHEDULER_CLOCK_ADJUST_THRESHOLD ) ) {
+			this->m_clockOffset = offset;
+			std::vector<std::shared_ptr<BaseTask>> tasks;
+			for ( auto const &task : this->m_wallClockTasks ) {
+				tasks.push_back( task->shared_from_this() );
+			}
+			for ( auto const &task : tasks ) {
+				this->_insert( task, now_ );
+			}
+		}
+	};
+
+	void Scheduler::ThreadPool::_insert( std::shared_ptr<BaseTask> task_, steady_clock::time_point now_ ) {
+		if ( ! task_->m_indexed ) {
+			this->_index( task_.get() );
+		}
+		this->_cancel( task_ );
+		if ( task_->m_wallClock ) {
+			task_->time = now_ + duration_cast<steady_clock::duration>( task_->m_wallTime - system_clock::now() );
+		}
+		if ( task_->time <= now_ ) {
+			this->_queue( task_ );
+		} else {
+			// The expiry tick is rounded up so that tasks never run before their scheduled time.
+			unsigned long long tick = this->_toTick( task_->time );
+			if ( this->m_epoch + milliseconds( tick ) < task_->time ) {
+				tick++;
+			}
+			task_->m_tick = std::max( tick, this->m_tick );
+			this->_place( task_ );
+			this->_wake( false, task_->m_tick );
+		}
+	};
+
+	void Scheduler::ThreadPool::_place( std::shared_ptr<BaseTask> task_ ) {
+		unsigned long long delta = task_->m_tick - this->m_tick;
+		for ( unsigned int level = 0; level < SCHEDULER_WHEEL_LEVELS; level++ ) {
+			if ( delta < ( 1ULL << ( SCHEDULER_WHEEL_BITS * ( level + 1 ) ) ) ) {
+				unsigned int index = ( task_->m_tick >> ( SCHEDULER_WHEEL_BITS * level ) ) & ( SCHEDULER_WHEEL_SLOTS - 1 );
+				this->_link( task_, this->m_wheel[level][index], level );
+				return;
+			}
+		}
+		this->_link( task_, this->m_overflow, c_overflowLevel );
+	};
+
+	inline void Scheduler::ThreadPool::_link( std::shared_ptr<BaseTask> task_, BaseTask::t_slot& slot_, unsigned int level_ ) {
+		task_->m_slotIt = slot_.insert( slot_.end(), task_ );
+		task_->m_slot = &slot_;
+		task_->m_level = level_;
+		if ( task_->m_wallClock ) {
+			this->m_wallClockTasks.insert( task_.get() );
+		}
+		this->m_levelSizes[level_]++;
+		this->m_size++;
+	};
+
+	inline void Scheduler::ThreadPool::_unlink( std::shared_ptr<BaseTask> task_ ) {
+		if ( task_->m_slot != nullptr ) {
+			task_->m_slot->erase( task_->m_slotIt );
+			task_->m_slot = nullptr;
+			this->m_wallClockTasks.erase( task_.get() );
+			this->m_levelSizes[task_->m_level]--;
+			this->m_size--;
+		}
+	};
+
+	void Scheduler::ThreadPool::_index( BaseTask* task_ ) {
+		task_->m_key = task_->data;
+		task_->m_indexed = true;
+		this->m_index[task_->m_scheduler][task_->m_key].insert( task_ );
+	};
+
+	void Scheduler::ThreadPool::_unindex( BaseTask* task_ ) {
+		auto owner = this->m_index.find( task_->m_scheduler );
+		auto tasks = owner->second.find( task_->m_key );
+		tasks->second.erase( task_ );
+		task_->m_indexed = false;
+		if ( tasks->second.empty() ) {
+			owner->second.erase( tasks );
+			if ( owner->second.empty() ) {
+				this->m_index.erase( owner );
+			}
+		}
+	};
+
+	void Scheduler::ThreadPool::_cascade( BaseTask::t_slot& slot_ ) {
+		BaseTask::t_slot tasks;
+		tasks.splice( tasks.end(), slot_ );
+		for ( auto const &task : tasks ) {
+			task->m_slot = nullptr;
+			this->m_levelSizes[task->m_level]--;
+			this->m_size--;
+			this->_place( task );
+		}
+	};
+
+	void Scheduler::ThreadPool::_advance( steady_clock::time_point now_ ) {
+		const unsigned long long mask = SCHEDULER_WHEEL_SLOTS - 1;
+		unsigned long long now = this->_toTick( now_ );
+		while( this->m_tick <= now ) {
+			if ( this->m_size == 0 ) {
+				this->m_tick = now + 1;
+				break;
+			}
+
+			// Ticks can be skipped in bulk up to the next boundary at which a non-empty level cascades.
+			unsigned int lowest = 0;
+			while(
+				lowest < SCHEDULER_WHEEL_LEVELS
+				&& this->m_levelSizes[lowest] == 0
+			) {
+				lowest++;
+			}
+			if ( lowest > 0 ) {
+				unsigned long long levelMask = ( 1ULL << ( SCHEDULER_WHEEL_BITS * std::min( lowest, SCHEDULER_WHEEL_LEVELS - 1U ) ) ) - 1;
+				if ( ( this->m_tick & levelMask ) != 0 ) {
+					this->m_tick = std::min( ( this->m_tick | levelMask ) + 1, now + 1 );
+					continue;
+				}
+			}
+
+			for ( unsigned int level = SCHEDULER_WHEEL_LEVELS - 1; level > 0; level-- ) {
+				unsigned int bits = SCHEDULER_WHEEL_BITS * level;
+				if ( ( this->m_tick & ( ( 1ULL << bits ) - 1 ) ) == 0 ) {
+					if (
+						level == SCHEDULER_WHEEL_LEVELS - 1
+						&& this->m_levelSizes[c_overflowLevel] > 0
+					) {
+						this->_cascade( this->m_overflow );
+					}
+					if ( this->m_levelSizes[level] > 0 ) {
+						this->_cascade( this->m_wheel[level][( this->m_tick >> bits ) & mask] );
+					}
+				}
+			}
+
+			auto& slot = this->m_wheel[0][this->m_tick & mask];
+			while( ! slot.empty() ) {
+				std::shared_ptr<BaseTask> task = slot.front();
+				this->_unlink( task );
+				this->_queue( task );
+			}
+
+			this->m_tick++;
+		}
+	};
+
+	unsigned long long Scheduler::ThreadPool::_next() const {
+		const unsigned long long mask = SCHEDULER_WHEEL_SLOTS - 1;
+		unsigned long long next = ULLONG_MAX;
+
+		// All tasks in the lowest level expire within SCHEDULER_WHEEL_SLOTS ticks from now. Higher levels are
+		// only inspected to find the next cascade, which might move tasks into the lowest level that expire earlier.
+		if ( this->m_levelSizes[0] > 0 ) {
+			for ( unsigned long long tick = this->m_tick; tick < this->m_tick + SCHEDULER_WHEEL_SLOTS; tick++ ) {
+				if ( ! this->m_wheel[0][tick & mask].empty() ) {
+					next = tick;
+					break;
+				}
+			}
+		}
+		for ( unsigned int level = 1; level < SCHEDULER_WHEEL_LEVELS; level++ ) {
+			if ( this->m_levelSizes[level] > 0 ) {
+				unsigned int bits = SCHEDULER_WHEEL_BITS * level;
+				unsigned long long block = this->m_tick >> bits;
+				for ( unsigned long long i = ( ( this->m_tick & ( ( 1ULL << bits ) - 1 ) ) == 0 ? 0 : 1 ); i <= SCHEDULER_WHEEL_SLOTS; i++ ) {
+					if ( ! this->m_wheel[level][( block + i ) & mask].empty() ) {
+						next = std::min( next, ( block + i ) << bits );
+						break;
+					}
+				}
+			}
+		}
+		if ( this->m_levelSizes[c_overflowLevel] > 0 ) {
+			unsigned int bits = SCHEDULER_WHEEL_BITS * ( SCHEDULER_WHEEL_LEVELS - 1 );
+			next = std::min( next, ( ( this->m_tick >> bits ) + 1 ) << bits );
+		}
+		return next;
+	};
+
+	inline void Scheduler::ThreadPool::_wake( bool ready_, unsigned long long tick_ ) {
+		// If there's work and no thread to pick it up, either because all threads are busy or because no thread is
+		// waiting for the wheel, the pool grows. Threads that are still starting up pick up work by themselves.
+		if ( ready_ ) {
+			if ( this->m_workWaiting > 0 ) {
+				this->m_workCondition.notify_one();
+			} else if ( this->m_timerWaiting ) {
+				this->m_timerCondition.notify_one();
+			} else if ( this->m_startingThreads == 0 ) {
+				this->_spawn();
+			}
+		} else if ( this->m_timerWaiting ) {
+			if ( tick_ < this->m_timerDeadline ) {
+				this->m_timerCondition.notify_one();
+			}
+		} else if ( this->m_size > 0 ) {
+			if ( this->m_workWaiting > 0 ) {
+				this->m_workCondition.notify_one();
+			} else if ( this->m_startingThreads == 0 ) {
+				this->_spawn();
+			}
+		}
+	};
+
+	auto Scheduler::ThreadPool::_statistics( const Scheduler* scheduler_ ) const -> Statistics {
+		Statistics statistics;
+		statistics.label = scheduler_->m_label;
+		statistics.pending = 0;
+		statistics.active = 0;
+		this->_each( scheduler_, [&statistics]( const BaseTask* task_ ) {
+			if ( ( task_->m_state & c_active ) == c_active ) {
+				statistics.active++;
+			} else {
+				statistics.pending++;
+			}
+		} );
+		statistics.executed = scheduler_->m_counters.executed.load( std::memory_order_relaxed );
+		statistics.delay = scheduler_->m_counters.delay.load( std::memory_order_relaxed );
+		statistics.runtime = scheduler_->m_counters.runtime.load( std::memory_order_relaxed );
+		for ( unsigned int i = 0; i < SCHEDULER_STATISTICS_BUCKETS; i++ ) {
+			statistics.delayBuckets[i] = scheduler_->m_counters.delayBuckets[i].load( std::memory_order_relaxed );
+			statistics.runtimeBuckets[i] = scheduler_->m_counters.runtimeBuckets[i].load( std::memory_order_relaxed );
+		}
+		return statistics;
+	};
+
+	template<class F> void Scheduler::ThreadPool::_each( const Scheduler* scheduler_, F&& func_ ) const {
+		auto owner = this->m_index.find( scheduler_ );
+		if ( owner != this->m_index.end() ) {
+			for ( auto const &tasks : owner->second ) {
+				for ( auto const &task : tasks.second ) {
+					func_( task );
+				}
+			}
 		}
 	};
 
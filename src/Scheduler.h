@@ -1,9 +1,14 @@
 #pragma once
 
+#include <string>
 #include <thread>
 #include <chrono>
 #include <vector>
-#include <map>
+#include <list>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <condition_variable>
 #include <climits>
@@ -20,6 +25,40 @@
 #define SCHEDULER_INTERVAL_5MIN 1000 * 60 * 5
 #define SCHEDULER_INTERVAL_1HOUR 1000 * 60 * 60
 
+// The pending tasks are kept in a hierarchical timing wheel with a resolution of 1 millisecond. Each level consists
+// of 2^SCHEDULER_WHEEL_BITS slots and covers SCHEDULER_WHEEL_BITS more bits of the expiry tick than the level below,
+// which makes 4 levels of 256 slots span ~49 days. Tasks beyond that end up in an overflow list.
+#define SCHEDULER_WHEEL_BITS 8
+#define SCHEDULER_WHEEL_SLOTS ( 1 << SCHEDULER_WHEEL_BITS )
+#define SCHEDULER_WHEEL_LEVELS 4
+
+// The thread pool starts with the minimum number of threads and grows up to the maximum number of threads when due
+// tasks find no idle thread to run them. Threads that have been idle for the idle timeout are stopped again. Threads
+// that are blocked waiting for something are compensated for with additional threads, up to twice the maximum.
+#define SCHEDULER_THREADS_MIN 2
+#define SCHEDULER_THREADS_MAX_PER_CORE 4
+#define SCHEDULER_THREADS_STACK_SIZE 1024 * 1024
+#define SCHEDULER_THREADS_IDLE_TIMEOUT SCHEDULER_INTERVAL_1MIN
+#define SCHEDULER_THREADS_LIMIT 256
+
+// Each thread runs at most this many tasks from the ready queues before advancing the wheel again.
+#define SCHEDULER_THREADS_BATCH_SIZE 32
+
+// Tasks are scheduled on the steady clock. Tasks that are anchored to the wall clock are placed in the wheel again if
+// the system clock is adjusted by more than this many milliseconds.
+#define SCHEDULER_CLOCK_ADJUST_THRESHOLD 1000
+
+// The queue delay and the run time of tasks are counted per scheduler in a fixed number of buckets. The upper bounds
+// of the buckets are listed in Scheduler::StatisticsBuckets, the last bucket counts everything above that.
+#define SCHEDULER_STATISTICS_BUCKETS 12
+
+// Threads that wait for a task to complete are parked on one of a fixed number of condition variables, selected by the
+// address of the task. Tasks therefore don't need a synchronization object of their own.
+#define SCHEDULER_PARKING_SLOTS 64
+
+// Ready tasks are taken in order of their priority class. This is the number of classes in Scheduler::Priority.
+#define SCHEDULER_PRIORITIES 3
+
 namespace micasa {
 
 	// =========
@@ -34,42 +73,148 @@ namespace micasa {
 
 	public:
 
+		// ========
+		// Blocking
+		// ========
+
+		// Code running on a pool thread that is about to wait for something other than the cpu, such as a network
+		// response, the result of another task or a plugin to stop, should hold a Blocking instance for the duration
+		// of the wait. The pool then adds a thread if needed so that other tasks aren't starved.
+		class Blocking final {
+
+		public:
+			Blocking();
+			~Blocking();
+
+			Blocking( const Blocking& ) = delete; // do not copy
+			Blocking& operator=( const Blocking& ) = delete; // do not copy-assign
+
+		}; // class Blocking
+
+		// ========
+		// Priority
+		// ========
+
+		// Ready tasks of a higher priority class are always taken before ready tasks of a lower priority class.
+		// Interactive tasks are tasks a user is waiting for, such as api replies and websocket pushes. Background
+		// tasks are maintenance tasks that can wait for everything else.
+		enum class Priority: unsigned short {
+			INTERACTIVE = 0,
+			NORMAL,
+			BACKGROUND
+		}; // enum Priority
+
 		// ========
 		// BaseTask
 		// ========
 
 		class BaseTask: public std::enable_shared_from_this<BaseTask> {
+			friend class Scheduler;
 			friend class ThreadPool;
 
 		public:
 			typedef std::function<bool(const BaseTask&)> t_compareFunc;
+			typedef std::list<std::shared_ptr<BaseTask>> t_slot;
 
 			BaseTask( const BaseTask& ) = delete; // Do not copy!
 			BaseTask& operator=( const BaseTask& ) = delete; // Do not copy-assign!
 
-			std::chrono::system_clock::time_point time;
+			std::chrono::steady_clock::time_point time;
 			unsigned long delay;
 			unsigned long repeat;
 			unsigned long iteration;
 			void* data;
 
-			BaseTask( Scheduler* scheduler_, std::chrono::system_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_ ) :
+			BaseTask( Scheduler* scheduler_, std::chrono::steady_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_ ) :
 				time( time_ ),
 				delay( delay_ ),
 				repeat( repeat_ ),
 				iteration( 0 ),
 				data( data_ ),
-				m_scheduler( scheduler_ )
+				m_scheduler( scheduler_ ),
+				m_wallClock( false ),
+				m_priority( Priority::NORMAL ),
+				m_limited( scheduler_->m_maxConcurrency > 0 ),
+				m_state( 0 ),
+				m_due( 0 ),
+				m_completion( 0 ),
+				m_laneNext( nullptr ),
+				m_indexed( false ),
+				m_key( nullptr ),
+				m_slot( nullptr ),
+				m_level( 0 ),
+				m_tick( 0 )
 			{
 			};
 			virtual ~BaseTask() { };
 
 			virtual void execute() = 0;
-			virtual void complete() = 0;
+
+			// Waits for the current run of the task to complete, or for the first run if the task hasn't run yet. The
+			// wait returns immediately if the task is in between runs.
+			void complete() const {
+				this->_wait();
+			};
+
+			bool waitFor( unsigned long wait_ ) const {
+				return this->_waitFor( wait_ );
+			};
+
+		protected:
+			// The start and the end of each run are marked with a single atomic operation. Waiting threads and
+			// continuations are only looked after if there are any, so tasks that nobody waits for pay nothing more.
+			void _begin();
+			void _finish();
+			void _wait() const;
+			bool _waitFor( unsigned long wait_ ) const;
+			void _then( std::function<void()>&& func_ );
+			std::mutex& _parkingMutex() const;
 
 		private:
+			static const unsigned int c_completed = 1;
+			static const unsigned int c_parked = 2;
+			static const unsigned int c_continued = 4;
+
 			Scheduler* m_scheduler;
 
+			// Tasks that are anchored to the wall clock keep their scheduled time on the system clock. Their steady
+			// time is derived from it each time they're placed in the wheel.
+			bool m_wallClock;
+			std::chrono::system_clock::time_point m_wallTime;
+
+			Priority m_priority;
+
+			// Tasks of a scheduler with a concurrency limit need a slot of the scheduler to run.
+			const bool m_limited;
+
+			// The state flags tell wether the task is queued in one of the ready queues and wether it is running. They
+			// are changed atomically because threads take tasks from the ready queues without holding the tasks mutex.
+			std::atomic<unsigned int> m_state;
+
+			// The steady time at which the task was last queued as due, used to measure how long it waited for a
+			// thread to run it.
+			std::atomic<std::chrono::steady_clock::rep> m_due;
+
+			// The completion state tells wether the last run has completed and wether there are threads parked or
+			// continuations registered for the task. The continuations are guarded by the mutex of the parking slot.
+			mutable std::atomic<unsigned int> m_completion;
+			std::vector<std::function<void()>> m_continuations;
+
+			// Tasks that are submitted to the lane of the ThreadPool are linked through the next pointer and keep a
+			// reference to themselves until they are drained from it.
+			BaseTask* m_laneNext;
+			std::shared_ptr<BaseTask> m_laneSelf;
+
+			// The members below are owned by the ThreadPool and are only accessed while holding its tasks mutex. They
+			// allow a task to be unlinked from the wheel slot it is in in constant time and remember the data pointer
+			// the task was indexed under.
+			bool m_indexed;
+			const void* m_key;
+			t_slot* m_slot;
+			t_slot::iterator m_slotIt;
+			unsigned int m_level;
+			unsigned long long m_tick;
+
 		}; // class BaseTask
 
 		// ====
@@ -81,53 +226,73 @@ namespace micasa {
 
 		public:
 			typedef std::function<T(std::shared_ptr<Task<T>>)> t_taskFunc;
+			typedef std::function<void(std::shared_ptr<Task<T>>)> t_thenFunc;
 
-			Task( Scheduler* scheduler_, t_taskFunc&& func_, std::chrono::system_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_ ) :
+			Task( Scheduler* scheduler_, t_taskFunc&& func_, std::chrono::steady_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_ ) :
 				BaseTask( scheduler_, time_, delay_, repeat_, data_ ),
-				m_func( std::move( func_ ) ),
-				m_first( true )
+				m_func( std::move( func_ ) )
 			{
-				// Retrieving the first result for the task is blocking. All subsequent calls to retrieve the result are
-				// instant, returning the last generated value.
-				this->m_resultMutex.lock();
 			};
 			~Task() { };
 
 			void execute() {
-				if ( ! this->m_first ) {
-					this->m_resultMutex.lock();
+				this->_begin();
+				T result = this->m_func( std::static_pointer_cast<Task<T>>( this->shared_from_this() ) );
+				{
+					std::lock_guard<std::mutex> lock( this->_parkingMutex() );
+					this->m_result = std::move( result );
 				}
-				this->m_result = this->m_func( std::static_pointer_cast<Task<T>>( this->shared_from_this() ) );
-				this->m_first = false;
-				this->m_resultMutex.unlock();
-			};
-
-			void complete() {
-				this->wait();
+				this->_finish();
 			};
 
+			// Retrieving the first result for the task is blocking. All subsequent calls to retrieve the result are
+			// instant, returning the last generated value.
 			T wait() const {
-				std::lock_guard<std::timed_mutex> lock( this->m_resultMutex );
+				this->_wait();
+				std::lock_guard<std::mutex> lock( this->_parkingMutex() );
 				return this->m_result;
 			};
 
-			bool waitFor( unsigned long wait_ ) const {
-				if ( this->m_resultMutex.try_lock_for( std::chrono::milliseconds( wait_ ) ) ) {
-					this->m_resultMutex.unlock();
-					return true;
-				}
-				return false;
+			// The continuation runs once, on the thread that completes the current or the first run of the task, or
+			// immediately if the task is in between runs. Continuations of tasks that are erased before they run are
+			// dropped.
+			void then( t_thenFunc&& func_ ) {
+				std::weak_ptr<BaseTask> task = this->shared_from_this();
+				t_thenFunc func = std::move( func_ );
+				this->_then( [task,func]() {
+					auto locked = task.lock();
+					if ( locked ) {
+						func( std::static_pointer_cast<Task<T>>( locked ) );
+					}
+				} );
 			};
 
 		private:
 			t_taskFunc m_func;
-			mutable std::timed_mutex m_resultMutex;
 			T m_result;
-			bool m_first;
 
 		}; // class Task
 
-		Scheduler() { };
+		// ==========
+		// Statistics
+		// ==========
+
+		// A snapshot of the counters of a single scheduler. Delays and run times are in microseconds.
+		struct Statistics {
+			std::string label;
+			unsigned int pending;
+			unsigned int active;
+			unsigned long long executed;
+			unsigned long long delay;
+			unsigned long long runtime;
+			unsigned long long delayBuckets[SCHEDULER_STATISTICS_BUCKETS];
+			unsigned long long runtimeBuckets[SCHEDULER_STATISTICS_BUCKETS];
+		}; // struct Statistics
+		static const unsigned long long StatisticsBuckets[SCHEDULER_STATISTICS_BUCKETS - 1];
+
+		// The priority class is used for tasks that are scheduled without one. The maximum concurrency limits the
+		// number of tasks of the scheduler that run simultaneously, zero means no limit.
+		Scheduler( const std::string& label_, Priority priority_ = Priority::NORMAL, unsigned int maxConcurrency_ = 0 );
 		~Scheduler();
 
 		Scheduler( const Scheduler& ) = delete; // do not copy
@@ -135,32 +300,50 @@ namespace micasa {
 		Scheduler( const Scheduler&& ) = delete; // do not move
 		Scheduler& operator=( Scheduler&& ) = delete; // do not move-assign
 
+		// Tasks are scheduled relative to the steady clock, so that adjustments of the system clock have no effect on
+		// them. Tasks that are scheduled at a system clock time point, such as tasks that should run at whole minutes,
+		// are anchored to the wall clock instead. Their first run and their repetitions follow the system clock, also
+		// when it is adjusted in the mean time.
+
 		template<typename V = void> std::shared_ptr<Task<V>> schedule( unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
-			std::shared_ptr<Task<V>> task = std::make_shared<Task<V>>( this, std::move( func_ ), std::chrono::system_clock::now() + std::chrono::milliseconds( delay_ ), delay_, repeat_, data_ );
-			Scheduler::ThreadPool::get().schedule( std::static_pointer_cast<BaseTask>( task ) );
-			return task;
+			return this->schedule<V>( this->m_priority, delay_, delay_, repeat_, data_, std::move( func_ ) );
 		};
 
 		template<typename V = void> std::shared_ptr<Task<V>> schedule( std::chrono::system_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
-			std::shared_ptr<Task<V>> task = std::make_shared<Task<V>>( this, std::move( func_ ), time_, delay_, repeat_, data_ );
+			return this->schedule<V>( this->m_priority, time_, delay_, repeat_, data_, std::move( func_ ) );
+		};
+
+		template<typename V = void> std::shared_ptr<Task<V>> schedule( unsigned long wait_, unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
+			return this->schedule<V>( this->m_priority, wait_, delay_, repeat_, data_, std::move( func_ ) );
+		};
+
+		template<typename V = void> std::shared_ptr<Task<V>> schedule( Priority priority_, unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
+			return this->schedule<V>( priority_, delay_, delay_, repeat_, data_, std::move( func_ ) );
+		};
+
+		template<typename V = void> std::shared_ptr<Task<V>> schedule( Priority priority_, std::chrono::system_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
+			std::shared_ptr<Task<V>> task = std::make_shared<Task<V>>( this, std::move( func_ ), std::chrono::steady_clock::now(), delay_, repeat_, data_ );
+			task->m_priority = priority_;
+			task->m_wallClock = true;
+			task->m_wallTime = time_;
 			Scheduler::ThreadPool::get().schedule( task );
 			return task;
 		};
 
-		template<typename V = void> std::shared_ptr<Task<V>> schedule( unsigned long wait_, unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
-			return this->schedule<V>( std::chrono::system_clock::now() + std::chrono::milliseconds( wait_ ), delay_, repeat_, data_, std::move( func_ ) );
+		template<typename V = void> std::shared_ptr<Task<V>> schedule( Priority priority_, unsigned long wait_, unsigned long delay_, unsigned long repeat_, void* data_, typename Task<V>::t_taskFunc&& func_ ) {
+			std::shared_ptr<Task<V>> task = std::make_shared<Task<V>>( this, std::move( func_ ), std::chrono::steady_clock::now() + std::chrono::milliseconds( wait_ ), delay_, repeat_, data_ );
+			task->m_priority = priority_;
+			Scheduler::ThreadPool::get().submit( task );
+			return task;
 		};
 
 		template<typename V = void> std::shared_ptr<Task<V>> schedule( unsigned long delay_, unsigned long repeat_, std::shared_ptr<Task<V>> task_ ) {
-			task_->time = std::chrono::system_clock::now() + std::chrono::milliseconds( delay_ );
-			task_->delay = delay_;
-			task_->repeat = repeat_;
-			Scheduler::ThreadPool::get().schedule( task_ );
-			return task_;
+			return this->schedule<V>( delay_, delay_, repeat_, task_ );
 		};
 
 		template<typename V = void> std::shared_ptr<Task<V>> schedule( std::chrono::system_clock::time_point time_, unsigned long delay_, unsigned long repeat_, std::shared_ptr<Task<V>> task_ ) {
-			task_->time = time_;
+			task_->m_wallClock = true;
+			task_->m_wallTime = time_;
 			task_->delay = delay_;
 			task_->repeat = repeat_;
 			Scheduler::ThreadPool::get().schedule( task_ );
@@ -168,14 +351,49 @@ namespace micasa {
 		};
 
 		template<typename V = void> std::shared_ptr<Task<V>> schedule( unsigned long wait_, unsigned long delay_, unsigned long repeat_, std::shared_ptr<Task<V>> task_ ) {
-			return this->schedule<V>( std::chrono::system_clock::now() + std::chrono::milliseconds( wait_ ), delay_, repeat_, task_ );
+			task_->time = std::chrono::steady_clock::now() + std::chrono::milliseconds( wait_ );
+			task_->m_wallClock = false;
+			task_->delay = delay_;
+			task_->repeat = repeat_;
+			Scheduler::ThreadPool::get().schedule( task_ );
+			return task_;
 		};
 
 		void erase( BaseTask::t_compareFunc&& func_ = []( const BaseTask& ) -> bool { return true; } );
 		std::shared_ptr<BaseTask> first( BaseTask::t_compareFunc&& func_ = []( const BaseTask& ) -> bool { return true; } ) const;
+		std::shared_ptr<BaseTask> nextScheduleFor( const void* data_ ) const;
 		void proceed( unsigned long wait_, std::shared_ptr<BaseTask> task_ );
 
+		// Changes the thread limits and the stack size of new threads of the shared thread pool. Passing zero keeps
+		// the current value.
+		static void configure( unsigned int minThreads_, unsigned int maxThreads_, size_t stackSize_ );
+
+		Statistics getStatistics() const;
+		static std::vector<Statistics> getAllStatistics();
+
 	private:
+		// The label identifies the owner of the scheduler in the statistics. The counters are updated by the threads
+		// that run the tasks of the scheduler, without holding any lock.
+		const std::string m_label;
+		struct {
+			std::atomic<unsigned long long> executed;
+			std::atomic<unsigned long long> delay;
+			std::atomic<unsigned long long> runtime;
+			std::atomic<unsigned long long> delayBuckets[SCHEDULER_STATISTICS_BUCKETS];
+			std::atomic<unsigned long long> runtimeBuckets[SCHEDULER_STATISTICS_BUCKETS];
+		} m_counters;
+
+		void _record( unsigned long long delay_, unsigned long long runtime_ );
+
+		// Tasks that are taken from a ready queue while the maximum number of tasks of the scheduler are running are
+		// deferred. Each task that finishes hands the oldest deferred task back to a ready queue. Tasks that wait in
+		// a Blocking section don't count as running, so that tasks waiting for other tasks of the same scheduler
+		// cannot lock up the scheduler.
+		const Priority m_priority;
+		const unsigned int m_maxConcurrency;
+		unsigned int m_running;
+		std::deque<std::shared_ptr<BaseTask>> m_deferred;
+		std::mutex m_concurrencyMutex;
 
 		// ==========
 		// ThreadPool
@@ -194,9 +412,19 @@ namespace micasa {
 			ThreadPool& operator=( ThreadPool&& ) = delete; // do not move-assign
 
 			void schedule( std::shared_ptr<BaseTask> task_ );
+			void submit( std::shared_ptr<BaseTask> task_ );
 			void erase( Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ = []( const BaseTask& ) -> bool { return true; } );
-			std::shared_ptr<BaseTask> first( const Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ = []( const BaseTask& ) -> bool { return true; } ) const;
+			std::shared_ptr<BaseTask> first( const Scheduler* scheduler_, BaseTask::t_compareFunc&& func_ = []( const BaseTask& ) -> bool { return true; } );
+			std::shared_ptr<BaseTask> nextScheduleFor( const Scheduler* scheduler_, const void* data_ );
 			void proceed( const Scheduler* scheduler_, unsigned long wait_, std::shared_ptr<BaseTask> task_ );
+			size_t size();
+			void attach( Scheduler* scheduler_ );
+			void detach( Scheduler* scheduler_ );
+			Statistics getStatistics( const Scheduler* scheduler_ );
+			std::vector<Statistics> getAllStatistics();
+			void configure( unsigned int minThreads_, unsigned int maxThreads_, size_t stackSize_ );
+			void block();
+			void unblock();
 
 			static ThreadPool& get() {
 				// In c++11 static initialization is supposed to be thread-safe.
@@ -205,19 +433,94 @@ namespace micasa {
 			}
 
 		private:
+			// The overflow list is treated as an additional wheel level.
+			static const unsigned int c_overflowLevel = SCHEDULER_WHEEL_LEVELS;
+
+			// Task state flags.
+			static const unsigned int c_queued = 1;
+			static const unsigned int c_active = 2;
+
+			// Pending tasks are also indexed by their owning scheduler and by their data pointer, so that lookups by
+			// owner only visit the tasks of that owner.
+			typedef std::unordered_map<const void*, std::unordered_set<BaseTask*>> t_ownerIndex;
+
+			// Each thread owns a ready queue. Due tasks are queued in the ready queue of the thread that found them
+			// due, and idle threads steal from the ready queues of other threads. Finished tasks are collected per
+			// thread and handed back to the wheel or removed from the index in bulk.
+			struct t_worker {
+				ThreadPool* pool;
+				unsigned int index;
+				std::atomic<bool> running;
+				std::atomic<Scheduler*> executing;
+				std::mutex mutex;
+				std::deque<std::shared_ptr<BaseTask>> tasks[SCHEDULER_PRIORITIES];
+				std::vector<std::shared_ptr<BaseTask>> finished;
+			};
+
 			bool m_shutdown;
-			bool m_continue;
-			std::multimap<std::chrono::system_clock::time_point, std::shared_ptr<BaseTask>> m_tasks;
-			std::vector<std::shared_ptr<BaseTask>> m_activeTasks;
-			mutable std::recursive_mutex m_tasksMutex;
-			std::vector<std::thread> m_threads;
-			std::condition_variable m_continueCondition;
-			mutable std::mutex m_conditionMutex;
+			const std::chrono::steady_clock::time_point m_epoch;
+			std::chrono::milliseconds m_clockOffset;
+			unsigned long long m_tick;
+			BaseTask::t_slot m_wheel[SCHEDULER_WHEEL_LEVELS][SCHEDULER_WHEEL_SLOTS];
+			BaseTask::t_slot m_overflow;
+			size_t m_levelSizes[SCHEDULER_WHEEL_LEVELS + 1];
+			size_t m_size;
+			std::unordered_map<const Scheduler*, t_ownerIndex> m_index;
+			std::unordered_set<const Scheduler*> m_schedulers;
+			std::unordered_set<BaseTask*> m_wallClockTasks;
+			t_worker m_workers[SCHEDULER_THREADS_LIMIT];
+			std::atomic<unsigned int> m_workersUsed;
+			std::atomic<size_t> m_queued;
+			std::atomic<size_t> m_queuedPriorities[SCHEDULER_PRIORITIES];
+
+			// Tasks that are due right away are submitted to the lane without taking the tasks mutex. The lane is a
+			// lock-free stack that is drained in one go, in submission order, by the next thread that takes the tasks
+			// mutex. Only the submitter that finds the lane empty wakes up a thread for it.
+			std::atomic<BaseTask*> m_lane;
+			unsigned int m_nextWorker;
+			mutable std::mutex m_tasksMutex;
+			unsigned int m_minThreads;
+			unsigned int m_maxThreads;
+			size_t m_stackSize;
+			unsigned int m_threads;
+			unsigned int m_startingThreads;
+			unsigned int m_blockingThreads;
+			std::condition_variable m_workCondition;
+			std::condition_variable m_timerCondition;
+			std::condition_variable m_exitCondition;
+			unsigned int m_workWaiting;
+			bool m_timerWaiting;
+			unsigned long long m_timerDeadline;
 
 			ThreadPool(); // private constructor
 
-			void _loop( unsigned int index_ );
-			void _notify( bool all_, std::function<void()>&& func_ );
+			static void* _worker( void* worker_ );
+			bool _spawn();
+			void _loop( t_worker& worker_ );
+			std::shared_ptr<BaseTask> _take( t_worker& worker_ );
+			void _execute( t_worker& worker_, std::shared_ptr<BaseTask> task_ );
+			void _push( t_worker& worker_, std::shared_ptr<BaseTask> task_ );
+			bool _acquire( t_worker& worker_, std::shared_ptr<BaseTask> task_ );
+			bool _release( t_worker& worker_, Scheduler* scheduler_ );
+			void _finish( t_worker& worker_ );
+			void _drain( bool wake_ = true );
+			void _queue( std::shared_ptr<BaseTask> task_ );
+			t_worker* _select();
+			void _cancel( std::shared_ptr<BaseTask> task_ );
+			unsigned long long _toTick( std::chrono::steady_clock::time_point time_ ) const;
+			void _adjust( std::chrono::steady_clock::time_point now_ );
+			void _insert( std::shared_ptr<BaseTask> task_, std::chrono::steady_clock::time_point now_ );
+			void _place( std::shared_ptr<BaseTask> task_ );
+			void _link( std::shared_ptr<BaseTask> task_, BaseTask::t_slot& slot_, unsigned int level_ );
+			void _unlink( std::shared_ptr<BaseTask> task_ );
+			void _index( BaseTask* task_ );
+			void _unindex( BaseTask* task_ );
+			void _cascade( BaseTask::t_slot& slot_ );
+			void _advance( std::chrono::steady_clock::time_point now_ );
+			unsigned long long _next() const;
+			void _wake( bool ready_, unsigned long long tick_ = ULLONG_MAX );
+			template<class F> void _each( const Scheduler* scheduler_, F&& func_ ) const;
+			Statistics _statistics( const Scheduler* scheduler_ ) const;
 
 		}; // class ThreadPool
 
@@ -231,41 +534,38 @@ namespace micasa {
 
 	public:
 		typedef std::function<void(std::shared_ptr<Task<void>>)> t_taskFunc;
+		typedef std::function<void(std::shared_ptr<Task<void>>)> t_thenFunc;
 
-		Task( Scheduler* scheduler_, t_taskFunc&& func_, std::chrono::system_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_ ) :
+		Task( Scheduler* scheduler_, t_taskFunc&& func_, std::chrono::steady_clock::time_point time_, unsigned long delay_, unsigned long repeat_, void* data_ ) :
 			BaseTask( scheduler_, time_, delay_, repeat_, data_ ),
-			m_func( std::move( func_ ) ),
-			m_first( true )
+			m_func( std::move( func_ ) )
 		{
-			this->m_resultMutex.lock();
 		};
 		~Task() { };
 
 		void execute() {
-			if ( ! this->m_first ) {
-				this->m_resultMutex.lock();
-			}
+			this->_begin();
 			this->m_func( std::static_pointer_cast<Task<void>>( this->shared_from_this() ) );
-			this->m_first = false;
-			this->m_resultMutex.unlock();
-		};
-
-		void complete() {
-			this->wait();
+			this->_finish();
 		};
 
 		void wait() const {
-			std::lock_guard<std::timed_mutex> lock( this->m_resultMutex );
+			this->_wait();
 		};
 
-		bool waitFor( unsigned long wait_ ) const {
-			return this->m_resultMutex.try_lock_for( std::chrono::milliseconds( wait_ ) );
+		void then( t_thenFunc&& func_ ) {
+			std::weak_ptr<BaseTask> task = this->shared_from_this();
+			t_thenFunc func = std::move( func_ );
+			this->_then( [task,func]() {
+				auto locked = task.lock();
+				if ( locked ) {
+					func( std::static_pointer_cast<Task<void>>( locked ) );
+				}
+			} );
 		};
 
 	private:
 		t_taskFunc m_func;
-		mutable std::timed_mutex m_resultMutex;
-		bool m_first;
 
 	}; // class Task<void>
 
@@ -30,7 +30,7 @@ void micasa_serial_signal_handler( int signal_ ) {
 
 namespace micasa {
 
-	Scheduler Serial::g_scheduler;
+	Scheduler Serial::g_scheduler( "Serial" );
 	std::vector<Serial*> Serial::g_serialInstances;
 	std::mutex Serial::g_serialInstancesMutex;
 
@@ -1,4 +1,5 @@
 #include <memory>
+#include <algorithm>
 
 #ifdef _DEBUG
 	#include <cassert>
@@ -7,6 +8,8 @@
 #include "Settings.h"
 
 #include "Database.h"
+#include "Controller.h"
+#include "Scheduler.h"
 #include "Plugin.h"
 #include "Device.h"
 #include "User.h"
@@ -16,6 +19,20 @@ namespace micasa {
 	using namespace nlohmann;
 
 	extern std::unique_ptr<Database> g_database;
+	extern std::unique_ptr<Controller> g_controller;
+
+	// The controller indexes devices by their name, which is a setting. The index is updated when the setting is
+	// committed, regardless of who changed it.
+	template<class T> static void committed( const T& target_, const std::vector<std::string>& dirty_ ) { };
+	template<> void committed( const Device& device_, const std::vector<std::string>& dirty_ ) {
+		// Settings of devices that are destroyed with the controller are committed after it's gone.
+		if (
+			g_controller
+			&& std::find( dirty_.begin(), dirty_.end(), "name" ) != dirty_.end()
+		) {
+			g_controller->reindexDeviceName( &device_ );
+		}
+	};
 
 	SettingValue::SettingValue( const unsigned long& value_ ) {
 		this->assign( std::to_string( value_ ) );
@@ -53,49 +70,83 @@ namespace micasa {
 		this->assign( value_ );
 	};
 
+	ParsedSetting::ParsedSetting( const std::string& value_ ) :
+		m_text( value_ ),
+		m_boolean( value_ == "true" )
+	{
+		// The conversions match those of the stream that was previously used for each get; an integer stops at the
+		// first character that isn't a digit and text that isn't a number results in 0.
+		const char* text = value_.c_str();
+		char* end;
+		this->m_integer = std::strtoll( text, &end, 10 );
+		this->m_numeric = ( end != text && *end == '\0' );
+		this->m_real = std::strtod( text, nullptr );
+	};
+
 	template<class T> SettingsHelper<T>::SettingsHelper( const T& target_ ) :
-		m_target( target_ ),
-		m_populated( false )
+		m_target( target_ )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before settings instances." );
 #endif // _DEBUG
 	};
 
-	template<class T> void SettingsHelper<T>::commit() {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
+	template<class T> SettingsHelper<T>::SettingsHelper( const T& target_, const std::map<std::string, std::string>& settings_ ) :
+		m_target( target_ )
+	{
+#ifdef _DEBUG
+		assert( g_database && "Global Database instance should be created before settings instances." );
+#endif // _DEBUG
+		this->m_settings = std::make_shared<const ParsedSettings>( settings_.begin(), settings_.end() );
+	};
+
+	template<class T> void SettingsHelper<T>::commit( bool wait_ ) {
+		std::unique_lock<std::mutex> lock( this->m_settingsMutex );
+		std::string key = std::string( T::settingsName ) + "_settings." + std::to_string( this->m_target.getId() ) + ".";
 		for ( auto dirtyIt = this->m_dirty.begin(); dirtyIt != this->m_dirty.end(); dirtyIt++ ) {
-			auto setting = this->m_settings.find( *dirtyIt );
-			if ( setting != this->m_settings.end() ) {
-				g_database->putQuery(
-					"REPLACE INTO `%s_settings` (`key`, `value`, `%s_id`) "
-					"VALUES (%Q, %Q, %d)",
-					T::settingsName,
-					T::settingsName,
-					setting->first.c_str(),
-					setting->second.c_str(),
+			auto setting = this->m_settings->find( *dirtyIt );
+			if ( setting != this->m_settings->end() ) {
+				g_database->coalesceQuery(
+					Database::Durability::QUEUED,
+					key + *dirtyIt,
+					std::string( T::settingsName ) + "_settings.replace",
+					std::string( "REPLACE INTO `" ) + T::settingsName + "_settings` (`key`, `value`, `" + T::settingsName + "_id`) "
+					"VALUES (?, ?, ?)",
+					setting->first,
+					setting->second.getText(),
 					this->m_target.getId()
 				);
 			} else {
-				g_database->putQuery(
-					"DELETE FROM `%s_settings` "
-					"WHERE `key`=%Q "
-					"AND `%s_id`=%d",
-					T::settingsName,
-					( *dirtyIt ).c_str(),
-					T::settingsName,
+				g_database->coalesceQuery(
+					Database::Durability::QUEUED,
+					key + *dirtyIt,
+					std::string( T::settingsName ) + "_settings.delete",
+					std::string( "DELETE FROM `" ) + T::settingsName + "_settings` "
+					"WHERE `key`=? "
+					"AND `" + T::settingsName + "_id`=?",
+					*dirtyIt,
 					this->m_target.getId()
 				);
 			}
 		}
-		this->m_dirty.clear();
+		std::vector<std::string> dirty;
+		dirty.swap( this->m_dirty );
+		lock.unlock();
+
+		committed( this->m_target, dirty );
+		if ( wait_ ) {
+			Scheduler::Blocking blocking;
+			g_database->flush();
+		}
 	};
 
 	template<class T> void SettingsHelper<T>::_populateOnce() const {
 		// NOTE Only call this method with held lock on settings mutex.
-		if ( ! this->m_populated ) {
-			this->m_settings.clear();
-			auto results = g_database->getQueryMap(
+		if ( ! this->m_settings ) {
+			// The settings are read on a connection of the read pool, so populating the settings of many targets at
+			// once doesn't contend for the primary connection with the writer.
+			ParsedSettings settings;
+			Database::Cursor cursor = g_database->getCursor(
 				"SELECT `key`, `value` "
 				"FROM `%s_settings` "
 				"WHERE `%s_id`=%d",
@@ -103,53 +154,67 @@ namespace micasa {
 				T::settingsName,
 				this->m_target.getId()
 			);
-			this->m_settings.insert( results.begin(), results.end() );
-			this->m_populated = true;
+			while ( cursor.next() ) {
+				settings.emplace( cursor.get<std::string>( 0 ), cursor.get<std::string>( 1 ) );
+			}
+			std::atomic_store( &this->m_settings, std::shared_ptr<const ParsedSettings>( std::make_shared<ParsedSettings>( std::move( settings ) ) ) );
 		}
 	};
 
 	// The void-variant of the class is fully specialized, resulting in a fully instantiated type
 	// called SettingsHelper<void>.
-	SettingsHelper<void>::SettingsHelper() :
-		m_populated( false )
-	{
+	SettingsHelper<void>::SettingsHelper() {
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before settings instances." );
 #endif // _DEBUG
 	};
 
-	void SettingsHelper<void>::commit() {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
+	void SettingsHelper<void>::commit( bool wait_ ) {
+		std::unique_lock<std::mutex> lock( this->m_settingsMutex );
 		for ( auto dirtyIt = this->m_dirty.begin(); dirtyIt != this->m_dirty.end(); dirtyIt++ ) {
-			auto setting = this->m_settings.find( *dirtyIt );
-			if ( setting != this->m_settings.end() ) {
-				g_database->putQuery(
+			auto setting = this->m_settings->find( *dirtyIt );
+			if ( setting != this->m_settings->end() ) {
+				g_database->coalesceQuery(
+					Database::Durability::QUEUED,
+					"settings." + *dirtyIt,
+					"settings.replace",
 					"REPLACE INTO `settings` (`key`, `value`) "
-					"VALUES (%Q, %Q)",
-					setting->first.c_str(),
-					setting->second.c_str()
+					"VALUES (?, ?)",
+					setting->first,
+					setting->second.getText()
 				);
 			} else {
-				g_database->putQuery(
+				g_database->coalesceQuery(
+					Database::Durability::QUEUED,
+					"settings." + *dirtyIt,
+					"settings.delete",
 					"DELETE FROM `settings` "
-					"WHERE `key`=%Q ",
-					( *dirtyIt ).c_str()
+					"WHERE `key`=?",
+					*dirtyIt
 				);
 			}
 		}
 		this->m_dirty.clear();
+		lock.unlock();
+
+		if ( wait_ ) {
+			Scheduler::Blocking blocking;
+			g_database->flush();
+		}
 	};
 
 	void SettingsHelper<void>::_populateOnce() const {
 		// NOTE Only call this method with held lock on settings mutex.
-		if ( ! this->m_populated ) {
-			this->m_settings.clear();
-			auto results = g_database->getQueryMap(
+		if ( ! this->m_settings ) {
+			ParsedSettings settings;
+			Database::Cursor cursor = g_database->getCursor(
 				"SELECT `key`, `value` "
-				"FROM `settings` "
+				"FROM `settings`"
 			);
-			this->m_settings.insert( results.begin(), results.end() );
-			this->m_populated = true;
+			while ( cursor.next() ) {
+				settings.emplace( cursor.get<std::string>( 0 ), cursor.get<std::string>( 1 ) );
+			}
+			std::atomic_store( &this->m_settings, std::shared_ptr<const ParsedSettings>( std::make_shared<ParsedSettings>( std::move( settings ) ) ) );
 		}
 	};
 
@@ -168,17 +233,18 @@ namespace micasa {
 	template<class T> void Settings<T>::insert( const std::vector<Setting>& settings_ ) {
 		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
 		this->_populateOnce();
-		this->m_settings.insert( settings_.begin(), settings_.end() );
+		ParsedSettings settings( *this->m_settings );
 		for ( auto settingsIt = settings_.begin(); settingsIt != settings_.end(); settingsIt++ ) {
+			settings.emplace( settingsIt->first, settingsIt->second );
 			this->m_dirty.push_back( settingsIt->first );
 		}
+		this->_putSettings( std::move( settings ) );
 	};
 
 	template<class T> bool Settings<T>::contains( const std::initializer_list<std::string>& settings_ ) const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
+		auto settings = this->_getSettings();
 		for ( auto settingsIt = settings_.begin(); settingsIt != settings_.end(); settingsIt++ ) {
-			if ( this->m_settings.find( *settingsIt ) == this->m_settings.end() ) {
+			if ( settings->find( *settingsIt ) == settings->end() ) {
 				return false;
 			}
 		}
@@ -186,22 +252,21 @@ namespace micasa {
 	};
 
 	template<class T> bool Settings<T>::contains( const std::string& key_ ) const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
-		return this->m_settings.find( key_ ) != this->m_settings.end();
+		auto settings = this->_getSettings();
+		return settings->find( key_ ) != settings->end();
 	};
 
 	template<class T> void Settings<T>::remove( const std::string& key_ ) {
 		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
 		this->_populateOnce();
-		this->m_settings.erase( key_ );
+		ParsedSettings settings( *this->m_settings );
+		settings.erase( key_ );
+		this->_putSettings( std::move( settings ) );
 		this->m_dirty.push_back( key_ );
 	};
 
 	template<class T> unsigned int Settings<T>::count() const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
-		return this->m_settings.size();
+		return this->_getSettings()->size();
 	};
 
 	template<class T> bool Settings<T>::isDirty() const {
@@ -210,17 +275,15 @@ namespace micasa {
 	};
 
 	template<class T> std::string Settings<T>::get( const std::string& key_ ) const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
-		return this->m_settings.at( key_ );
+		return this->_getSettings()->at( key_ ).getText();
 	};
 
 	template<class T> std::string Settings<T>::get( const std::string& key_, const std::string& default_ ) const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
-		try {
-			return this->m_settings.at( std::string( key_ ) );
-		} catch( std::out_of_range exception_ ) {
+		auto settings = this->_getSettings();
+		auto find = settings->find( key_ );
+		if ( find != settings->end() ) {
+			return find->second.getText();
+		} else {
 			return default_;
 		}
 	};
@@ -228,11 +291,15 @@ namespace micasa {
 	template<class T> void Settings<T>::put( const std::string& key_, const SettingValue& value_ ) {
 		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
 		this->_populateOnce();
+		auto find = this->m_settings->find( key_ );
 		if (
-			this->m_settings.find( key_ ) == this->m_settings.end() // does not exist
-			|| value_ != this->m_settings.at( key_ ) // is not the same
+			find == this->m_settings->end() // does not exist
+			|| value_ != find->second.getText() // is not the same
 		) {
-			this->m_settings[key_] = value_;
+			ParsedSettings settings( *this->m_settings );
+			settings.erase( key_ );
+			settings.emplace( key_, value_ );
+			this->_putSettings( std::move( settings ) );
 			this->m_dirty.push_back( key_ );
 		}
 	};
@@ -259,25 +326,40 @@ namespace micasa {
 	};
 
 	template<class T> std::map<std::string, std::string> Settings<T>::getAll() const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
+		auto settings = this->_getSettings();
 		std::map<std::string, std::string> result;
-		result.insert( this->m_settings.begin(), this->m_settings.end() );
+		for ( auto settingsIt = settings->begin(); settingsIt != settings->end(); settingsIt++ ) {
+			result[settingsIt->first] = settingsIt->second.getText();
+		}
 		return result;
 	};
 
 	template<class T> std::map<std::string, std::string> Settings<T>::getAll( const std::string& prefix_ ) const {
-		std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-		this->_populateOnce();
+		auto settings = this->_getSettings();
 		std::map<std::string, std::string> result;
-		for ( auto settingsIt = this->m_settings.begin(); settingsIt != this->m_settings.end(); settingsIt++ ) {
+		for ( auto settingsIt = settings->begin(); settingsIt != settings->end(); settingsIt++ ) {
 			if ( settingsIt->first.substr( 0, prefix_.size() ) == prefix_ ) {
-				result[settingsIt->first] = settingsIt->second;
+				result[settingsIt->first] = settingsIt->second.getText();
 			}
 		}
 		return result;
 	};
 
+	template<class T> std::shared_ptr<const ParsedSettings> Settings<T>::_getSettings() const {
+		auto settings = std::atomic_load( &this->m_settings );
+		if ( ! settings ) {
+			std::lock_guard<std::mutex> lock( this->m_settingsMutex );
+			this->_populateOnce();
+			settings = this->m_settings;
+		}
+		return settings;
+	};
+
+	template<class T> void Settings<T>::_putSettings( ParsedSettings&& settings_ ) {
+		// NOTE Only call this method with held lock on settings mutex.
+		std::atomic_store( &this->m_settings, std::shared_ptr<const ParsedSettings>( std::make_shared<ParsedSettings>( std::move( settings_ ) ) ) );
+	};
+
 	template class Settings<void>;
 	template class Settings<Plugin>;
 	template class Settings<Device>;
@@ -2,7 +2,9 @@
 
 #include <string>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <type_traits>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -26,18 +28,69 @@ namespace micasa {
 
 	typedef std::pair<std::string, SettingValue> Setting;
 
+	// Settings are parsed once when they are populated or put, so that getting a setting doesn't involve a stream
+	// for the common types. Other types, such as enums that are stored as text, are still read from a stream.
+	class ParsedSetting {
+
+	public:
+		ParsedSetting( const std::string& value_ );
+
+		const std::string& getText() const { return this->m_text; };
+		template<typename V> V get() const {
+			V value;
+			this->_get( value );
+			return value;
+		};
+
+	private:
+		std::string m_text;
+		long long m_integer;
+		double m_real;
+		bool m_boolean;
+		bool m_numeric; // the entire text is an integer
+
+		void _get( std::string& value_ ) const { value_ = this->m_text; };
+		void _get( bool& value_ ) const { value_ = this->m_boolean; };
+		template<typename V> typename std::enable_if<std::is_integral<V>::value>::type _get( V& value_ ) const {
+			value_ = static_cast<V>( this->m_integer );
+		};
+		template<typename V> typename std::enable_if<std::is_floating_point<V>::value>::type _get( V& value_ ) const {
+			value_ = static_cast<V>( this->m_real );
+		};
+		template<typename V> typename std::enable_if<std::is_enum<V>::value>::type _get( V& value_ ) const {
+			if ( this->m_numeric ) {
+				value_ = static_cast<V>( this->m_integer );
+			} else {
+				this->_read( value_ );
+			}
+		};
+		template<typename V> typename std::enable_if<! std::is_arithmetic<V>::value && ! std::is_enum<V>::value>::type _get( V& value_ ) const {
+			this->_read( value_ );
+		};
+		template<typename V> void _read( V& value_ ) const {
+			std::istringstream( this->m_text ) >> std::boolalpha >> std::fixed >> std::setprecision( 3 ) >> value_;
+		};
+
+	}; // class ParsedSetting
+
+	typedef std::map<std::string, ParsedSetting> ParsedSettings;
+
 	template<class T> class SettingsHelper {
 
 	public:
 		SettingsHelper( const T& target_ );
+		SettingsHelper( const T& target_, const std::map<std::string, std::string>& settings_ );
 
-		void commit();
+		// The dirty settings are queued and committed by the database writer thread, in a single transaction with
+		// all other queued writes. A setting that is committed again before that is only written once. If wait_ is
+		// true the call returns after the settings are committed, which is only needed if they're read back from the
+		// database right after, such as by the api.
+		void commit( bool wait_ = false );
 
 	protected:
 		const T& m_target;
 		// NOTE is marked mutable to allow the populate method to be called as late as possible.
-		mutable std::map<std::string, std::string> m_settings;
-		mutable bool m_populated;
+		mutable std::shared_ptr<const ParsedSettings> m_settings;
 		std::vector<std::string> m_dirty;
 		mutable std::mutex m_settingsMutex;
 
@@ -51,12 +104,11 @@ namespace micasa {
 	public:
 		SettingsHelper();
 
-		void commit();
+		void commit( bool wait_ = false );
 
 	protected:
 		// NOTE is marked mutable to allow the populate method to be called as late as possible.
-		mutable std::map<std::string, std::string> m_settings;
-		mutable bool m_populated;
+		mutable std::shared_ptr<const ParsedSettings> m_settings;
 		std::vector<std::string> m_dirty;
 		mutable std::mutex m_settingsMutex;
 
@@ -83,23 +135,17 @@ namespace micasa {
 		std::string get( const std::string& key_ ) const;
 		template<typename V> V get( const std::string& key_ ) const {
 			// Unfortunately, to be able to use all types, the implementation needs to be in the header.
-			std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-			this->_populateOnce();
-			V value;
-			std::istringstream( this->m_settings.at( key_ ) ) >> std::boolalpha >> std::fixed >> std::setprecision( 3 ) >> value;
-			return value;
+			return this->_getSettings()->at( key_ ).template get<V>();
 		};
 
 		std::string get( const std::string& key_, const std::string& default_ ) const;
 		template<typename V> V get( const std::string& key_, const V& default_ ) const {
 			// Unfortunately, to be able to use all types, the implementation needs to be in the header.
-			std::lock_guard<std::mutex> lock( this->m_settingsMutex );
-			this->_populateOnce();
-			try {
-				V value;
-				std::istringstream( this->m_settings.at( key_ ) ) >> std::boolalpha >> std::fixed >> std::setprecision( 3 ) >> value;
-				return value;
-			} catch( std::out_of_range exception_ ) {
+			auto settings = this->_getSettings();
+			auto find = settings->find( key_ );
+			if ( find != settings->end() ) {
+				return find->second.template get<V>();
+			} else {
 				return default_;
 			}
 		};
@@ -110,6 +156,12 @@ namespace micasa {
 		std::map<std::string, std::string> getAll() const;
 		std::map<std::string, std::string> getAll( const std::string& prefix_ ) const;
 
+	private:
+		// Readers use the current snapshot of the settings without locking, writers replace the snapshot while
+		// holding the settings mutex.
+		std::shared_ptr<const ParsedSettings> _getSettings() const;
+		void _putSettings( ParsedSettings&& settings_ );
+
 	}; // class Settings
 
 }; // namespace micasa
@@ -2,6 +2,7 @@
 
 #include <string>
 #include <vector>
+#include <utility>
 
 namespace micasa {
 
@@ -211,6 +212,177 @@ namespace micasa {
 		"CREATE INDEX IF NOT EXISTS `ix_links_enabled` ON `links`( `enabled` )",
 
 		"CREATE INDEX IF NOT EXISTS `ix_links_device_id` ON `links`( `device_id` )",
+
+		// Compact Device History and Trends
+		// NOTE the history and trends are stored with seconds since epoch and clustered on device and time. The
+		// existing tables are renamed and their rows are copied into the new tables in the background, see
+		// c_migrations below.
+		"ALTER TABLE `device_text_history` RENAME TO `device_text_history_legacy`",
+		"CREATE TABLE IF NOT EXISTS `device_text_history` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`value` TEXT NOT NULL, "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT )",
+
+		// NOTE no primary key for text devices > every value needs to be inserted, even within the same second.
+		"CREATE INDEX IF NOT EXISTS `ix_device_text_history_device_id_timestamp` ON `device_text_history`( `device_id`, `timestamp` )",
+
+		"ALTER TABLE `device_counter_history` RENAME TO `device_counter_history_legacy`",
+		"CREATE TABLE IF NOT EXISTS `device_counter_history` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`value` FLOAT NOT NULL, "
+		"`samples` INTEGER DEFAULT 1 NOT NULL, "
+		"PRIMARY KEY ( `device_id`, `timestamp` ), "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT ) WITHOUT ROWID",
+
+		"ALTER TABLE `device_level_history` RENAME TO `device_level_history_legacy`",
+		"CREATE TABLE IF NOT EXISTS `device_level_history` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`value` FLOAT NOT NULL, "
+		"`samples` INTEGER DEFAULT 1 NOT NULL, "
+		"PRIMARY KEY ( `device_id`, `timestamp` ), "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT ) WITHOUT ROWID",
+
+		"ALTER TABLE `device_switch_history` RENAME TO `device_switch_history_legacy`",
+		"CREATE TABLE IF NOT EXISTS `device_switch_history` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`value` VARCHAR(32) NOT NULL, "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT )",
+
+		// NOTE no primary key for switch devices > every value needs to be inserted, even within the same second.
+		"CREATE INDEX IF NOT EXISTS `ix_device_switch_history_device_id_timestamp` ON `device_switch_history`( `device_id`, `timestamp` )",
+
+		"ALTER TABLE `device_counter_trends` RENAME TO `device_counter_trends_legacy`",
+		"CREATE TABLE IF NOT EXISTS `device_counter_trends` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`last` BIGINT NOT NULL, "
+		"`diff` BIGINT NOT NULL, "
+		"PRIMARY KEY ( `device_id`, `timestamp` ), "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT ) WITHOUT ROWID",
+
+		"ALTER TABLE `device_level_trends` RENAME TO `device_level_trends_legacy`",
+		"CREATE TABLE IF NOT EXISTS `device_level_trends` ( "
+		"`device_id` INTEGER NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`min` FLOAT NOT NULL, "
+		"`max` FLOAT NOT NULL, "
+		"`average` FLOAT NOT NULL, "
+		"PRIMARY KEY ( `device_id`, `timestamp` ), "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT ) WITHOUT ROWID",
+
+		// The current state of each device, so that it can be restored at startup without searching the history. The
+		// value is stored as FLOAT for level and counter devices and as TEXT for switch and text devices.
+		"CREATE TABLE IF NOT EXISTS `device_state` ( "
+		"`device_id` INTEGER PRIMARY KEY, "
+		"`value` NOT NULL, "
+		"`timestamp` INTEGER NOT NULL, "
+		"`source` INTEGER NOT NULL, "
+		"FOREIGN KEY ( `device_id` ) REFERENCES `devices` ( `id` ) ON DELETE CASCADE ON UPDATE RESTRICT )",
+	};
+
+	// The state is seeded with the last entry in the history of each device. The history tables are renamed to
+	// `<table>_legacy` when device_state is created and only migrated in the background, so Database::_init seeds the
+	// devices that don't have a state yet from the legacy tables, for as long as they exist.
+	const std::vector<std::pair<std::string, std::string>> c_legacyStates = {
+		{ "device_counter_history",
+			"INSERT OR IGNORE INTO `device_state` ( `device_id`, `value`, `timestamp`, `source` ) "
+			"SELECT * FROM ( "
+				"SELECT `id`, "
+				"( SELECT `value` FROM `device_counter_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ) AS `value`, "
+				"( SELECT CAST( strftime( '%%s', `date` ) AS INTEGER ) FROM `device_counter_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ), "
+				"0 "
+				"FROM `devices` "
+				"WHERE `type` = 'counter' "
+			") "
+			"WHERE `value` IS NOT NULL"
+		},
+		{ "device_level_history",
+			"INSERT OR IGNORE INTO `device_state` ( `device_id`, `value`, `timestamp`, `source` ) "
+			"SELECT * FROM ( "
+				"SELECT `id`, "
+				"( SELECT `value` FROM `device_level_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ) AS `value`, "
+				"( SELECT CAST( strftime( '%%s', `date` ) AS INTEGER ) FROM `device_level_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ), "
+				"0 "
+				"FROM `devices` "
+				"WHERE `type` = 'level' "
+			") "
+			"WHERE `value` IS NOT NULL"
+		},
+		{ "device_switch_history",
+			"INSERT OR IGNORE INTO `device_state` ( `device_id`, `value`, `timestamp`, `source` ) "
+			"SELECT * FROM ( "
+				"SELECT `id`, "
+				"( SELECT `value` FROM `device_switch_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ) AS `value`, "
+				"( SELECT CAST( strftime( '%%s', `date` ) AS INTEGER ) FROM `device_switch_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ), "
+				"0 "
+				"FROM `devices` "
+				"WHERE `type` = 'switch' "
+			") "
+			"WHERE `value` IS NOT NULL"
+		},
+		{ "device_text_history",
+			"INSERT OR IGNORE INTO `device_state` ( `device_id`, `value`, `timestamp`, `source` ) "
+			"SELECT * FROM ( "
+				"SELECT `id`, "
+				"( SELECT `value` FROM `device_text_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ) AS `value`, "
+				"( SELECT CAST( strftime( '%%s', `date` ) AS INTEGER ) FROM `device_text_history_legacy` WHERE `device_id` = `devices`.`id` ORDER BY `date` DESC LIMIT 1 ), "
+				"0 "
+				"FROM `devices` "
+				"WHERE `type` = 'text' "
+			") "
+			"WHERE `value` IS NOT NULL"
+		}
+	};
+
+	// Tables that have been replaced by one of the queries above are renamed to `<table>_legacy`. Their rows are
+	// copied into the new table by Database::migrate, a chunk at a time, after which the legacy table is dropped. The
+	// query is completed with the condition that selects the chunk.
+	const std::vector<std::pair<std::string, std::string>> c_migrations = {
+		{ "device_text_history",
+			"INSERT INTO `device_text_history` ( `device_id`, `timestamp`, `value` ) "
+			"SELECT `device_id`, CAST( strftime( '%%s', `date` ) AS INTEGER ), `value` "
+			"FROM `device_text_history_legacy` "
+			"WHERE %s"
+		},
+		{ "device_counter_history",
+			"INSERT INTO `device_counter_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+			"SELECT `device_id`, CAST( strftime( '%%s', `date` ) AS INTEGER ), `value`, `samples` "
+			"FROM `device_counter_history_legacy` "
+			"WHERE %s "
+			"ON CONFLICT( `device_id`, `timestamp` ) DO UPDATE "
+			"SET `value` = ( ( `value` * `samples` ) + ( excluded.`value` * excluded.`samples` ) ) / ( `samples` + excluded.`samples` ), `samples` = `samples` + excluded.`samples`"
+		},
+		{ "device_level_history",
+			"INSERT INTO `device_level_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+			"SELECT `device_id`, CAST( strftime( '%%s', `date` ) AS INTEGER ), `value`, `samples` "
+			"FROM `device_level_history_legacy` "
+			"WHERE %s "
+			"ON CONFLICT( `device_id`, `timestamp` ) DO UPDATE "
+			"SET `value` = ( ( `value` * `samples` ) + ( excluded.`value` * excluded.`samples` ) ) / ( `samples` + excluded.`samples` ), `samples` = `samples` + excluded.`samples`"
+		},
+		{ "device_switch_history",
+			"INSERT INTO `device_switch_history` ( `device_id`, `timestamp`, `value` ) "
+			"SELECT `device_id`, CAST( strftime( '%%s', `date` ) AS INTEGER ), `value` "
+			"FROM `device_switch_history_legacy` "
+			"WHERE %s"
+		},
+		// NOTE trends that were already written to the new table are more recent than the legacy ones.
+		{ "device_counter_trends",
+			"INSERT OR IGNORE INTO `device_counter_trends` ( `device_id`, `timestamp`, `last`, `diff` ) "
+			"SELECT `device_id`, CAST( strftime( '%%s', `date` ) AS INTEGER ), `last`, `diff` "
+			"FROM `device_counter_trends_legacy` "
+			"WHERE %s"
+		},
+		{ "device_level_trends",
+			"INSERT OR IGNORE INTO `device_level_trends` ( `device_id`, `timestamp`, `min`, `max`, `average` ) "
+			"SELECT `device_id`, CAST( strftime( '%%s', `date` ) AS INTEGER ), `min`, `max`, `average` "
+			"FROM `device_level_trends_legacy` "
+			"WHERE %s"
+		},
 	};
 
 }; // namespace micasa
@@ -6,6 +6,7 @@
 #include <iterator>
 #include <random>
 #include <cstdarg>
+#include <cmath>
 
 #ifdef _DEBUG
 	#include <cassert>
@@ -104,6 +105,11 @@ namespace micasa {
 		return uni( rng );
 	};
 
+	bool compareDouble( double a_, double b_, double precision_ ) {
+		// The precision is relative to the largest of both values, with a minimum of 1.
+		return std::abs( a_ - b_ ) <= precision_ * std::max( 1.0, std::max( std::abs( a_ ), std::abs( b_ ) ) );
+	};
+
 	// http://stackoverflow.com/questions/2530096/how-to-find-all-serial-devices-ttys-ttyusb-on-linux-without-opening-them
 	// http://www.signal11.us/oss/udev/
 	const std::map<std::string, std::string> getSerialPorts() {
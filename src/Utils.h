@@ -18,6 +18,7 @@ namespace micasa {
 	std::string stringFormat( const std::string format_, ... );
 	std::string randomString( size_t length_, std::string charset_ = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz" );
 	int randomNumber( int min_, int max_ );
+	bool compareDouble( double a_, double b_, double precision_ = 1e-9 );
 
 	const std::map<std::string, std::string> getSerialPorts();
 
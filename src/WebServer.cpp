@@ -14,6 +14,7 @@
 #include <cstdlib>
 #include <regex>
 #include <sstream>
+#include <algorithm>
 
 #ifdef _WITH_OPENSSL
 	#include <openssl/x509.h>
@@ -75,7 +76,8 @@ namespace micasa {
 	WebServer::WebServer( unsigned int port_, unsigned int sslport_ ) :
 		m_port( port_ ),
 		m_sslport( sslport_ ),
-		m_resources( std::vector<t_resource>( 9 ) )
+		m_scheduler( "WebServer", Scheduler::Priority::INTERACTIVE ),
+		m_resources( std::vector<t_resource>( 11 ) )
 	{
 #ifdef _DEBUG
 		assert( g_database && "Global Database instance should be created before global WebServer instance." );
@@ -169,6 +171,8 @@ namespace micasa {
 		this->_installScriptResourceHandler();
 		this->_installTimerResourceHandler();
 		this->_installUserResourceHandler();
+		this->_installSchedulerResourceHandler();
+		this->_installDatabaseResourceHandler();
 
 		auto handler = [this]( std::shared_ptr<Network::Connection> connection_, Network::Connection::Event event_ ) -> void {
 			if ( event_ == Network::Connection::Event::HTTP ) {
@@ -215,7 +219,7 @@ namespace micasa {
 			Logger::log( Logger::LogLevel::NORMAL, this, "Default administrator user created." );
 		}
 
-		this->m_scheduler.schedule( SCHEDULER_INTERVAL_5MIN, SCHEDULER_INTERVAL_5MIN, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
+		this->m_scheduler.schedule( Scheduler::Priority::BACKGROUND, SCHEDULER_INTERVAL_5MIN, SCHEDULER_INTERVAL_5MIN, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
 			std::lock_guard<std::mutex> lock( this->m_loginsMutex );
 			auto now = system_clock::now();
 			for ( auto loginIt = this->m_logins.begin(); loginIt != this->m_logins.end(); ) {
@@ -529,7 +533,8 @@ namespace micasa {
 								},
 								{
 									{ "value", "system" },
-									{ "label", System::label }
+									{ "label", System::label },
+									{ "settings", System::getEmptySettingsJson() }
 								},
 								{
 									{ "value", "telegram" },
@@ -675,7 +680,7 @@ namespace micasa {
 							pluginData.erase( "type" );
 							pluginData.erase( "enabled" );
 							plugin->getSettings()->put( pluginData );
-							plugin->getSettings()->commit();
+							plugin->getSettings()->commit( true );
 							if ( enabled ) {
 								this->m_scheduler.schedule( SCHEDULER_INTERVAL_1SEC, 1, this, [plugin]( std::shared_ptr<Scheduler::Task<>> ) {
 									plugin->start();
@@ -707,7 +712,7 @@ namespace micasa {
 							plugin->getSettings()->put( pluginData );
 							bool restart = false;
 							if ( plugin->getSettings()->isDirty() ) {
-								plugin->getSettings()->commit();
+								plugin->getSettings()->commit( true );
 								// Only parent plugins are restarted. Child plugins needs to be restarted after an
 								// update it should listen for putSettingsJon.
 								if ( plugin->getParent() == nullptr ) {
@@ -952,7 +957,7 @@ namespace micasa {
 							device->putSettingsJson( deviceData );
 							device->getSettings()->put( deviceData );
 							if ( device->getSettings()->isDirty() ) {
-								device->getSettings()->commit();
+								device->getSettings()->commit( true );
 							}
 
 							output_["code"] = 200;
@@ -2095,7 +2100,7 @@ namespace micasa {
 							&& input_["$1"].is_string()
 						) {
 							user_->getSettings()->put( WEBSERVER_USER_WEBCLIENT_SETTING_PREFIX + input_["$1"].get<std::string>(), (*find).dump() );
-							user_->getSettings()->commit();
+							user_->getSettings()->commit( true );
 							output_["code"] = 200;
 						}
 						break;
@@ -2107,7 +2112,7 @@ namespace micasa {
 							&& user_->getSettings()->contains( WEBSERVER_USER_WEBCLIENT_SETTING_PREFIX + input_["$1"].get<std::string>() )
 						) {
 							user_->getSettings()->remove( WEBSERVER_USER_WEBCLIENT_SETTING_PREFIX + input_["$1"].get<std::string>() );
-							user_->getSettings()->commit();
+							user_->getSettings()->commit( true );
 							output_["code"] = 200;
 						}
 						break;
@@ -2118,6 +2123,106 @@ namespace micasa {
 		};
 	};
 
+	void WebServer::_installSchedulerResourceHandler() {
+		this->m_resources[9] = {
+			"^/api/scheduler$",
+			WebServer::Method::GET,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+				if (
+					user_ == nullptr
+					|| user_->getRights() < User::Rights::INSTALLER
+				) {
+					throw WebServer::ResourceException( 403, "Access.Denied", "Access to the requested resource was denied." );
+				}
+
+				// The statistics of all schedulers are returned with the owners that spent the most time running tasks
+				// first. The histograms contain the number of tasks per bucket, the buckets property contains the upper
+				// bound of each bucket in microseconds.
+				auto statistics = Scheduler::getAllStatistics();
+				std::sort( statistics.begin(), statistics.end(), []( const Scheduler::Statistics& a_, const Scheduler::Statistics& b_ ) {
+					return a_.runtime > b_.runtime;
+				} );
+
+				json buckets = json::array();
+				for ( unsigned int i = 0; i < SCHEDULER_STATISTICS_BUCKETS - 1; i++ ) {
+					buckets += Scheduler::StatisticsBuckets[i];
+				}
+
+				json schedulers = json::array();
+				for ( auto const &scheduler : statistics ) {
+					json delays = json::array();
+					json runtimes = json::array();
+					for ( unsigned int i = 0; i < SCHEDULER_STATISTICS_BUCKETS; i++ ) {
+						delays += scheduler.delayBuckets[i];
+						runtimes += scheduler.runtimeBuckets[i];
+					}
+					schedulers += {
+						{ "label", scheduler.label },
+						{ "pending", scheduler.pending },
+						{ "active", scheduler.active },
+						{ "executed", scheduler.executed },
+						{ "delay", {
+							{ "total", scheduler.delay },
+							{ "average", scheduler.executed > 0 ? scheduler.delay / scheduler.executed : 0 },
+							{ "histogram", delays }
+						} },
+						{ "runtime", {
+							{ "total", scheduler.runtime },
+							{ "average", scheduler.executed > 0 ? scheduler.runtime / scheduler.executed : 0 },
+							{ "histogram", runtimes }
+						} }
+					};
+				}
+
+				output_["data"] = {
+					{ "buckets", buckets },
+					{ "schedulers", schedulers }
+				};
+				output_["code"] = 200;
+			}
+		};
+	};
+
+	void WebServer::_installDatabaseResourceHandler() {
+		this->m_resources[10] = {
+			"^/api/database/stats$",
+			WebServer::Method::GET,
+			[&]( std::shared_ptr<User> user_, const json& input_, const WebServer::Method& method_, json& output_ ) {
+				if (
+					user_ == nullptr
+					|| user_->getRights() < User::Rights::INSTALLER
+				) {
+					throw WebServer::ResourceException( 403, "Access.Denied", "Access to the requested resource was denied." );
+				}
+
+				// The statistics are aggregated per query template, or per statement for prepared statements, with
+				// the queries that spent the most time executing first. All times are in microseconds.
+				auto statistics = g_database->getStatistics();
+				std::sort( statistics.begin(), statistics.end(), []( const Database::Statistics& a_, const Database::Statistics& b_ ) {
+					return a_.runtime > b_.runtime;
+				} );
+
+				json queries = json::array();
+				for ( auto const &query : statistics ) {
+					queries += {
+						{ "query", query.query },
+						{ "executed", query.executed },
+						{ "rows", query.rows },
+						{ "wait", query.wait },
+						{ "runtime", {
+							{ "total", query.runtime },
+							{ "average", query.executed > 0 ? query.runtime / query.executed : 0 },
+							{ "maximum", query.maximum }
+						} }
+					};
+				}
+
+				output_["data"] = queries;
+				output_["code"] = 200;
+			}
+		};
+	};
+
 	bool WebServer::_validateSettings( const json& input_, json& output_, const json& settings_, std::vector<std::string>* invalid_, std::vector<std::string>* missing_, std::vector<std::string>* errors_ ) {
 		bool result = true;
 
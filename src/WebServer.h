@@ -101,6 +101,8 @@ namespace micasa {
 		void _installScriptResourceHandler();
 		void _installTimerResourceHandler();
 		void _installUserResourceHandler();
+		void _installSchedulerResourceHandler();
+		void _installDatabaseResourceHandler();
 
 		static bool _validateSettings( const nlohmann::json&, nlohmann::json&, const nlohmann::json&, std::vector<std::string>*, std::vector<std::string>*, std::vector<std::string>* );
 
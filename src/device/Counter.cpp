@@ -10,6 +10,7 @@
 #include "../User.h"
 #include "../Utils.h"
 
+#define DEVICE_COUNTER_HISTORY_FLUSH_INTERVAL SCHEDULER_INTERVAL_1MIN // msec, bounds the samples lost on a crash
 #define DEVICE_COUNTER_DEFAULT_HISTORY_RETENTION 7 // days
 #define DEVICE_COUNTER_DEFAULT_TRENDS_RETENTION 60 // months
 
@@ -23,6 +24,9 @@ namespace micasa {
 
 	const Device::Type Counter::type = Device::Type::COUNTER;
 
+	Maintenance Counter::g_historyMaintenance( "Counter History", DEVICE_COUNTER_HISTORY_FLUSH_INTERVAL, Counter::_flushHistory );
+	Maintenance Counter::g_purgeMaintenance( "Counter Purge", SCHEDULER_INTERVAL_1HOUR, Counter::_purgeHistoryAndTrends );
+
 	const std::map<Counter::SubType, std::string> Counter::SubTypeText = {
 		{ Counter::SubType::GENERIC, "generic" },
 		{ Counter::SubType::ENERGY, "energy" },
@@ -48,24 +52,39 @@ namespace micasa {
 		{ Counter::SubType::WATER, { Counter::Unit::M3 } },
 	};
 
-	Counter::Counter( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
-		Device( plugin_, id_, reference_, label_, enabled_ ),
+	Counter::Counter( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Device::Hydration* hydration_ ) :
+		Device( plugin_, id_, reference_, label_, enabled_, hydration_ ),
 		m_value( 0 ),
+		m_source( Device::resolveUpdateSource( 0 ) ),
 		m_updated( system_clock::now() ),
 		m_rateLimiter( { 0, Device::resolveUpdateSource( 0 ) } )
 	{
-		try {
-			json result = g_database->getQueryRow<json>(
-				"SELECT `value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `age` "
-				"FROM `device_counter_history` "
-				"WHERE `device_id` = %d "
-				"ORDER BY `date` DESC "
-				"LIMIT 1",
-				this->m_id
-			);
-			this->m_value = this->m_rateLimiter.value = jsonGet<double>( result, "value" );
-			this->m_updated = system_clock::now() - seconds( jsonGet<unsigned int>( result, "age" ) );
-		} catch( const Database::NoResultsException& ex_ ) {
+		this->m_bucket.start = 0;
+		this->m_bucket.sum = 0;
+		this->m_bucket.samples = 0;
+		this->m_bucket.pendingSum = 0;
+		this->m_bucket.pendingSamples = 0;
+		this->m_bucket.trend.count = 0;
+		this->m_bucket.trend.previousStart = 0;
+
+		json last;
+		if ( hydration_ != nullptr ) {
+			last = hydration_->last;
+		} else {
+			try {
+				last = g_database->getQueryRow<json>(
+					"SELECT `value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - `timestamp` AS `age`, `source` "
+					"FROM `device_state` "
+					"WHERE `device_id` = %d",
+					this->m_id
+				);
+			} catch( const Database::NoResultsException& ex_ ) { /* no state */ }
+		}
+		if ( ! last.is_null() ) {
+			this->m_value = this->m_rateLimiter.value = jsonGet<double>( last, "value" );
+			this->m_updated = system_clock::now() - seconds( jsonGet<unsigned int>( last, "age" ) );
+			this->m_source = Device::resolveUpdateSource( jsonGet<unsigned int>( last, "source" ) );
+		} else {
 			Logger::log( Logger::LogLevel::DEBUG, this, "No starting value." );
 		}
 	};
@@ -74,21 +93,24 @@ namespace micasa {
 #ifdef _DEBUG
 		assert( this->m_enabled && "Device needs to be enabled while being started." );
 #endif // _DEBUG
-		this->m_scheduler.schedule( randomNumber( 0, SCHEDULER_INTERVAL_5MIN ), SCHEDULER_INTERVAL_5MIN, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
-			this->_processTrends();
-		} );
-		this->m_scheduler.schedule( randomNumber( 0, SCHEDULER_INTERVAL_1HOUR ), SCHEDULER_INTERVAL_1HOUR, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
-			this->_purgeHistoryAndTrends();
-		} );
+		this->_loadBucket();
+		Counter::g_historyMaintenance.add( this );
+		Counter::g_purgeMaintenance.add( this );
 	};
 
 	void Counter::stop() {
 #ifdef _DEBUG
 		assert( this->m_enabled && "Device needs to be enabled while being stopped." );
 #endif // _DEBUG
+		Counter::g_historyMaintenance.remove( this );
+		Counter::g_purgeMaintenance.remove( this );
 		this->m_scheduler.erase( [this]( const Scheduler::BaseTask& task_ ) {
 			return task_.data == this;
 		} );
+
+		// The pending samples and the trend of the current hour are committed before returning, the device might be
+		// removed from the database next.
+		this->_flushBucket( true );
 	};
 
 	void Counter::updateValue( Device::UpdateSource source_, t_value value_ ) {
@@ -331,13 +353,14 @@ namespace micasa {
 			groupFormat = "%Y";
 			start = "'start of year'";
 		}
-		return g_database->getQuery<json>(
-			"SELECT CAST( printf( %Q, sum( `diff` ) / %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', strftime( %Q, MAX( `date` ) ) ) AS INTEGER ) AS `timestamp`, strftime( %Q, MAX( `date` ) ) AS `date` "
+		json result = json::array();
+		Database::Cursor cursor = g_database->getCursor(
+			"SELECT CAST( printf( %Q, sum( `diff` ) / %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', strftime( %Q, MAX( `timestamp` ), 'unixepoch' ) ) AS INTEGER ) AS `timestamp`, strftime( %Q, MAX( `timestamp` ), 'unixepoch' ) AS `date` "
 			"FROM `device_counter_trends` "
 			"WHERE `device_id` = %d "
-			"AND `date` >= datetime( 'now', '-%d %s', %s ) "
-			"GROUP BY strftime( %Q, `date` ) "
-			"ORDER BY `date` ASC ",
+			"AND `timestamp` >= CAST( strftime( '%%s', 'now', '-%d %s', %s ) AS INTEGER ) "
+			"GROUP BY strftime( %Q, `timestamp`, 'unixepoch' ) "
+			"ORDER BY `timestamp` ASC ",
 			format.c_str(),
 			divider,
 			dateFormat.c_str(),
@@ -348,6 +371,14 @@ namespace micasa {
 			start.c_str(),
 			groupFormat.c_str()
 		);
+		while ( cursor.next() ) {
+			result.push_back( {
+				{ "value", cursor.get<double>( 0 ) },
+				{ "timestamp", cursor.get<long>( 1 ) },
+				{ "date", cursor.get<const char*>( 2 ) }
+			} );
+		}
+		return result;
 	};
 
 	void Counter::_processValue( const Device::UpdateSource& source_, const t_value& value_ ) {
@@ -369,38 +400,23 @@ namespace micasa {
 		}
 		if ( success && apply ) {
 			if ( this->m_enabled ) {
-				std::string date = "strftime( '%Y-%m-%d %H:', datetime( 'now' ) ) || CASE WHEN CAST( strftime( '%M',  datetime( 'now' ) ) AS INTEGER ) < 10 THEN '0' ELSE '' END || CAST( CAST( strftime( '%M', datetime( 'now' ) ) AS INTEGER ) / 5 * 5 AS TEXT ) || ':00'";
-
-				g_database->putQuery(
-					"REPLACE INTO `device_counter_history` ( `device_id`, `date`, `value`, `samples` ) "
-					"VALUES ( "
-						"%d, "
-						"%s, "
-						"COALESCE( ( "
-							"SELECT printf( '%%.6f', ( ( `value` * `samples` ) + %.6f ) / ( `samples` + 1 ) ) "
-							"FROM `device_counter_history` "
-							"WHERE `device_id` = %d "
-							"AND `date` = %s "
-						"), %.6f ), "
-						"COALESCE( ( "
-							"SELECT `samples` + 1 "
-							"FROM `device_counter_history` "
-							"WHERE `device_id` = %d "
-							"AND `date` = %s "
-						"), 1 ) "
-					")",
-					this->m_id,
-					date.c_str(),
-					this->m_value,
-					this->m_id,
-					date.c_str(),
-					this->m_value,
-					this->m_id,
-					date.c_str()
-				);
+				// Samples are accumulated in the current 5 minute bucket, which is added to the trend of the current
+				// hour when the next bucket is started. The pending samples of the bucket are written to the history
+				// when the bucket is flushed by the history maintenance pipeline.
+				time_t now = system_clock::to_time_t( system_clock::now() );
+				std::lock_guard<std::mutex> lock( this->m_bucket.mutex );
+				this->_rollBucket( now );
+				if ( this->m_bucket.samples == 0 ) {
+					this->m_bucket.start = now - ( now % 300 );
+				}
+				this->m_bucket.sum += this->m_value;
+				this->m_bucket.samples++;
+				this->m_bucket.pendingSum += this->m_value;
+				this->m_bucket.pendingSamples++;
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_storeState( this->m_value, source_ );
 			if (
 				this->m_enabled
 				&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -413,62 +429,258 @@ namespace micasa {
 		}
 	};
 
-	void Counter::_processTrends() const {
-		std::string hourFormat = "%Y-%m-%d %H:30:00";
-		std::string groupFormat = "%Y-%m-%d-%H";
-
-		auto trends = g_database->getQuery(
-			"SELECT MAX( rowid ) AS `last_rowid`, strftime( %Q, MAX( `date` ) ) AS `date`, MAX( `value` ) AS `max` "
+	void Counter::_loadBucket() {
+		// The bucket and the trend of the current hour are restored from the history, so that they are complete
+		// after a restart. The maximum of the last hour before the current hour is needed to calculate the diff.
+		time_t now = system_clock::to_time_t( system_clock::now() );
+		time_t hour = now - ( now % 3600 );
+		std::lock_guard<std::mutex> lock( this->m_bucket.mutex );
+		this->m_bucket.start = now - ( now % 300 );
+		this->m_bucket.sum = 0;
+		this->m_bucket.samples = 0;
+		this->m_bucket.pendingSum = 0;
+		this->m_bucket.pendingSamples = 0;
+		this->m_bucket.trend.count = 0;
+		this->m_bucket.trend.previousStart = 0;
+		{
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT MAX( `timestamp` ) - ( MAX( `timestamp` ) %% 3600 ), MAX( `value` ) "
+				"FROM `device_counter_history` "
+				"WHERE `device_id` = %d "
+				"AND `timestamp` >= ( "
+					"SELECT MAX( `timestamp` ) - ( MAX( `timestamp` ) %% 3600 ) "
+					"FROM `device_counter_history` "
+					"WHERE `device_id` = %d "
+					"AND `timestamp` < %ld "
+				") "
+				"AND `timestamp` < %ld",
+				this->m_id,
+				this->m_id,
+				static_cast<long>( hour ),
+				static_cast<long>( hour )
+			);
+			if (
+				cursor.next()
+				&& ! cursor.isNull( 1 )
+			) {
+				this->m_bucket.trend.previousStart = cursor.get<long>( 0 );
+				this->m_bucket.trend.previousMax = cursor.get<double>( 1 );
+			}
+		}
+		Database::Cursor cursor = g_database->getCursor(
+			"SELECT `timestamp`, `value`, `samples` "
 			"FROM `device_counter_history` "
-			"WHERE `device_id`=%d AND `Date` > datetime( 'now', '-5 hour' ) "
-			"GROUP BY strftime( %Q, `date` )",
-			hourFormat.c_str(),
+			"WHERE `device_id` = %d "
+			"AND `timestamp` >= %ld "
+			"ORDER BY `timestamp` ASC",
 			this->m_id,
-			groupFormat.c_str()
+			static_cast<long>( hour )
 		);
+		while ( cursor.next() ) {
+			if ( cursor.get<long>( 0 ) >= this->m_bucket.start ) {
+				this->m_bucket.samples = cursor.get<unsigned long>( 2 );
+				this->m_bucket.sum = cursor.get<double>( 1 ) * this->m_bucket.samples;
+			} else {
+				Counter::_addToTrend( this->m_bucket.trend, hour, cursor.get<double>( 1 ) );
+			}
+		}
+	};
 
-		// In order to properly calculate the diff between the beginning and ending of an hour, the maximum of the
-		// previous hour is needed, otherwise the first 5 minutes are lost. So the first record is skipped while it's
-		// maximum value is kept to calculate the diff for the next hour.
-		double max;
-		for ( auto trendsIt = trends.begin(); trendsIt != trends.end(); trendsIt++ ) {
-			if ( trendsIt != trends.begin() ) {
-				try {
-					auto value = g_database->getQueryValue<double>(
-						"SELECT `value` "
-						"FROM `device_counter_history` "
-						"WHERE rowid = %q",
-						(*trendsIt)["last_rowid"].c_str()
-					);
-					g_database->putQuery(
-						"REPLACE INTO `device_counter_trends` ( `device_id`, `last`, `diff`, `date` ) "
-						"VALUES ( %d, %.6f, %.6f, %Q )",
-						this->m_id,
-						value,
-						std::stod( (*trendsIt)["max"] ) - max,
-						(*trendsIt)["date"].c_str()
-					);
-				} catch( const Database::NoResultsException& ex_ ) { /* ignore */ }
+	void Counter::_rollBucket( time_t now_ ) const {
+		// NOTE the bucket mutex should be held by the caller.
+		if (
+			this->m_bucket.samples > 0
+			&& this->m_bucket.start + 300 <= now_
+		) {
+			this->_writeBucket( false );
+			time_t hour = this->m_bucket.start - ( this->m_bucket.start % 3600 );
+			if (
+				this->m_bucket.trend.count > 0
+				&& this->m_bucket.trend.start != hour
+			) {
+				this->_writeTrend( this->m_bucket.trend, false );
 			}
-			max = std::stod( (*trendsIt)["max"] );
+			Counter::_addToTrend( this->m_bucket.trend, hour, this->m_bucket.sum / this->m_bucket.samples );
+			this->m_bucket.sum = 0;
+			this->m_bucket.samples = 0;
+		}
+		if (
+			this->m_bucket.trend.count > 0
+			&& this->m_bucket.trend.start + 3600 <= now_
+		) {
+			this->_writeTrend( this->m_bucket.trend, false );
+			this->m_bucket.trend.previousStart = this->m_bucket.trend.start;
+			this->m_bucket.trend.previousMax = this->m_bucket.trend.max;
+			this->m_bucket.trend.count = 0;
 		}
 	};
 
-	void Counter::_purgeHistoryAndTrends() const {
-		g_database->putQuery(
-			"DELETE FROM `device_counter_history` "
-			"WHERE `device_id` = %d "
-			"AND `date` < datetime( 'now','-%d day' )",
+	void Counter::_flushBucket( bool final_ ) const {
+		std::lock_guard<std::mutex> lock( this->m_bucket.mutex );
+		this->_rollBucket( system_clock::to_time_t( system_clock::now() ) );
+		this->_writeBucket( final_ );
+		if ( final_ ) {
+			// The trend of the current hour is written including the current bucket. It's restored from the history
+			// if the device is started again.
+			t_trend trend = this->m_bucket.trend;
+			if ( this->m_bucket.samples > 0 ) {
+				Counter::_addToTrend( trend, this->m_bucket.start - ( this->m_bucket.start % 3600 ), this->m_bucket.sum / this->m_bucket.samples );
+			}
+			if ( trend.count > 0 ) {
+				this->_writeTrend( trend, true );
+			}
+		}
+	};
+
+	void Counter::_writeBucket( bool wait_ ) const {
+		// NOTE the bucket mutex should be held by the caller.
+		if ( this->m_bucket.pendingSamples == 0 ) {
+			return;
+		}
+
+		// The bucket might have been flushed before, in which case the samples are merged with the existing row.
+		g_database->queueQuery(
+			wait_ ? Database::Durability::COMMITTED : Database::Durability::QUEUED,
+			"device_counter_history",
+			"INSERT INTO `device_counter_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+			"VALUES ( ?1, ?2, ?3 / ?4, ?4 ) "
+			"ON CONFLICT( `device_id`, `timestamp` ) DO UPDATE SET "
+				"`value` = ( ( `value` * `samples` ) + ?3 ) / ( `samples` + ?4 ), "
+				"`samples` = `samples` + ?4",
 			this->m_id,
-			this->m_settings->get<int>( "history_retention", DEVICE_COUNTER_DEFAULT_HISTORY_RETENTION )
+			static_cast<long>( this->m_bucket.start ),
+			this->m_bucket.pendingSum,
+			this->m_bucket.pendingSamples
 		);
-		g_database->putQuery(
-			"DELETE FROM `device_counter_trends` "
-			"WHERE `device_id` = %d "
-			"AND `date` < datetime( 'now','-%d month' )",
+		this->m_bucket.pendingSum = 0;
+		this->m_bucket.pendingSamples = 0;
+	};
+
+	void Counter::_writeTrend( const t_trend& trend_, bool wait_ ) const {
+		// The diff of an hour can only be calculated if there's a previous hour, so the first hour is skipped.
+		if ( trend_.previousStart == 0 ) {
+			return;
+		}
+		g_database->queueQuery(
+			wait_ ? Database::Durability::COMMITTED : Database::Durability::QUEUED,
+			"device_counter_trends",
+			"REPLACE INTO `device_counter_trends` ( `device_id`, `last`, `diff`, `timestamp` ) "
+			"VALUES ( ?, ?, ?, ? )",
 			this->m_id,
-			this->m_settings->get<int>( "trends_retention", DEVICE_COUNTER_DEFAULT_TRENDS_RETENTION )
+			trend_.last,
+			trend_.max - trend_.previousMax,
+			static_cast<long>( trend_.start + 1800 )
+		);
+	};
+
+	void Counter::_addToTrend( t_trend& trend_, time_t hour_, double value_ ) {
+		// The trend of an hour is made up of the averages of its 5 minute buckets. The diff is calculated against the
+		// maximum of the previous hour, otherwise the first 5 minutes of each hour would be lost.
+		if (
+			trend_.count > 0
+			&& trend_.start != hour_
+		) {
+			trend_.previousStart = trend_.start;
+			trend_.previousMax = trend_.max;
+			trend_.count = 0;
+		}
+		if ( trend_.count == 0 ) {
+			trend_.start = hour_;
+			trend_.max = value_;
+		} else {
+			trend_.max = std::max( trend_.max, value_ );
+		}
+		trend_.last = value_;
+		trend_.count++;
+	};
+
+	Maintenance::t_deferredFunc Counter::_flushHistory( const std::vector<const Device*>& devices_ ) {
+		for ( auto const& device : devices_ ) {
+			static_cast<const Counter*>( device )->_flushBucket( false );
+		}
+		return nullptr;
+	};
+
+	unsigned int Counter::checkTrends() {
+		// The expected trends are computed the way _processTrends did before the trends were maintained incrementally,
+		// but over the complete history instead of the last five hours. The last value of an hour is selected by
+		// timestamp, the history no longer has a rowid. As it did then, the first hour of each device is skipped and
+		// only provides the maximum for the diff of the next hour.
+		std::map<std::pair<unsigned int, long>, std::vector<double>> trends;
+		std::map<unsigned int, long> skipped;
+		{
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT `hours`.`device_id`, `hours`.`hour`, `history`.`value`, `hours`.`max` "
+				"FROM ( "
+					"SELECT `device_id`, ( `timestamp` / 3600 ) * 3600 + 1800 AS `hour`, MAX( `timestamp` ) AS `last_timestamp`, MAX( `value` ) AS `max` "
+					"FROM `device_counter_history` "
+					"GROUP BY `device_id`, `hour` "
+				") AS `hours` "
+				"JOIN `device_counter_history` AS `history` ON `history`.`device_id` = `hours`.`device_id` AND `history`.`timestamp` = `hours`.`last_timestamp` "
+				"ORDER BY `hours`.`device_id`, `hours`.`hour`"
+			);
+			double max = 0;
+			while ( cursor.next() ) {
+				if ( skipped.find( cursor.get<unsigned int>( 0 ) ) == skipped.end() ) {
+					skipped[cursor.get<unsigned int>( 0 )] = cursor.get<long>( 1 );
+				} else {
+					trends[{ cursor.get<unsigned int>( 0 ), cursor.get<long>( 1 ) }] = { cursor.get<double>( 2 ), cursor.get<double>( 3 ) - max };
+				}
+				max = cursor.get<double>( 3 );
+			}
+		}
+
+		// Every stored trend within the history of its device should match the expected trend, and every expected
+		// trend should have been stored. Older trends are kept longer than the history and can't be checked.
+		unsigned int checked = 0;
+		unsigned int differences = 0;
+		Database::Cursor cursor = g_database->getCursor(
+			"SELECT `device_id`, `timestamp`, `last`, `diff` "
+			"FROM `device_counter_trends` "
+			"ORDER BY `device_id`, `timestamp`"
 		);
+		while ( cursor.next() ) {
+			auto skip = skipped.find( cursor.get<unsigned int>( 0 ) );
+			if (
+				skip == skipped.end()
+				|| cursor.get<long>( 1 ) <= skip->second
+			) {
+				continue;
+			}
+			auto find = trends.find( { cursor.get<unsigned int>( 0 ), cursor.get<long>( 1 ) } );
+			if (
+				find == trends.end()
+				|| ! compareDouble( find->second[0], cursor.get<double>( 2 ) )
+				|| ! compareDouble( find->second[1], cursor.get<double>( 3 ) )
+			) {
+				Logger::logr( Logger::LogLevel::WARNING, "Counter", "Trend of device %d at %ld differs.", cursor.get<unsigned int>( 0 ), cursor.get<long>( 1 ) );
+				differences++;
+			}
+			if ( find != trends.end() ) {
+				trends.erase( find );
+			}
+			checked++;
+		}
+		for ( auto const& trend : trends ) {
+			Logger::logr( Logger::LogLevel::WARNING, "Counter", "Trend of device %d at %ld is missing.", trend.first.first, trend.first.second );
+			differences++;
+			checked++;
+		}
+		Logger::logr( Logger::LogLevel::NORMAL, "Counter", "Checked %u trends, %u differ.", checked, differences );
+		return differences;
+	};
+
+	Maintenance::t_deferredFunc Counter::_purgeHistoryAndTrends( const std::vector<const Device*>& devices_ ) {
+		std::string history = Maintenance::getRetentionCondition( devices_, "day", []( const Device* device_ ) {
+			return device_->getSettings()->get<int>( "history_retention", DEVICE_COUNTER_DEFAULT_HISTORY_RETENTION );
+		} );
+		std::string trends = Maintenance::getRetentionCondition( devices_, "month", []( const Device* device_ ) {
+			return device_->getSettings()->get<int>( "trends_retention", DEVICE_COUNTER_DEFAULT_TRENDS_RETENTION );
+		} );
+		return [history,trends]() {
+			Maintenance::purge( "device_counter_history", history );
+			Maintenance::purge( "device_counter_trends", trends );
+		};
 	};
 
 }; // namespace micasa
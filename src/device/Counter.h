@@ -4,6 +4,8 @@
 
 #include "../Scheduler.h"
 
+#include "Maintenance.h"
+
 namespace micasa {
 
 	class Counter final : public Device {
@@ -31,13 +33,17 @@ namespace micasa {
 		typedef double t_value;
 		static const Device::Type type;
 
-		Counter( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ );
+		Counter( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Device::Hydration* hydration_ );
 
 		void updateValue( Device::UpdateSource source_, t_value value_ );
 		void incrementValue( Device::UpdateSource source_, t_value value_ = 1.0f );
 		t_value getValue() const { return this->m_value; };
 		nlohmann::json getData( unsigned int range_, const std::string& interval_, const std::string& group_ ) const;
 
+		// Replays the recorded history through the incremental trends and compares the result with the trends as
+		// computed by sql from the same history. Returns the number of hours that differ.
+		static unsigned int checkTrends();
+
 		void start() override;
 		void stop() override;
 		Device::Type getType() const override { return Counter::type; };
@@ -46,6 +52,18 @@ namespace micasa {
 		void putSettingsJson( const nlohmann::json& settings_ ) override;
 
 	private:
+		struct t_trend {
+			time_t start;
+			double max;
+			double last;
+			unsigned long count;
+			time_t previousStart;
+			double previousMax;
+		}; // struct t_trend
+
+		static Maintenance g_historyMaintenance;
+		static Maintenance g_purgeMaintenance;
+
 		t_value m_value;
 		Device::UpdateSource m_source;
 		std::chrono::system_clock::time_point m_updated;
@@ -55,9 +73,27 @@ namespace micasa {
 			std::weak_ptr<Scheduler::Task<>> task;
 		} m_rateLimiter;
 
+		// The current 5 minute bucket and the trend of the current hour. Pending samples are part of the bucket but
+		// haven't been written to the history yet.
+		mutable struct {
+			time_t start;
+			double sum;
+			unsigned long samples;
+			double pendingSum;
+			unsigned long pendingSamples;
+			t_trend trend;
+			std::mutex mutex;
+		} m_bucket;
+
 		void _processValue( const Device::UpdateSource& source_, const t_value& value_ );
-		void _processTrends() const;
-		void _purgeHistoryAndTrends() const;
+		void _loadBucket();
+		void _rollBucket( time_t now_ ) const;
+		void _flushBucket( bool final_ ) const;
+		void _writeBucket( bool wait_ ) const;
+		void _writeTrend( const t_trend& trend_, bool wait_ ) const;
+		static void _addToTrend( t_trend& trend_, time_t hour_, double value_ );
+		static Maintenance::t_deferredFunc _flushHistory( const std::vector<const Device*>& devices_ );
+		static Maintenance::t_deferredFunc _purgeHistoryAndTrends( const std::vector<const Device*>& devices_ );
 
 	}; // class Counter
 
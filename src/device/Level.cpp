@@ -7,6 +7,7 @@
 #include "../User.h"
 #include "../Utils.h"
 
+#define DEVICE_LEVEL_HISTORY_FLUSH_INTERVAL SCHEDULER_INTERVAL_1MIN // msec, bounds the samples lost on a crash
 #define DEVICE_LEVEL_DEFAULT_HISTORY_RETENTION 7 // days
 #define DEVICE_LEVEL_DEFAULT_TRENDS_RETENTION 36 // months
 
@@ -20,6 +21,9 @@ namespace micasa {
 
 	const Device::Type Level::type = Device::Type::LEVEL;
 
+	Maintenance Level::g_historyMaintenance( "Level History", DEVICE_LEVEL_HISTORY_FLUSH_INTERVAL, Level::_flushHistory );
+	Maintenance Level::g_purgeMaintenance( "Level Purge", SCHEDULER_INTERVAL_1HOUR, Level::_purgeHistoryAndTrends );
+
 	const std::map<Level::SubType, std::string> Level::SubTypeText = {
 		{ Level::SubType::GENERIC, "generic" },
 		{ Level::SubType::TEMPERATURE, "temperature" },
@@ -45,6 +49,7 @@ namespace micasa {
 		{ Level::Unit::PASCAL, "Pa" },
 		{ Level::Unit::LUX, "lx" },
 		{ Level::Unit::SECONDS, " sec" },
+		{ Level::Unit::MILLISECONDS, " ms" },
 	};
 
 	const std::map<Level::Unit, std::string> Level::UnitFormat = {
@@ -58,6 +63,7 @@ namespace micasa {
 		{ Level::Unit::PASCAL, "%.0f" },
 		{ Level::Unit::LUX, "%.0f" },
 		{ Level::Unit::SECONDS, "%.0f" },
+		{ Level::Unit::MILLISECONDS, "%.1f" },
 	};
 
 	const std::map<Level::SubType, std::vector<Level::Unit>> Level::SubTypeUnits = {
@@ -73,24 +79,38 @@ namespace micasa {
 		{ Level::SubType::DIMMER, { Level::Unit::PERCENT } },
 	};
 
-	Level::Level( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
-		Device( plugin_, id_, reference_, label_, enabled_ ),
+	Level::Level( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Device::Hydration* hydration_ ) :
+		Device( plugin_, id_, reference_, label_, enabled_, hydration_ ),
 		m_value( 0 ),
+		m_source( Device::resolveUpdateSource( 0 ) ),
 		m_updated( system_clock::now() ),
 		m_rateLimiter( { 0, 0, Device::resolveUpdateSource( 0 ) } )
 	{
-		try {
-			json result = g_database->getQueryRow<json>(
-				"SELECT `value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `age` "
-				"FROM `device_level_history` "
-				"WHERE `device_id` = %d "
-				"ORDER BY `date` DESC "
-				"LIMIT 1",
-				this->m_id
-			);
-			this->m_value = this->m_rateLimiter.value = jsonGet<double>( result, "value" );
-			this->m_updated = system_clock::now() - seconds( jsonGet<unsigned int>( result, "age" ) );
-		} catch( const Database::NoResultsException& ex_ ) {
+		this->m_bucket.start = 0;
+		this->m_bucket.sum = 0;
+		this->m_bucket.samples = 0;
+		this->m_bucket.pendingSum = 0;
+		this->m_bucket.pendingSamples = 0;
+		this->m_bucket.trend.count = 0;
+
+		json last;
+		if ( hydration_ != nullptr ) {
+			last = hydration_->last;
+		} else {
+			try {
+				last = g_database->getQueryRow<json>(
+					"SELECT `value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - `timestamp` AS `age`, `source` "
+					"FROM `device_state` "
+					"WHERE `device_id` = %d",
+					this->m_id
+				);
+			} catch( const Database::NoResultsException& ex_ ) { /* no state */ }
+		}
+		if ( ! last.is_null() ) {
+			this->m_value = this->m_rateLimiter.value = jsonGet<double>( last, "value" );
+			this->m_updated = system_clock::now() - seconds( jsonGet<unsigned int>( last, "age" ) );
+			this->m_source = Device::resolveUpdateSource( jsonGet<unsigned int>( last, "source" ) );
+		} else {
 			Logger::log( Logger::LogLevel::DEBUG, this, "No starting value." );
 		}
 	};
@@ -99,21 +119,24 @@ namespace micasa {
 #ifdef _DEBUG
 		assert( this->m_enabled && "Device needs to be enabled while being started." );
 #endif // _DEBUG
-		this->m_scheduler.schedule( randomNumber( 0, SCHEDULER_INTERVAL_5MIN ), SCHEDULER_INTERVAL_5MIN, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
-			this->_processTrends();
-		} );
-		this->m_scheduler.schedule( randomNumber( 0, SCHEDULER_INTERVAL_1HOUR ), SCHEDULER_INTERVAL_1HOUR, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
-			this->_purgeHistoryAndTrends();
-		} );
+		this->_loadBucket();
+		Level::g_historyMaintenance.add( this );
+		Level::g_purgeMaintenance.add( this );
 	};
 
 	void Level::stop() {
 #ifdef _DEBUG
 		assert( this->m_enabled && "Device needs to be enabled while being stopped." );
 #endif // _DEBUG
+		Level::g_historyMaintenance.remove( this );
+		Level::g_purgeMaintenance.remove( this );
 		this->m_scheduler.erase( [this]( const Scheduler::BaseTask& task_ ) {
 			return task_.data == this;
 		} );
+
+		// The pending samples and the trend of the current hour are committed before returning, the device might be
+		// removed from the database next.
+		this->_flushBucket( true );
 	};
 
 	void Level::updateValue( Device::UpdateSource source_, t_value value_ ) {
@@ -397,14 +420,15 @@ namespace micasa {
 		double divider = this->m_settings->get<double>( "divider", 1 );
 		double offset = this->m_settings->get<double>( "offset", 0 );
 
+		json result = json::array();
 		if ( group_ == "5min" ) {
 			std::string dateFormat = "%Y-%m-%d %H:%M:00";
-			return g_database->getQuery<json>(
-				"SELECT CAST( printf( %Q, ( `value` / %.6f ) + %.6f ) AS REAL ) AS `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp`, strftime( %Q, `date` ) AS `date` "
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT CAST( printf( %Q, ( `value` / %.6f ) + %.6f ) AS REAL ) AS `value`, `timestamp`, strftime( %Q, `timestamp`, 'unixepoch' ) AS `date` "
 				"FROM `device_level_history` "
 				"WHERE `device_id` = %d "
-				"AND `date` >= datetime( 'now', '-%d %s' ) "
-				"ORDER BY `date` ASC ",
+				"AND `timestamp` >= CAST( strftime( '%%s', 'now', '-%d %s' ) AS INTEGER ) "
+				"ORDER BY `timestamp` ASC ",
 				format.c_str(),
 				divider,
 				offset,
@@ -413,6 +437,13 @@ namespace micasa {
 				range_,
 				interval.c_str()
 			);
+			while ( cursor.next() ) {
+				result.push_back( {
+					{ "value", cursor.get<double>( 0 ) },
+					{ "timestamp", cursor.get<long>( 1 ) },
+					{ "date", cursor.get<const char*>( 2 ) }
+				} );
+			}
 		} else {
 			std::string dateFormat = "%Y-%m-%d %H:30:00";
 			std::string groupFormat = "%Y-%m-%d-%H";
@@ -430,18 +461,18 @@ namespace micasa {
 				groupFormat = "%Y";
 				start = "'start of year'";
 			}
-			return g_database->getQuery<json>(
+			Database::Cursor cursor = g_database->getCursor(
 				"SELECT "
 					"CAST( printf( %Q, ( avg( `average` ) / %.6f ) +  %.6f ) AS REAL ) AS `value`, "
 					"CAST( printf( %Q, ( max( `max` ) / %.6f ) +  %.6f ) AS REAL ) AS `maximum`, "
 					"CAST( printf( %Q, ( min( `min` ) / %.6f ) +  %.6f ) AS REAL ) AS `minimum`, "
-					"CAST( strftime( '%%s', strftime( %Q, MAX( `date` ) ) ) AS INTEGER ) AS `timestamp`, "
-					"strftime( %Q, MAX( `date` ) ) AS `date` "
+					"CAST( strftime( '%%s', strftime( %Q, MAX( `timestamp` ), 'unixepoch' ) ) AS INTEGER ) AS `timestamp`, "
+					"strftime( %Q, MAX( `timestamp` ), 'unixepoch' ) AS `date` "
 				"FROM `device_level_trends` "
 				"WHERE `device_id` = %d "
-				"AND `date` >= datetime( 'now', '-%d %s', %s ) "
-				"GROUP BY strftime( %Q, `date` ) "
-				"ORDER BY `date` ASC ",
+				"AND `timestamp` >= CAST( strftime( '%%s', 'now', '-%d %s', %s ) AS INTEGER ) "
+				"GROUP BY strftime( %Q, `timestamp`, 'unixepoch' ) "
+				"ORDER BY `timestamp` ASC ",
 				format.c_str(),
 				divider,
 				offset,
@@ -459,7 +490,17 @@ namespace micasa {
 				start.c_str(),
 				groupFormat.c_str()
 			);
+			while ( cursor.next() ) {
+				result.push_back( {
+					{ "value", cursor.get<double>( 0 ) },
+					{ "maximum", cursor.get<double>( 1 ) },
+					{ "minimum", cursor.get<double>( 2 ) },
+					{ "timestamp", cursor.get<long>( 3 ) },
+					{ "date", cursor.get<const char*>( 4 ) }
+				} );
+			}
 		}
+		return result;
 	};
 
 	void Level::_processValue( const Device::UpdateSource& source_, const t_value& value_ ) {
@@ -481,37 +522,23 @@ namespace micasa {
 		}
 		if ( success && apply ) {
 			if ( this->m_enabled ) {
-				std::string date = "strftime( '%Y-%m-%d %H:', datetime( 'now' ) ) || CASE WHEN CAST( strftime( '%M',  datetime( 'now' ) ) AS INTEGER ) < 10 THEN '0' ELSE '' END || CAST( CAST( strftime( '%M', datetime( 'now' ) ) AS INTEGER ) / 5 * 5 AS TEXT ) || ':00'";
-				g_database->putQuery(
-					"REPLACE INTO `device_level_history` ( `device_id`, `date`, `value`, `samples` ) "
-					"VALUES ( "
-						"%d, "
-						"%s, "
-						"COALESCE( ( "
-							"SELECT printf( '%%.6f', ( ( `value` * `samples` ) + %.6f ) / ( `samples` + 1 ) ) "
-							"FROM `device_level_history` "
-							"WHERE `device_id` = %d "
-							"AND `date` = %s "
-						"), %.6f ), "
-						"COALESCE( ( "
-							"SELECT `samples` + 1 "
-							"FROM `device_level_history` "
-							"WHERE `device_id` = %d "
-							"AND `date` = %s "
-						"), 1 ) "
-					")",
-					this->m_id,
-					date.c_str(),
-					this->m_value,
-					this->m_id,
-					date.c_str(),
-					this->m_value,
-					this->m_id,
-					date.c_str()
-				);
+				// Samples are accumulated in the current 5 minute bucket, which is added to the trend of the current
+				// hour when the next bucket is started. The pending samples of the bucket are written to the history
+				// when the bucket is flushed by the history maintenance pipeline.
+				time_t now = system_clock::to_time_t( system_clock::now() );
+				std::lock_guard<std::mutex> lock( this->m_bucket.mutex );
+				this->_rollBucket( now );
+				if ( this->m_bucket.samples == 0 ) {
+					this->m_bucket.start = now - ( now % 300 );
+				}
+				this->m_bucket.sum += this->m_value;
+				this->m_bucket.samples++;
+				this->m_bucket.pendingSum += this->m_value;
+				this->m_bucket.pendingSamples++;
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_storeState( this->m_value, source_ );
 			if (
 				this->m_enabled
 				&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -524,51 +551,222 @@ namespace micasa {
 		}
 	};
 
-	void Level::_processTrends() const {
-		std::string hourFormat = "%Y-%m-%d %H:30:00";
-		std::string groupFormat = "%Y-%m-%d-%H";
-
-		auto trends = g_database->getQuery(
-			"SELECT MAX( `value` ) AS `max`, MIN( `value` ) AS `min`, AVG( `value` ) AS `average`, strftime( %Q, MAX( `date` ) ) AS `date` "
+	void Level::_loadBucket() {
+		// The bucket and the trend of the current hour are restored from the history, so that they are complete
+		// after a restart.
+		time_t now = system_clock::to_time_t( system_clock::now() );
+		std::lock_guard<std::mutex> lock( this->m_bucket.mutex );
+		this->m_bucket.start = now - ( now % 300 );
+		this->m_bucket.sum = 0;
+		this->m_bucket.samples = 0;
+		this->m_bucket.pendingSum = 0;
+		this->m_bucket.pendingSamples = 0;
+		this->m_bucket.trend.count = 0;
+		Database::Cursor cursor = g_database->getCursor(
+			"SELECT `timestamp`, `value`, `samples` "
 			"FROM `device_level_history` "
-			"WHERE `device_id` = %d AND `Date` > datetime( 'now','-5 hour' ) "
-			"GROUP BY strftime( %Q, `date` )",
-			hourFormat.c_str(),
+			"WHERE `device_id` = %d "
+			"AND `timestamp` >= %ld "
+			"ORDER BY `timestamp` ASC",
 			this->m_id,
-			groupFormat.c_str()
+			static_cast<long>( now - ( now % 3600 ) )
 		);
-		// NOTE the first group is skipped because the select query starts somewhere in the middle of the interval and
-		// the diff value is therefore incorrect.
-		for ( auto trendsIt = trends.begin(); trendsIt != trends.end(); trendsIt++ ) {
-			if ( trendsIt != trends.begin() ) {
-				g_database->putQuery(
-					"REPLACE INTO `device_level_trends` ( `device_id`, `min`, `max`, `average`, `date` ) "
-					"VALUES ( %d, %.6f, %.6f, %.6f, %Q )",
-					this->m_id,
-					std::stod( (*trendsIt)["min"] ),
-					std::stod( (*trendsIt)["max"] ),
-					std::stod( (*trendsIt)["average"] ),
-					(*trendsIt)["date"].c_str()
-				);
+		while ( cursor.next() ) {
+			if ( cursor.get<long>( 0 ) >= this->m_bucket.start ) {
+				this->m_bucket.samples = cursor.get<unsigned long>( 2 );
+				this->m_bucket.sum = cursor.get<double>( 1 ) * this->m_bucket.samples;
+			} else {
+				if ( this->m_bucket.trend.count == 0 ) {
+					this->m_bucket.trend.start = now - ( now % 3600 );
+				}
+				Level::_addToTrend( this->m_bucket.trend, cursor.get<double>( 1 ) );
 			}
 		}
 	};
 
-	void Level::_purgeHistoryAndTrends() const {
-		g_database->putQuery(
-			"DELETE FROM `device_level_history` "
-			"WHERE `device_id` = %d "
-			"AND `date` < datetime( 'now','-%d day' )",
+	void Level::_rollBucket( time_t now_ ) const {
+		// NOTE the bucket mutex should be held by the caller.
+		if (
+			this->m_bucket.samples > 0
+			&& this->m_bucket.start + 300 <= now_
+		) {
+			this->_writeBucket( false );
+			time_t hour = this->m_bucket.start - ( this->m_bucket.start % 3600 );
+			if (
+				this->m_bucket.trend.count > 0
+				&& this->m_bucket.trend.start != hour
+			) {
+				this->_writeTrend( this->m_bucket.trend, false );
+				this->m_bucket.trend.count = 0;
+			}
+			if ( this->m_bucket.trend.count == 0 ) {
+				this->m_bucket.trend.start = hour;
+			}
+			Level::_addToTrend( this->m_bucket.trend, this->m_bucket.sum / this->m_bucket.samples );
+			this->m_bucket.sum = 0;
+			this->m_bucket.samples = 0;
+		}
+		if (
+			this->m_bucket.trend.count > 0
+			&& this->m_bucket.trend.start + 3600 <= now_
+		) {
+			this->_writeTrend( this->m_bucket.trend, false );
+			this->m_bucket.trend.count = 0;
+		}
+	};
+
+	void Level::_flushBucket( bool final_ ) const {
+		std::lock_guard<std::mutex> lock( this->m_bucket.mutex );
+		this->_rollBucket( system_clock::to_time_t( system_clock::now() ) );
+		this->_writeBucket( final_ );
+		if ( final_ ) {
+			// The trend of the current hour is written including the current bucket. It's restored from the history
+			// if the device is started again.
+			t_trend trend = this->m_bucket.trend;
+			if ( this->m_bucket.samples > 0 ) {
+				if ( trend.count == 0 ) {
+					trend.start = this->m_bucket.start - ( this->m_bucket.start % 3600 );
+				}
+				Level::_addToTrend( trend, this->m_bucket.sum / this->m_bucket.samples );
+			}
+			if ( trend.count > 0 ) {
+				this->_writeTrend( trend, true );
+			}
+		}
+	};
+
+	void Level::_writeBucket( bool wait_ ) const {
+		// NOTE the bucket mutex should be held by the caller.
+		if ( this->m_bucket.pendingSamples == 0 ) {
+			return;
+		}
+
+		// The bucket might have been flushed before, in which case the samples are merged with the existing row.
+		g_database->queueQuery(
+			wait_ ? Database::Durability::COMMITTED : Database::Durability::QUEUED,
+			"device_level_history",
+			"INSERT INTO `device_level_history` ( `device_id`, `timestamp`, `value`, `samples` ) "
+			"VALUES ( ?1, ?2, ?3 / ?4, ?4 ) "
+			"ON CONFLICT( `device_id`, `timestamp` ) DO UPDATE SET "
+				"`value` = ( ( `value` * `samples` ) + ?3 ) / ( `samples` + ?4 ), "
+				"`samples` = `samples` + ?4",
 			this->m_id,
-			this->m_settings->get<int>( "history_retention", DEVICE_LEVEL_DEFAULT_HISTORY_RETENTION )
+			static_cast<long>( this->m_bucket.start ),
+			this->m_bucket.pendingSum,
+			this->m_bucket.pendingSamples
 		);
-		g_database->putQuery(
-			"DELETE FROM `device_level_trends` "
-			"WHERE `device_id` = %d "
-			"AND `date` < datetime( 'now','-%d month' )",
+		this->m_bucket.pendingSum = 0;
+		this->m_bucket.pendingSamples = 0;
+	};
+
+	void Level::_writeTrend( const t_trend& trend_, bool wait_ ) const {
+		g_database->queueQuery(
+			wait_ ? Database::Durability::COMMITTED : Database::Durability::QUEUED,
+			"device_level_trends",
+			"REPLACE INTO `device_level_trends` ( `device_id`, `min`, `max`, `average`, `timestamp` ) "
+			"VALUES ( ?, ?, ?, ?, ? )",
 			this->m_id,
-			this->m_settings->get<int>( "trends_retention", DEVICE_LEVEL_DEFAULT_TRENDS_RETENTION )
+			trend_.min,
+			trend_.max,
+			trend_.sum / trend_.count,
+			static_cast<long>( trend_.start + 1800 )
+		);
+	};
+
+	void Level::_addToTrend( t_trend& trend_, double value_ ) {
+		// The trend of an hour is made up of the averages of its 5 minute buckets.
+		if ( trend_.count == 0 ) {
+			trend_.min = trend_.max = value_;
+			trend_.sum = 0;
+		} else {
+			trend_.min = std::min( trend_.min, value_ );
+			trend_.max = std::max( trend_.max, value_ );
+		}
+		trend_.sum += value_;
+		trend_.count++;
+	};
+
+	Maintenance::t_deferredFunc Level::_flushHistory( const std::vector<const Device*>& devices_ ) {
+		for ( auto const& device : devices_ ) {
+			static_cast<const Level*>( device )->_flushBucket( false );
+		}
+		return nullptr;
+	};
+
+	unsigned int Level::checkTrends() {
+		// The expected trends are computed with the query that _processTrends used before the trends were maintained
+		// incrementally, but over the complete history instead of the last five hours. As it did then, the first hour
+		// of each device is skipped, because a purge might have removed the start of it.
+		std::map<std::pair<unsigned int, long>, std::vector<double>> trends;
+		std::map<unsigned int, long> skipped;
+		{
+			Database::Cursor cursor = g_database->getCursor(
+				"SELECT `device_id`, ( `timestamp` / 3600 ) * 3600 + 1800 AS `hour`, MIN( `value` ), MAX( `value` ), AVG( `value` ) "
+				"FROM `device_level_history` "
+				"GROUP BY `device_id`, `hour` "
+				"ORDER BY `device_id`, `hour`"
+			);
+			while ( cursor.next() ) {
+				if ( skipped.find( cursor.get<unsigned int>( 0 ) ) == skipped.end() ) {
+					skipped[cursor.get<unsigned int>( 0 )] = cursor.get<long>( 1 );
+				} else {
+					trends[{ cursor.get<unsigned int>( 0 ), cursor.get<long>( 1 ) }] = { cursor.get<double>( 2 ), cursor.get<double>( 3 ), cursor.get<double>( 4 ) };
+				}
+			}
+		}
+
+		// Every stored trend within the history of its device should match the expected trend, and every expected
+		// trend should have been stored. Older trends are kept longer than the history and can't be checked.
+		unsigned int checked = 0;
+		unsigned int differences = 0;
+		Database::Cursor cursor = g_database->getCursor(
+			"SELECT `device_id`, `timestamp`, `min`, `max`, `average` "
+			"FROM `device_level_trends` "
+			"ORDER BY `device_id`, `timestamp`"
 		);
+		while ( cursor.next() ) {
+			auto skip = skipped.find( cursor.get<unsigned int>( 0 ) );
+			if (
+				skip == skipped.end()
+				|| cursor.get<long>( 1 ) <= skip->second
+			) {
+				continue;
+			}
+			auto find = trends.find( { cursor.get<unsigned int>( 0 ), cursor.get<long>( 1 ) } );
+			if (
+				find == trends.end()
+				|| ! compareDouble( find->second[0], cursor.get<double>( 2 ) )
+				|| ! compareDouble( find->second[1], cursor.get<double>( 3 ) )
+				|| ! compareDouble( find->second[2], cursor.get<double>( 4 ) )
+			) {
+				Logger::logr( Logger::LogLevel::WARNING, "Level", "Trend of device %d at %ld differs.", cursor.get<unsigned int>( 0 ), cursor.get<long>( 1 ) );
+				differences++;
+			}
+			if ( find != trends.end() ) {
+				trends.erase( find );
+			}
+			checked++;
+		}
+		for ( auto const& trend : trends ) {
+			Logger::logr( Logger::LogLevel::WARNING, "Level", "Trend of device %d at %ld is missing.", trend.first.first, trend.first.second );
+			differences++;
+			checked++;
+		}
+		Logger::logr( Logger::LogLevel::NORMAL, "Level", "Checked %u trends, %u differ.", checked, differences );
+		return differences;
+	};
+
+	Maintenance::t_deferredFunc Level::_purgeHistoryAndTrends( const std::vector<const Device*>& devices_ ) {
+		std::string history = Maintenance::getRetentionCondition( devices_, "day", []( const Device* device_ ) {
+			return device_->getSettings()->get<int>( "history_retention", DEVICE_LEVEL_DEFAULT_HISTORY_RETENTION );
+		} );
+		std::string trends = Maintenance::getRetentionCondition( devices_, "month", []( const Device* device_ ) {
+			return device_->getSettings()->get<int>( "trends_retention", DEVICE_LEVEL_DEFAULT_TRENDS_RETENTION );
+		} );
+		return [history,trends]() {
+			Maintenance::purge( "device_level_history", history );
+			Maintenance::purge( "device_level_trends", trends );
+		};
 	};
 
 }; // namespace micasa
@@ -0,0 +1,178 @@
+#ifdef _DEBUG
+	#include <cassert>
+#endif // _DEBUG
+
+#include "Maintenance.h"
+
+#include "../Device.h"
+#include "../Database.h"
+#include "../Utils.h"
+#include "../Logger.h"
+
+namespace micasa {
+
+	extern std::unique_ptr<Database> g_database;
+
+	Maintenance::Maintenance( const std::string& label_, const unsigned long interval_, t_passFunc&& func_ ) :
+		m_interval( interval_ ),
+		m_func( std::move( func_ ) ),
+		m_scheduler( label_, Scheduler::Priority::BACKGROUND ),
+		m_size( 0 ),
+		m_slot( 0 )
+	{
+	};
+
+	Maintenance::~Maintenance() {
+#ifdef _DEBUG
+		assert( this->m_size == 0 && "All devices should be removed when Maintenance is destructed." );
+#endif // _DEBUG
+	};
+
+	void Maintenance::add( const Device* device_ ) {
+		std::lock_guard<std::mutex> lock( this->m_slotsMutex );
+		if ( this->m_slots[randomNumber( 0, DEVICE_MAINTENANCE_SLOTS - 1 )].insert( device_ ).second ) {
+			this->m_size++;
+		}
+
+		// The pipeline task is only running while there are devices to maintain. It visits one slot per run.
+		if ( ! this->m_task.lock() ) {
+			unsigned long delay = this->m_interval / DEVICE_MAINTENANCE_SLOTS;
+			this->m_task = this->m_scheduler.schedule( delay, delay, SCHEDULER_REPEAT_INFINITE, NULL, [this]( std::shared_ptr<Scheduler::Task<>> ) {
+				this->_pass();
+			} );
+		}
+	};
+
+	void Maintenance::remove( const Device* device_ ) {
+		// NOTE pass functions are run while holding the slots lock, so a device that has been removed is guaranteed
+		// to not be part of a running pass anymore. Deferred work only has a copy of the ids it needs.
+		std::unique_lock<std::mutex> lock( this->m_slotsMutex );
+		for ( unsigned int slot = 0; slot < DEVICE_MAINTENANCE_SLOTS; slot++ ) {
+			if ( this->m_slots[slot].erase( device_ ) > 0 ) {
+				this->m_size--;
+				break;
+			}
+		}
+		if ( this->m_size == 0 ) {
+			auto task = this->m_task.lock();
+			this->m_task.reset();
+			lock.unlock();
+			if ( task ) {
+				this->m_scheduler.erase( [task]( const Scheduler::BaseTask& task_ ) {
+					return &task_ == task.get();
+				} );
+			}
+		}
+	};
+
+	std::string Maintenance::getIds( const std::vector<const Device*>& devices_ ) {
+		std::vector<std::string> ids;
+		for ( auto const& device : devices_ ) {
+			ids.push_back( std::to_string( device->getId() ) );
+		}
+		return stringJoin( ids, ", " );
+	};
+
+	std::string Maintenance::getRetentionCondition( const std::vector<const Device*>& devices_, const std::string& unit_, std::function<int( const Device* )>&& retention_ ) {
+		// Devices are grouped by their retention, which is usually the default, so that the condition contains only a
+		// single term for the common case.
+		std::map<int, std::vector<const Device*>> groups;
+		for ( auto const& device : devices_ ) {
+			groups[retention_( device )].push_back( device );
+		}
+		std::vector<std::string> conditions;
+		for ( auto groupsIt = groups.begin(); groupsIt != groups.end(); groupsIt++ ) {
+			conditions.push_back( stringFormat( "( `device_id` IN ( %s ) AND `timestamp` < CAST( strftime( '%%s', 'now', '-%d %s' ) AS INTEGER ) )", Maintenance::getIds( groupsIt->second ).c_str(), groupsIt->first, unit_.c_str() ) );
+		}
+		return stringJoin( conditions, " OR " );
+	};
+
+	unsigned long Maintenance::purge( const std::string& table_, const std::string& condition_ ) {
+		// The expired rows are looked up on a read connection, so that the write transactions only need to delete a
+		// range of the (device_id, timestamp) key for each device in the chunk, which most history tables are
+		// clustered on. All rows of a device up to and including the last one in the chunk are expired. The pause
+		// after each chunk gives queued writes at least the same amount of time.
+		unsigned long purged = 0;
+		unsigned int chunks = 0;
+		unsigned int size = DEVICE_MAINTENANCE_PURGE_ROWS / 10;
+		while ( true ) {
+			unsigned int rows = 0;
+			std::map<unsigned int, long> ranges;
+			{
+				Database::Cursor cursor = g_database->getCursor(
+					"SELECT `device_id`, `timestamp` "
+					"FROM `%s` "
+					"WHERE %s "
+					"ORDER BY `device_id`, `timestamp` "
+					"LIMIT %u",
+					table_.c_str(),
+					condition_.c_str(),
+					size
+				);
+				while ( cursor.next() ) {
+					ranges[cursor.get<unsigned int>( 0 )] = cursor.get<long>( 1 );
+					rows++;
+				}
+			}
+			if ( rows == 0 ) {
+				break;
+			}
+
+			std::vector<std::string> conditions;
+			for ( auto const& range : ranges ) {
+				conditions.push_back( stringFormat( "( `device_id` = %u AND `timestamp` <= %ld )", range.first, range.second ) );
+			}
+			auto start = std::chrono::steady_clock::now();
+			g_database->transaction( [&table_,&conditions]() {
+				g_database->putQuery(
+					"DELETE FROM `%s` "
+					"WHERE %s",
+					table_.c_str(),
+					stringJoin( conditions, " OR " ).c_str()
+				);
+			} );
+			auto duration = std::chrono::steady_clock::now() - start;
+			purged += rows;
+			chunks++;
+
+			if ( rows < size ) {
+				break;
+			}
+			if ( duration > std::chrono::milliseconds( DEVICE_MAINTENANCE_PURGE_MSEC ) ) {
+				size = std::max( size / 2, 1U );
+			} else if (
+				duration < std::chrono::milliseconds( DEVICE_MAINTENANCE_PURGE_MSEC / 4 )
+				&& size < DEVICE_MAINTENANCE_PURGE_ROWS
+			) {
+				size = std::min( size * 2, (unsigned int)DEVICE_MAINTENANCE_PURGE_ROWS );
+			}
+			std::this_thread::sleep_for( duration );
+		}
+		if ( purged > 0 ) {
+			Logger::logr( Logger::LogLevel::VERBOSE, g_database.get(), "Purged %lu rows from %s in %u chunks.", purged, table_.c_str(), chunks );
+		}
+		return purged;
+	};
+
+	void Maintenance::_pass() {
+		t_deferredFunc deferred;
+		{
+			std::lock_guard<std::mutex> lock( this->m_slotsMutex );
+			const std::set<const Device*>& slot = this->m_slots[this->m_slot];
+			this->m_slot = ( this->m_slot + 1 ) % DEVICE_MAINTENANCE_SLOTS;
+			if ( slot.size() > 0 ) {
+				// NOTE passes are not run in a transaction, writes should either be queued or use short transactions
+				// of their own so they don't block the database writer for long.
+				deferred = this->m_func( std::vector<const Device*>( slot.begin(), slot.end() ) );
+			}
+		}
+
+		// Deferred work mostly waits for the database and pauses between chunks, so it doesn't hold the slots lock,
+		// which would block devices from being added or removed, and it doesn't count as running on the pool.
+		if ( deferred ) {
+			Scheduler::Blocking blocking;
+			deferred();
+		}
+	};
+
+}; // namespace micasa
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <set>
+#include <vector>
+#include <mutex>
+#include <functional>
+
+#include "../Scheduler.h"
+
+// The interval of a maintenance pipeline is divided into this many slots. Devices are assigned a random slot when they
+// are added and each slot is processed in a single pass, so the work is batched but still spread over the interval.
+#define DEVICE_MAINTENANCE_SLOTS 12
+
+// Expired rows are purged in chunks of at most this many rows, each in its own transaction. The size of the chunks is
+// adjusted so that a transaction, which blocks all other writes, takes no longer than this many milliseconds.
+#define DEVICE_MAINTENANCE_PURGE_ROWS 5000
+#define DEVICE_MAINTENANCE_PURGE_MSEC 50
+
+namespace micasa {
+
+	class Device;
+
+	// ===========
+	// Maintenance
+	// ===========
+
+	class Maintenance final {
+
+	public:
+		// The pass function is called with the slots lock held, so the devices it receives are guaranteed to be alive.
+		// Lengthy work that doesn't need the devices, such as purging, should be returned as a deferred function, which
+		// is run after the lock has been released.
+		typedef std::function<void()> t_deferredFunc;
+		typedef std::function<t_deferredFunc( const std::vector<const Device*>& devices_ )> t_passFunc;
+
+		Maintenance( const std::string& label_, const unsigned long interval_, t_passFunc&& func_ );
+		~Maintenance();
+
+		Maintenance( const Maintenance& ) = delete; // do not copy
+		Maintenance& operator=( const Maintenance& ) = delete; // do not copy-assign
+		Maintenance( const Maintenance&& ) = delete; // do not move
+		Maintenance& operator=( Maintenance&& ) = delete; // do not move-assign
+
+		void add( const Device* device_ );
+		void remove( const Device* device_ );
+
+		static std::string getIds( const std::vector<const Device*>& devices_ );
+		static std::string getRetentionCondition( const std::vector<const Device*>& devices_, const std::string& unit_, std::function<int( const Device* )>&& retention_ );
+		static unsigned long purge( const std::string& table_, const std::string& condition_ );
+
+	private:
+		const unsigned long m_interval;
+		const t_passFunc m_func;
+		Scheduler m_scheduler;
+		std::set<const Device*> m_slots[DEVICE_MAINTENANCE_SLOTS];
+		size_t m_size;
+		unsigned int m_slot;
+		std::weak_ptr<Scheduler::Task<>> m_task;
+		mutable std::mutex m_slotsMutex;
+
+		void _pass();
+
+	}; // class Maintenance
+
+}; // namespace micasa
@@ -6,6 +6,8 @@
 
 #include "../Scheduler.h"
 
+#include "Maintenance.h"
+
 namespace micasa {
 
 	class Switch final : public Device {
@@ -53,7 +55,7 @@ namespace micasa {
 		typedef std::string t_value;
 		static const Device::Type type;
 
-		Switch( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ );
+		Switch( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Device::Hydration* hydration_ );
 
 		void updateValue( Device::UpdateSource source_, Option value_ );
 		void updateValue( Device::UpdateSource source_, t_value value_ );
@@ -68,6 +70,8 @@ namespace micasa {
 		nlohmann::json getSettingsJson() const override;
 
 	private:
+		static Maintenance g_purgeMaintenance;
+
 		Option m_value;
 		Device::UpdateSource m_source;
 		std::chrono::system_clock::time_point m_updated;
@@ -78,7 +82,7 @@ namespace micasa {
 		} m_rateLimiter;
 
 		void _processValue( const Device::UpdateSource& source_, const Option& value_ );
-		void _purgeHistory() const;
+		static Maintenance::t_deferredFunc _purgeHistory( const std::vector<const Device*>& devices_ );
 
 	}; // class Switch
 
@@ -18,30 +18,39 @@ namespace micasa {
 
 	const Device::Type Text::type = Device::Type::TEXT;
 
+	Maintenance Text::g_purgeMaintenance( "Text Purge", SCHEDULER_INTERVAL_1HOUR, Text::_purgeHistory );
+
 	const std::map<Text::SubType, std::string> Text::SubTypeText = {
 		{ Text::SubType::GENERIC, "generic" },
 		{ Text::SubType::WIND_DIRECTION, "wind_direction" },
 		{ Text::SubType::NOTIFICATION, "notification" }
 	};
 
-	Text::Text( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ ) :
-		Device( plugin_, id_, reference_, label_, enabled_ ),
+	Text::Text( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Device::Hydration* hydration_ ) :
+		Device( plugin_, id_, reference_, label_, enabled_, hydration_ ),
 		m_value( "" ),
+		m_source( Device::resolveUpdateSource( 0 ) ),
 		m_updated( system_clock::now() ),
 		m_rateLimiter( { "", Device::resolveUpdateSource( 0 ) } )
 	{
-		try {
-			json result = g_database->getQueryRow<json>(
-				"SELECT `value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `age` "
-				"FROM `device_text_history` "
-				"WHERE `device_id` = %d "
-				"ORDER BY `date` DESC "
-				"LIMIT 1",
-				this->m_id
-			);
-			this->m_value = this->m_rateLimiter.value = jsonGet<std::string>( result, "value" );
-			this->m_updated = system_clock::now() - seconds( jsonGet<unsigned int>( result, "age" ) );
-		} catch( const Database::NoResultsException& ex_ ) {
+		json last;
+		if ( hydration_ != nullptr ) {
+			last = hydration_->last;
+		} else {
+			try {
+				last = g_database->getQueryRow<json>(
+					"SELECT `value`, CAST( strftime( '%%s', 'now' ) AS INTEGER ) - `timestamp` AS `age`, `source` "
+					"FROM `device_state` "
+					"WHERE `device_id` = %d",
+					this->m_id
+				);
+			} catch( const Database::NoResultsException& ex_ ) { /* no state */ }
+		}
+		if ( ! last.is_null() ) {
+			this->m_value = this->m_rateLimiter.value = jsonGet<std::string>( last, "value" );
+			this->m_updated = system_clock::now() - seconds( jsonGet<unsigned int>( last, "age" ) );
+			this->m_source = Device::resolveUpdateSource( jsonGet<unsigned int>( last, "source" ) );
+		} else {
 			Logger::log( Logger::LogLevel::DEBUG, this, "No starting value." );
 		}
 	};
@@ -50,15 +59,14 @@ namespace micasa {
 #ifdef _DEBUG
 		assert( this->m_enabled && "Device needs to be enabled while being started." );
 #endif // _DEBUG
-		this->m_scheduler.schedule( randomNumber( 0, SCHEDULER_INTERVAL_1HOUR ), SCHEDULER_INTERVAL_1HOUR, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
-			this->_purgeHistory();
-		} );
+		Text::g_purgeMaintenance.add( this );
 	};
 
 	void Text::stop() {
 #ifdef _DEBUG
 		assert( this->m_enabled && "Device needs to be enabled while being stopped." );
 #endif // _DEBUG
+		Text::g_purgeMaintenance.remove( this );
 		this->m_scheduler.erase( [this]( const Scheduler::BaseTask& task_ ) {
 			return task_.data == this;
 		} );
@@ -188,16 +196,24 @@ namespace micasa {
 			interval = "day";
 			range_ *= 7;
 		}
-		return g_database->getQuery<json>(
-			"SELECT `value`, CAST( strftime( '%%s', `date` ) AS INTEGER ) AS `timestamp` "
+		json result = json::array();
+		Database::Cursor cursor = g_database->getCursor(
+			"SELECT `value`, `timestamp` "
 			"FROM `device_text_history` "
 			"WHERE `device_id` = %d "
-			"AND `date` >= datetime( 'now', '-%d %s' ) "
-			"ORDER BY `date` ASC ",
+			"AND `timestamp` >= CAST( strftime( '%%s', 'now', '-%d %s' ) AS INTEGER ) "
+			"ORDER BY `timestamp` ASC ",
 			this->m_id,
 			range_,
 			interval.c_str()
 		);
+		while ( cursor.next() ) {
+			result.push_back( {
+				{ "value", cursor.get<const char*>( 0 ) },
+				{ "timestamp", cursor.get<long>( 1 ) }
+			} );
+		}
+		return result;
 	};
 
 	void Text::_processValue( const Device::UpdateSource& source_, const t_value& value_ ) {
@@ -222,15 +238,19 @@ namespace micasa {
 				this->m_enabled
 				&& previous != value_
 			) {
-				g_database->putQuery(
-					"INSERT INTO `device_text_history` ( `device_id`, `value` ) "
-					"VALUES ( %d, %Q )",
+				g_database->queueQuery(
+					Database::Durability::QUEUED,
+					"device_text_history",
+					"INSERT INTO `device_text_history` ( `device_id`, `value`, `timestamp` ) "
+					"VALUES ( ?, ?, ? )",
 					this->m_id,
-					this->m_value.c_str()
+					this->m_value,
+					system_clock::to_time_t( system_clock::now() )
 				);
 			}
 			this->m_source = source_;
 			this->m_updated = system_clock::now();
+			this->_storeState( this->m_value, source_ );
 			if (
 				this->m_enabled
 				&& this->getPlugin()->getState() >= Plugin::State::READY
@@ -243,14 +263,13 @@ namespace micasa {
 		}
 	};
 
-	void Text::_purgeHistory() const {
-		g_database->putQuery(
-			"DELETE FROM `device_text_history` "
-			"WHERE `device_id` = %d "
-			"AND `date` < datetime( 'now','-%d day' )",
-			this->m_id,
-			this->m_settings->get<int>( "history_retention", DEVICE_TEXT_DEFAULT_HISTORY_RETENTION )
-		);
+	Maintenance::t_deferredFunc Text::_purgeHistory( const std::vector<const Device*>& devices_ ) {
+		std::string history = Maintenance::getRetentionCondition( devices_, "day", []( const Device* device_ ) {
+			return device_->getSettings()->get<int>( "history_retention", DEVICE_TEXT_DEFAULT_HISTORY_RETENTION );
+		} );
+		return [history]() {
+			Maintenance::purge( "device_text_history", history );
+		};
 	};
 
 }; // namespace micasa
@@ -5,6 +5,8 @@
 
 #include "../Scheduler.h"
 
+#include "Maintenance.h"
+
 namespace micasa {
 
 	class Text final : public Device {
@@ -21,7 +23,7 @@ namespace micasa {
 		typedef std::string t_value;
 		static const Device::Type type;
 
-		Text( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_ );
+		Text( std::weak_ptr<Plugin> plugin_, const unsigned int id_, const std::string reference_, std::string label_, bool enabled_, const Device::Hydration* hydration_ );
 
 		void updateValue( Device::UpdateSource source_, t_value value_ );
 		t_value getValue() const { return this->m_value; };
@@ -34,6 +36,8 @@ namespace micasa {
 		nlohmann::json getSettingsJson() const override;
 
 	private:
+		static Maintenance g_purgeMaintenance;
+
 		t_value m_value;
 		Device::UpdateSource m_source;
 		std::chrono::system_clock::time_point m_updated;
@@ -44,7 +48,7 @@ namespace micasa {
 		} m_rateLimiter;
 
 		void _processValue( const Device::UpdateSource& source_, const t_value& value_ );
-		void _purgeHistory() const;
+		static Maintenance::t_deferredFunc _purgeHistory( const std::vector<const Device*>& devices_ );
 
 	}; // class Text
 
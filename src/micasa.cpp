@@ -10,6 +10,8 @@
 #include "Controller.h"
 #include "Settings.h"
 #include "Scheduler.h"
+#include "device/Level.h"
+#include "device/Counter.h"
 
 namespace micasa {
 
@@ -19,13 +21,17 @@ namespace micasa {
 	std::unique_ptr<Controller> g_controller;
 
 	const char g_usage[] =
-		"Usage: micasa [-p|--port <port>] [-sslp|--sslport <port>] [-l|--loglevel <loglevel>]\n"
+		"Usage: micasa [-p|--port <port>] [-sslp|--sslport <port>] [-l|--loglevel <loglevel>] [-t|--threads <min>[:<max>]] [-s|--stacksize <kb>] [-w|--writes <msec>[:<rows>]] [--check-trends]\n"
 		"\t-p|--port <port>\n\t\tSets the port for web connections (defaults to 80).\n"
 		"\t-sslp|--sslport <port>\n\t\tSets the port for secure web connections (defaults to no ssl).\n"
 		"\t-l|--loglevel <loglevel>\n\t\tSets the level of logging:\n"
 		"\t\t\t0 = default\n"
 		"\t\t\t1 = verbose\n"
 		"\t\t\t99 = debug\n"
+		"\t-t|--threads <min>[:<max>]\n\t\tSets the minimum and maximum number of scheduler threads (defaults to 2 and 4 per cpu core with a minimum of 8).\n"
+		"\t-s|--stacksize <kb>\n\t\tSets the stack size of scheduler threads in kilobytes (defaults to 1024).\n"
+		"\t-w|--writes <msec>[:<rows>]\n\t\tSets the interval and the maximum number of rows of a batch of queued database writes (defaults to 1000 and 500).\n"
+		"\t--check-trends\n\t\tCompares the stored trends with the trends computed from the recorded history by sql and exits.\n"
 	;
 
 	static volatile bool g_shutdown = false;
@@ -77,6 +83,35 @@ int main( int argc_, char* argv_[] ) {
 	}
 	auto logger = Logger::addReceiver<ConsoleLogger>( logLevel );
 
+	std::string threads = "0";
+	if ( arguments.exists( "-t" ) ) {
+		threads = arguments.get( "-t" );
+	} else if ( arguments.exists( "--threads" ) ) {
+		threads = arguments.get( "--threads" );
+	}
+	size_t stackSize = 0;
+	if ( arguments.exists( "-s" ) ) {
+		stackSize = 1024 * atoi( arguments.get( "-s" ).c_str() );
+	} else if ( arguments.exists( "--stacksize" ) ) {
+		stackSize = 1024 * atoi( arguments.get( "--stacksize" ).c_str() );
+	}
+	size_t separator = threads.find( ':' );
+	Scheduler::configure(
+		atoi( threads.substr( 0, separator ).c_str() ),
+		separator == std::string::npos ? 0 : atoi( threads.substr( separator + 1 ).c_str() ),
+		stackSize
+	);
+
+	std::string writes = "0";
+	if ( arguments.exists( "-w" ) ) {
+		writes = arguments.get( "-w" );
+	} else if ( arguments.exists( "--writes" ) ) {
+		writes = arguments.get( "--writes" );
+	}
+	separator = writes.find( ':' );
+	unsigned int writeInterval = atoi( writes.substr( 0, separator ).c_str() );
+	unsigned int writeBatchSize = separator == std::string::npos ? 0 : atoi( writes.substr( separator + 1 ).c_str() );
+
 	// See if the datadir is read- and writable.
 	struct stat info;
 	if (
@@ -93,7 +128,15 @@ int main( int argc_, char* argv_[] ) {
 	sigaction( SIGINT, &action, NULL );
 	sigaction( SIGTERM, &action, NULL );
 
-	g_database = std::unique_ptr<Database>( new Database );
+	g_database = std::unique_ptr<Database>( new Database( writeInterval, writeBatchSize ) );
+
+	if ( arguments.exists( "--check-trends" ) ) {
+		// The trends are checked against the complete history, so a pending migration is finished first.
+		while ( ! g_database->migrate() ) { }
+		unsigned int differences = Level::checkTrends() + Counter::checkTrends();
+		g_database = nullptr;
+		return differences == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
 	// The database might take some time to initialize (due to the VACUUM call). An additional shutdown check is done.
 	if ( ! g_shutdown ) {
@@ -8,9 +8,14 @@
 #include "../Database.h"
 #include "../device/Level.h"
 #include "../device/Counter.h"
+#include "../device/Text.h"
+
+#include "json.hpp"
 
 namespace micasa {
 
+	using namespace nlohmann;
+
 	extern std::unique_ptr<Database> g_database;
 
 	const char* System::label = "System";
@@ -18,8 +23,9 @@ namespace micasa {
 	void System::start() {
 		Logger::log( Logger::LogLevel::VERBOSE, this, "Starting..." );
 		Plugin::start();
+		g_database->setSlowQueryThreshold( this->m_settings->get<unsigned int>( "slow_query_threshold", SYSTEM_DEFAULT_SLOW_QUERY_THRESHOLD ) );
 		this->setState( Plugin::State::READY );
-		this->m_scheduler.schedule( SCHEDULER_INTERVAL_1MIN, SCHEDULER_INTERVAL_1MIN, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
+		this->m_scheduler.schedule( Scheduler::Priority::BACKGROUND, SCHEDULER_INTERVAL_1MIN, SCHEDULER_INTERVAL_1MIN, SCHEDULER_REPEAT_INFINITE, this, [this]( std::shared_ptr<Scheduler::Task<>> ) {
 			this->declareDevice<Level>( "network_connections", "Network Connections", {
 				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
 				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
@@ -30,13 +36,16 @@ namespace micasa {
 				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
 				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
 				{ DEVICE_SETTING_DEFAULT_UNIT,           Level::resolveTextUnit( Level::Unit::GENERIC ) }
-			} )->updateValue( Device::UpdateSource::PLUGIN, Scheduler::ThreadPool::get().m_tasks.size() );
+			} )->updateValue( Device::UpdateSource::PLUGIN, Scheduler::ThreadPool::get().size() );
 
 			this->declareDevice<Counter>( "database_queries", "Database Queries", {
 				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
 				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Counter::resolveTextSubType( Counter::SubType::GENERIC ) },
 				{ DEVICE_SETTING_DEFAULT_UNIT,           Counter::resolveTextUnit( Counter::Unit::GENERIC ) }
 			} )->updateValue( Device::UpdateSource::PLUGIN, g_database->m_queries );
+
+			this->_processStatistics();
+			this->_processDatabaseStatistics();
 		} );
 	};
 
@@ -45,9 +54,119 @@ namespace micasa {
 		this->m_scheduler.erase( [this]( const Scheduler::BaseTask& task_ ) {
 			return task_.data == this;
 		} );
+		g_database->setSlowQueryThreshold( 0 );
 		Plugin::stop();
 	};
 
+	json System::getSettingsJson() const {
+		json result = Plugin::getSettingsJson();
+		for ( auto &&setting : System::getEmptySettingsJson( true ) ) {
+			result.push_back( setting );
+		}
+		return result;
+	};
+
+	json System::getEmptySettingsJson( bool advanced_ ) {
+		json result = json::array();
+		result += {
+			{ "name", "slow_query_threshold" },
+			{ "label", "Slow Query Threshold" },
+			{ "description", "Database queries that take longer than this amount of milliseconds are logged as a warning. Use 0 to disable." },
+			{ "type", "int" },
+			{ "minimum", 0 },
+			{ "default", SYSTEM_DEFAULT_SLOW_QUERY_THRESHOLD },
+			{ "class", advanced_ ? "advanced" : "normal" },
+			{ "sort", 98 }
+		};
+		return result;
+	};
+
+	void System::_processStatistics() {
+		unsigned long long executed = 0;
+		unsigned long long delay = 0;
+		unsigned long long runtime = 0;
+		unsigned int active = 0;
+		std::map<std::string, unsigned long long> runtimes;
+		std::string busiest = "";
+		unsigned long long busiestRuntime = 0;
+		for ( auto const &statistics : Scheduler::getAllStatistics() ) {
+			executed += statistics.executed;
+			delay += statistics.delay;
+			runtime += statistics.runtime;
+			active += statistics.active;
+			runtimes[statistics.label] += statistics.runtime;
+
+			// The owner that spent the most time running tasks since the previous run is reported, which is usually
+			// the one stalling the pool.
+			auto find = this->m_previousStatistics.runtimes.find( statistics.label );
+			unsigned long long interval = statistics.runtime - ( find != this->m_previousStatistics.runtimes.end() ? std::min( find->second, statistics.runtime ) : 0 );
+			if ( interval > busiestRuntime ) {
+				busiest = statistics.label;
+				busiestRuntime = interval;
+			}
+		}
+
+		// Schedulers come and go, so the pool wide totals might decrease.
+		unsigned long long executedInterval = executed - std::min( executed, this->m_previousStatistics.executed );
+		unsigned long long delayInterval = delay - std::min( delay, this->m_previousStatistics.delay );
+		unsigned long long runtimeInterval = runtime - std::min( runtime, this->m_previousStatistics.runtime );
+		this->m_previousStatistics = { executed, delay, runtime, runtimes };
+
+		this->declareDevice<Level>( "active_tasks", "Active Tasks", {
+			{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
+			{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
+			{ DEVICE_SETTING_DEFAULT_UNIT,           Level::resolveTextUnit( Level::Unit::GENERIC ) }
+		} )->updateValue( Device::UpdateSource::PLUGIN, active );
+
+		if ( executedInterval > 0 ) {
+			this->declareDevice<Level>( "task_delay", "Task Delay", {
+				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
+				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
+				{ DEVICE_SETTING_DEFAULT_UNIT,           Level::resolveTextUnit( Level::Unit::MILLISECONDS ) }
+			} )->updateValue( Device::UpdateSource::PLUGIN, delayInterval / ( 1000. * executedInterval ) );
+
+			this->declareDevice<Level>( "task_runtime", "Task Run Time", {
+				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
+				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
+				{ DEVICE_SETTING_DEFAULT_UNIT,           Level::resolveTextUnit( Level::Unit::MILLISECONDS ) }
+			} )->updateValue( Device::UpdateSource::PLUGIN, runtimeInterval / ( 1000. * executedInterval ) );
+		}
+
+		if ( busiestRuntime > 0 ) {
+			this->declareDevice<Text>( "busiest_task_owner", "Busiest Task Owner", {
+				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
+				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Text::resolveTextSubType( Text::SubType::GENERIC ) }
+			} )->updateValue( Device::UpdateSource::PLUGIN, stringFormat( "%s (%.1f ms)", busiest.c_str(), busiestRuntime / 1000. ) );
+		}
+	};
+
+	void System::_processDatabaseStatistics() {
+		unsigned long long readAcquisitions = g_database->m_readAcquisitions;
+		unsigned long long readWait = g_database->m_readWait;
+		unsigned long long writeAcquisitions = g_database->m_writeAcquisitions;
+		unsigned long long writeWait = g_database->m_writeWait;
+		unsigned long long readInterval = readAcquisitions - this->m_previousDatabaseStatistics.readAcquisitions;
+		unsigned long long writeInterval = writeAcquisitions - this->m_previousDatabaseStatistics.writeAcquisitions;
+
+		// The average time a query had to wait for a connection during the last interval.
+		if ( readInterval > 0 ) {
+			this->declareDevice<Level>( "database_read_wait", "Database Read Wait", {
+				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
+				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
+				{ DEVICE_SETTING_DEFAULT_UNIT,           Level::resolveTextUnit( Level::Unit::MILLISECONDS ) }
+			} )->updateValue( Device::UpdateSource::PLUGIN, ( readWait - this->m_previousDatabaseStatistics.readWait ) / ( 1000. * readInterval ) );
+		}
+		if ( writeInterval > 0 ) {
+			this->declareDevice<Level>( "database_write_wait", "Database Write Wait", {
+				{ DEVICE_SETTING_ALLOWED_UPDATE_SOURCES, Device::resolveUpdateSource( Device::UpdateSource::PLUGIN ) },
+				{ DEVICE_SETTING_DEFAULT_SUBTYPE,        Level::resolveTextSubType( Level::SubType::GENERIC ) },
+				{ DEVICE_SETTING_DEFAULT_UNIT,           Level::resolveTextUnit( Level::Unit::MILLISECONDS ) }
+			} )->updateValue( Device::UpdateSource::PLUGIN, ( writeWait - this->m_previousDatabaseStatistics.writeWait ) / ( 1000. * writeInterval ) );
+		}
+
+		this->m_previousDatabaseStatistics = { readAcquisitions, readWait, writeAcquisitions, writeWait };
+	};
+
 	bool System::updateDevice( const Device::UpdateSource& source_, std::shared_ptr<Device> device_, bool owned_, bool& apply_ ) {
 		if ( owned_ ) {
 		}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <map>
+
 #include "../Plugin.h"
 
+#define SYSTEM_DEFAULT_SLOW_QUERY_THRESHOLD 250 // msec
+
 namespace micasa {
 
 	class System final : public Plugin {
@@ -9,15 +13,36 @@ namespace micasa {
 	public:
 		static const char* label;
 
-		System( const unsigned int id_, const Plugin::Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_ ) : Plugin( id_, type_, reference_, parent_ ) { };
+		System( const unsigned int id_, const Plugin::Type type_, const std::string reference_, const std::shared_ptr<Plugin> parent_ ) : Plugin( id_, type_, reference_, parent_ ), m_previousStatistics( { 0, 0, 0, { } } ), m_previousDatabaseStatistics( { 0, 0, 0, 0 } ) { };
 		~System() { };
 
 		void start() override;
 		void stop() override;
 
 		std::string getLabel() const override { return System::label; };
+		nlohmann::json getSettingsJson() const override;
+		static nlohmann::json getEmptySettingsJson( bool advanced_ = false );
 		bool updateDevice( const Device::UpdateSource& source_, std::shared_ptr<Device> device_, bool owned_, bool& apply_ ) override;
 
+	private:
+		// The scheduler counters only ever increase, so the totals of the previous run are kept to report the
+		// values of the last interval.
+		struct {
+			unsigned long long executed;
+			unsigned long long delay;
+			unsigned long long runtime;
+			std::map<std::string, unsigned long long> runtimes;
+		} m_previousStatistics;
+		struct {
+			unsigned long long readAcquisitions;
+			unsigned long long readWait;
+			unsigned long long writeAcquisitions;
+			unsigned long long writeWait;
+		} m_previousDatabaseStatistics;
+
+		void _processStatistics();
+		void _processDatabaseStatistics();
+
 	}; // class System
 
 }; // namespace micasa